@@ -0,0 +1,133 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "interval.h"
+
+#include <algorithm>
+
+class aabb {
+  public:
+    interval x, y, z;
+
+    aabb() {}; // empty by default, since intervals are empty by default
+
+    aabb(const interval &x, const interval &y, const interval &z)
+        : x(x), y(y), z(z) {
+        pad_to_minimums();
+    };
+
+    aabb(const point3 &a, const point3 &b) {
+        // Treat the two points a and b as extrema for the bounding box
+        x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+        y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+        z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+
+        pad_to_minimums();
+    };
+
+    aabb(const aabb &box0, const aabb &box1)
+        : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {};
+
+    const interval &axis_interval(int n) const {
+        if (n == 1)
+            return y;
+        if (n == 2)
+            return z;
+
+        return x;
+    }
+
+    bool hit(const ray &r, interval ray_t) const {
+        const point3 &ray_orig = r.origin();
+        const vec3 &ray_dir = r.direction();
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval &ax = axis_interval(axis);
+            const real adinv = 1 / ray_dir[axis];
+
+            auto t0 = (ax.min - ray_orig[axis]) * adinv;
+            auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+            if (t0 > t1)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min)
+                ray_t.min = t0;
+            if (t1 < ray_t.max)
+                ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+
+        return true;
+    }
+
+    real hit_distance(const point3 &orig, const vec3 &inv_dir,
+                        interval ray_t) const {
+        // Branchless slab test with the ray reciprocal direction computed once
+        // by the caller. Returns the entry distance, or infinity on a miss.
+        auto tx0 = (x.min - orig.e[0]) * inv_dir.e[0];
+        auto tx1 = (x.max - orig.e[0]) * inv_dir.e[0];
+        auto ty0 = (y.min - orig.e[1]) * inv_dir.e[1];
+        auto ty1 = (y.max - orig.e[1]) * inv_dir.e[1];
+        auto tz0 = (z.min - orig.e[2]) * inv_dir.e[2];
+        auto tz1 = (z.max - orig.e[2]) * inv_dir.e[2];
+
+        auto t_enter =
+            std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                     std::max(std::min(tz0, tz1), ray_t.min));
+        auto t_exit =
+            std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                     std::min(std::max(tz0, tz1), ray_t.max));
+
+        return t_enter <= t_exit ? t_enter : infinity;
+    }
+
+    int longest_axis() const {
+        // Returns the index of the longest axis of the bounding box
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+
+        return y.size() > z.size() ? 1 : 2;
+    }
+
+    real surface_area() const {
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+
+        auto dx = x.size();
+        auto dy = y.size();
+        auto dz = z.size();
+
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    point3 centroid() const {
+        return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max),
+                      0.5 * (z.min + z.max));
+    }
+
+    static const aabb empty, universe;
+
+  private:
+    void pad_to_minimums() {
+        // Adjust the AABB so that no side is narrower than some delta
+        real delta = 0.0001;
+
+        if (x.size() < delta)
+            x = x.expand(delta);
+        if (y.size() < delta)
+            y = y.expand(delta);
+        if (z.size() < delta)
+            z = z.expand(delta);
+    }
+};
+
+const aabb aabb::empty =
+    aabb(interval::empty, interval::empty, interval::empty);
+
+const aabb aabb::universe =
+    aabb(interval::universe, interval::universe, interval::universe);
+
+#endif // !AABB_H
@@ -0,0 +1,225 @@
+#ifndef AABB_KERNELS_H
+#define AABB_KERNELS_H
+
+#include "aabb.h"
+#include "ray_packet.h"
+#include "simd.h"
+
+#include <algorithm>
+
+// Slab tests of a whole ray packet against one box. Each returns the
+// nearest entry distance of any lane into the box, or infinity if no lane
+// enters it before its closest hit.
+
+inline real packet_box_entry_scalar(const aabb &box, const ray_packet &p) {
+    real nearest = infinity;
+
+    for (int k = 0; k < ray_packet::size; k++) {
+        auto tx0 = (box.x.min - p.ox[k]) * p.inv_dx[k];
+        auto tx1 = (box.x.max - p.ox[k]) * p.inv_dx[k];
+        auto ty0 = (box.y.min - p.oy[k]) * p.inv_dy[k];
+        auto ty1 = (box.y.max - p.oy[k]) * p.inv_dy[k];
+        auto tz0 = (box.z.min - p.oz[k]) * p.inv_dz[k];
+        auto tz1 = (box.z.max - p.oz[k]) * p.inv_dz[k];
+
+        auto t_enter =
+            std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                     std::max(std::min(tz0, tz1), p.t_min));
+        auto t_exit =
+            std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                     std::min(std::max(tz0, tz1), p.t_max[k]));
+
+        nearest = std::min(nearest, t_enter <= t_exit ? t_enter : infinity);
+    }
+
+    return nearest;
+}
+
+#if defined(RTW_X86) && !defined(RTW_FLOAT)
+inline real packet_box_entry_sse2(const aabb &box, const ray_packet &p) {
+    const __m128d x_min = _mm_set1_pd(box.x.min);
+    const __m128d x_max = _mm_set1_pd(box.x.max);
+    const __m128d y_min = _mm_set1_pd(box.y.min);
+    const __m128d y_max = _mm_set1_pd(box.y.max);
+    const __m128d z_min = _mm_set1_pd(box.z.min);
+    const __m128d z_max = _mm_set1_pd(box.z.max);
+    const __m128d t_min = _mm_set1_pd(p.t_min);
+    const __m128d inf = _mm_set1_pd(infinity);
+
+    __m128d nearest = inf;
+
+    for (int k = 0; k < ray_packet::size; k += 2) {
+        __m128d ox = _mm_load_pd(p.ox + k), idx = _mm_load_pd(p.inv_dx + k);
+        __m128d oy = _mm_load_pd(p.oy + k), idy = _mm_load_pd(p.inv_dy + k);
+        __m128d oz = _mm_load_pd(p.oz + k), idz = _mm_load_pd(p.inv_dz + k);
+
+        __m128d tx0 = _mm_mul_pd(_mm_sub_pd(x_min, ox), idx);
+        __m128d tx1 = _mm_mul_pd(_mm_sub_pd(x_max, ox), idx);
+        __m128d ty0 = _mm_mul_pd(_mm_sub_pd(y_min, oy), idy);
+        __m128d ty1 = _mm_mul_pd(_mm_sub_pd(y_max, oy), idy);
+        __m128d tz0 = _mm_mul_pd(_mm_sub_pd(z_min, oz), idz);
+        __m128d tz1 = _mm_mul_pd(_mm_sub_pd(z_max, oz), idz);
+
+        __m128d t_enter = _mm_max_pd(
+            _mm_max_pd(_mm_min_pd(tx0, tx1), _mm_min_pd(ty0, ty1)),
+            _mm_max_pd(_mm_min_pd(tz0, tz1), t_min));
+        __m128d t_exit = _mm_min_pd(
+            _mm_min_pd(_mm_max_pd(tx0, tx1), _mm_max_pd(ty0, ty1)),
+            _mm_min_pd(_mm_max_pd(tz0, tz1), _mm_load_pd(p.t_max + k)));
+
+        __m128d ok = _mm_cmple_pd(t_enter, t_exit);
+        __m128d entry =
+            _mm_or_pd(_mm_and_pd(ok, t_enter), _mm_andnot_pd(ok, inf));
+        nearest = _mm_min_pd(nearest, entry);
+    }
+
+    nearest = _mm_min_pd(nearest, _mm_shuffle_pd(nearest, nearest, 1));
+
+    return _mm_cvtsd_f64(nearest);
+}
+
+__attribute__((target("avx2"))) inline real
+packet_box_entry_avx2(const aabb &box, const ray_packet &p) {
+    const __m256d x_min = _mm256_set1_pd(box.x.min);
+    const __m256d x_max = _mm256_set1_pd(box.x.max);
+    const __m256d y_min = _mm256_set1_pd(box.y.min);
+    const __m256d y_max = _mm256_set1_pd(box.y.max);
+    const __m256d z_min = _mm256_set1_pd(box.z.min);
+    const __m256d z_max = _mm256_set1_pd(box.z.max);
+    const __m256d t_min = _mm256_set1_pd(p.t_min);
+    const __m256d inf = _mm256_set1_pd(infinity);
+
+    __m256d nearest = inf;
+
+    for (int k = 0; k < ray_packet::size; k += 4) {
+        __m256d ox = _mm256_load_pd(p.ox + k);
+        __m256d oy = _mm256_load_pd(p.oy + k);
+        __m256d oz = _mm256_load_pd(p.oz + k);
+        __m256d idx = _mm256_load_pd(p.inv_dx + k);
+        __m256d idy = _mm256_load_pd(p.inv_dy + k);
+        __m256d idz = _mm256_load_pd(p.inv_dz + k);
+
+        __m256d tx0 = _mm256_mul_pd(_mm256_sub_pd(x_min, ox), idx);
+        __m256d tx1 = _mm256_mul_pd(_mm256_sub_pd(x_max, ox), idx);
+        __m256d ty0 = _mm256_mul_pd(_mm256_sub_pd(y_min, oy), idy);
+        __m256d ty1 = _mm256_mul_pd(_mm256_sub_pd(y_max, oy), idy);
+        __m256d tz0 = _mm256_mul_pd(_mm256_sub_pd(z_min, oz), idz);
+        __m256d tz1 = _mm256_mul_pd(_mm256_sub_pd(z_max, oz), idz);
+
+        __m256d t_enter = _mm256_max_pd(
+            _mm256_max_pd(_mm256_min_pd(tx0, tx1), _mm256_min_pd(ty0, ty1)),
+            _mm256_max_pd(_mm256_min_pd(tz0, tz1), t_min));
+        __m256d t_exit = _mm256_min_pd(
+            _mm256_min_pd(_mm256_max_pd(tx0, tx1), _mm256_max_pd(ty0, ty1)),
+            _mm256_min_pd(_mm256_max_pd(tz0, tz1),
+                          _mm256_load_pd(p.t_max + k)));
+
+        __m256d ok = _mm256_cmp_pd(t_enter, t_exit, _CMP_LE_OQ);
+        nearest = _mm256_min_pd(nearest, _mm256_blendv_pd(inf, t_enter, ok));
+    }
+
+    nearest = _mm256_min_pd(nearest, _mm256_permute4x64_pd(nearest, 0x4e));
+    nearest = _mm256_min_pd(nearest, _mm256_permute_pd(nearest, 0x5));
+
+    return _mm256_cvtsd_f64(nearest);
+}
+#endif
+
+#if defined(RTW_X86) && defined(RTW_FLOAT)
+inline real packet_box_entry_sse2(const aabb &box, const ray_packet &p) {
+    const __m128 x_min = _mm_set1_ps(box.x.min);
+    const __m128 x_max = _mm_set1_ps(box.x.max);
+    const __m128 y_min = _mm_set1_ps(box.y.min);
+    const __m128 y_max = _mm_set1_ps(box.y.max);
+    const __m128 z_min = _mm_set1_ps(box.z.min);
+    const __m128 z_max = _mm_set1_ps(box.z.max);
+    const __m128 t_min = _mm_set1_ps(p.t_min);
+    const __m128 inf = _mm_set1_ps(infinity);
+
+    __m128 nearest = inf;
+
+    for (int k = 0; k < ray_packet::size; k += 4) {
+        __m128 ox = _mm_load_ps(p.ox + k), idx = _mm_load_ps(p.inv_dx + k);
+        __m128 oy = _mm_load_ps(p.oy + k), idy = _mm_load_ps(p.inv_dy + k);
+        __m128 oz = _mm_load_ps(p.oz + k), idz = _mm_load_ps(p.inv_dz + k);
+
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(x_min, ox), idx);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(x_max, ox), idx);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(y_min, oy), idy);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(y_max, oy), idy);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(z_min, oz), idz);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(z_max, oz), idz);
+
+        __m128 t_enter =
+            _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                       _mm_max_ps(_mm_min_ps(tz0, tz1), t_min));
+        __m128 t_exit =
+            _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                       _mm_min_ps(_mm_max_ps(tz0, tz1),
+                                  _mm_load_ps(p.t_max + k)));
+
+        __m128 ok = _mm_cmple_ps(t_enter, t_exit);
+        __m128 entry =
+            _mm_or_ps(_mm_and_ps(ok, t_enter), _mm_andnot_ps(ok, inf));
+        nearest = _mm_min_ps(nearest, entry);
+    }
+
+    nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, 0x4e));
+    nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, 0xb1));
+
+    return _mm_cvtss_f32(nearest);
+}
+
+__attribute__((target("avx2"))) inline real
+packet_box_entry_avx2(const aabb &box, const ray_packet &p) {
+    // The whole packet in one 256 bit vector per component
+    const __m256 x_min = _mm256_set1_ps(box.x.min);
+    const __m256 x_max = _mm256_set1_ps(box.x.max);
+    const __m256 y_min = _mm256_set1_ps(box.y.min);
+    const __m256 y_max = _mm256_set1_ps(box.y.max);
+    const __m256 z_min = _mm256_set1_ps(box.z.min);
+    const __m256 z_max = _mm256_set1_ps(box.z.max);
+
+    __m256 ox = _mm256_load_ps(p.ox), idx = _mm256_load_ps(p.inv_dx);
+    __m256 oy = _mm256_load_ps(p.oy), idy = _mm256_load_ps(p.inv_dy);
+    __m256 oz = _mm256_load_ps(p.oz), idz = _mm256_load_ps(p.inv_dz);
+
+    __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(x_min, ox), idx);
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(x_max, ox), idx);
+    __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(y_min, oy), idy);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(y_max, oy), idy);
+    __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(z_min, oz), idz);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(z_max, oz), idz);
+
+    __m256 t_enter = _mm256_max_ps(
+        _mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+        _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(p.t_min)));
+    __m256 t_exit = _mm256_min_ps(
+        _mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+        _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_load_ps(p.t_max)));
+
+    __m256 ok = _mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ);
+    __m256 nearest = _mm256_blendv_ps(_mm256_set1_ps(infinity), t_enter, ok);
+
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(nearest),
+                          _mm256_extractf128_ps(nearest, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, 0x4e));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, 0xb1));
+
+    return _mm_cvtss_f32(m);
+}
+#endif
+
+inline real packet_box_entry(simd_level level, const aabb &box,
+                               const ray_packet &p) {
+#ifdef RTW_X86
+    if (level == simd_level::avx2)
+        return packet_box_entry_avx2(box, p);
+    if (level == simd_level::sse2)
+        return packet_box_entry_sse2(box, p);
+#endif
+
+    return packet_box_entry_scalar(box, p);
+}
+
+#endif // !AABB_KERNELS_H
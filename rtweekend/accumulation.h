@@ -0,0 +1,309 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include "pixel_estimate.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The running sums of a progressive render, kept in a memory mapped file so
+// a killed render resumes, and a finished one takes more samples, without
+// redoing any. The file holds two copies of the sums after its header: a
+// pass reads the committed copy and writes the other, which commit flushes
+// before pointing the header at it, so a kill at any point leaves the last
+// committed pass intact. Sums are floats, halving the file, and a pixel's
+// samples continue from its stored count, so stopping and resuming gives
+// the same image as never stopping.
+
+struct accumulation_header {
+    char magic[8]; // "RTWACCUM"
+    uint32_t version;
+    uint32_t flags; // of accumulation_flags
+    uint32_t width, height;
+    uint64_t fingerprint; // camera::sample_fingerprint
+    uint32_t current;     // copy holding the last committed pass, 0 or 1
+    uint32_t passes;      // committed so far
+    uint64_t copy_size;   // bytes per copy, a multiple of the page size
+};
+
+enum accumulation_flags : uint32_t {
+    accumulate_variance = 1, // luminance sums, for adaptive sampling
+    accumulate_features = 2, // albedo and normal sums, for denoising
+};
+
+// Each copy is an array of every record kind it holds, in this order
+struct accumulated_pixel {
+    float sum[3];
+    uint32_t samples;
+};
+
+struct accumulated_variance {
+    float luminance_sum, luminance_squares;
+};
+
+struct accumulated_features {
+    float albedo_sum[3], normal_sum[3];
+};
+
+constexpr uint32_t accumulation_version = 1;
+constexpr size_t accumulation_page = 4096; // header size and copy alignment
+
+class accumulation_file {
+  public:
+    accumulation_file() {}
+
+    ~accumulation_file() { close(); };
+
+    accumulation_file(const accumulation_file &) = delete;
+    accumulation_file &operator=(const accumulation_file &) = delete;
+
+    bool open(const std::string &path, int width, int height,
+              uint64_t fingerprint, uint32_t flags, std::string &error) {
+        // Resumes the file at path, or starts it empty if there is none.
+        // A file from another scene, size or camera is an error rather
+        // than something to overwrite; one without the sums flags asks
+        // for has to be removed first.
+        close();
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat info;
+
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+
+        accumulation_header expected = {};
+        std::memcpy(expected.magic, "RTWACCUM", 8);
+        expected.version = accumulation_version;
+        expected.flags = flags;
+        expected.width = uint32_t(width);
+        expected.height = uint32_t(height);
+        expected.fingerprint = fingerprint;
+        expected.copy_size = copy_bytes(size_t(width) * height, flags);
+        length = accumulation_page + 2 * expected.copy_size;
+
+        // A file killed before its first header was written is new too, but
+        // only at exactly the size it was made, so a mistyped path to some
+        // other file is never taken for one and overwritten
+        bool fresh = info.st_size == 0 ||
+                     (size_t(info.st_size) == length && blank_header());
+
+        if (!fresh) {
+            accumulation_header found;
+
+            if (size_t(info.st_size) < sizeof(found) ||
+                ::pread(fd, &found, sizeof(found), 0) != sizeof(found) ||
+                std::memcmp(found.magic, "RTWACCUM", 8) != 0) {
+                error = "not an accumulation file";
+                return false;
+            }
+
+            if (found.version != accumulation_version ||
+                found.width != expected.width ||
+                found.height != expected.height ||
+                found.fingerprint != fingerprint) {
+                error = "accumulated for another scene, size or camera";
+                return false;
+            }
+
+            if ((found.flags & flags) != flags) {
+                error = "accumulated without the variance or features "
+                        "this render needs";
+                return false;
+            }
+
+            expected = found;
+            length = accumulation_page + 2 * expected.copy_size;
+
+            if (size_t(info.st_size) != length) {
+                error = "accumulation file cut short";
+                return false;
+            }
+        }
+
+        // Truncating first zeroes whatever a blank file held
+        if (fresh && (::ftruncate(fd, 0) != 0 ||
+                      ::ftruncate(fd, off_t(length)) != 0)) {
+            error = std::strerror(errno);
+            return false;
+        }
+
+        void *p =
+            mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (p == MAP_FAILED) {
+            error = std::strerror(errno);
+            length = 0;
+            return false;
+        }
+
+        base = static_cast<char *>(p);
+        header = reinterpret_cast<accumulation_header *>(base);
+        pixel_count = size_t(width) * height;
+
+        // A new file is all zeros past the header, every pixel unsampled
+        if (fresh) {
+            *header = expected;
+
+            if (msync(base, accumulation_page, MS_SYNC) != 0) {
+                error = std::strerror(errno);
+                return false;
+            }
+        }
+
+        bind(0, from);
+        bind(1, to);
+
+        if (header->current == 1)
+            std::swap(from, to);
+
+        return true;
+    };
+
+    uint32_t flags() const { return header->flags; };
+    int passes() const { return int(header->passes); };
+
+    void load(size_t index, pixel_estimate &estimate) const {
+        // The committed sums of a pixel
+        const accumulated_pixel &pixel = from.pixels[index];
+        estimate = pixel_estimate();
+        estimate.sum = color(pixel.sum[0], pixel.sum[1], pixel.sum[2]);
+        estimate.samples = int(pixel.samples);
+
+        if (from.variance) {
+            estimate.luminance_sum = from.variance[index].luminance_sum;
+            estimate.luminance_squares =
+                from.variance[index].luminance_squares;
+        }
+
+        if (from.features) {
+            const float *a = from.features[index].albedo_sum;
+            const float *n = from.features[index].normal_sum;
+            estimate.albedo_sum = color(a[0], a[1], a[2]);
+            estimate.normal_sum = vec3(n[0], n[1], n[2]);
+        }
+    };
+
+    void store(size_t index, const pixel_estimate &estimate) {
+        // Into the copy the next commit makes current
+        accumulated_pixel &pixel = to.pixels[index];
+
+        for (int k = 0; k < 3; k++)
+            pixel.sum[k] = float(estimate.sum[k]);
+
+        pixel.samples = uint32_t(estimate.samples);
+
+        if (to.variance)
+            to.variance[index] = {float(estimate.luminance_sum),
+                                  float(estimate.luminance_squares)};
+
+        if (to.features) {
+            for (int k = 0; k < 3; k++) {
+                to.features[index].albedo_sum[k] =
+                    float(estimate.albedo_sum[k]);
+                to.features[index].normal_sum[k] =
+                    float(estimate.normal_sum[k]);
+            }
+        }
+    };
+
+    bool commit(std::string &error) {
+        // Flushes the pixels stored since the last commit, then makes them
+        // the ones load reads and a resume starts from
+        if (msync(to.start, header->copy_size, MS_SYNC) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+
+        header->current = 1 - header->current;
+        header->passes++;
+
+        if (msync(base, accumulation_page, MS_SYNC) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+
+        std::swap(from, to);
+
+        return true;
+    };
+
+    void close() {
+        if (base)
+            munmap(base, length);
+
+        if (fd >= 0)
+            ::close(fd);
+
+        base = nullptr;
+        header = nullptr;
+        fd = -1;
+        length = 0;
+    };
+
+  private:
+    struct copy {
+        char *start = nullptr;
+        accumulated_pixel *pixels = nullptr;
+        accumulated_variance *variance = nullptr; // null unless flagged
+        accumulated_features *features = nullptr; // likewise
+    };
+
+    int fd = -1;
+    char *base = nullptr;
+    size_t length = 0;
+    size_t pixel_count = 0;
+    accumulation_header *header = nullptr;
+    copy from, to; // the committed copy and the one being written
+
+    bool blank_header() const {
+        // The whole header page is zero, as ftruncate left it
+        char page[accumulation_page];
+
+        if (::pread(fd, page, sizeof(page), 0) != ssize_t(sizeof(page)))
+            return false;
+
+        return page[0] == 0 &&
+               std::memcmp(page, page + 1, sizeof(page) - 1) == 0;
+    };
+
+    static size_t copy_bytes(size_t pixels, uint32_t flags) {
+        size_t bytes = pixels * sizeof(accumulated_pixel);
+
+        if (flags & accumulate_variance)
+            bytes += pixels * sizeof(accumulated_variance);
+
+        if (flags & accumulate_features)
+            bytes += pixels * sizeof(accumulated_features);
+
+        return (bytes + accumulation_page - 1) / accumulation_page *
+               accumulation_page;
+    };
+
+    void bind(int which, copy &c) {
+        // Points c at copy which of the file, by the flags it was made with
+        char *p = base + accumulation_page + which * header->copy_size;
+        c.start = p;
+        c.pixels = reinterpret_cast<accumulated_pixel *>(p);
+        p += pixel_count * sizeof(accumulated_pixel);
+
+        if (header->flags & accumulate_variance) {
+            c.variance = reinterpret_cast<accumulated_variance *>(p);
+            p += pixel_count * sizeof(accumulated_variance);
+        }
+
+        if (header->flags & accumulate_features)
+            c.features = reinterpret_cast<accumulated_features *>(p);
+    };
+};
+
+#endif // !ACCUMULATION_H
@@ -0,0 +1,2159 @@
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "compiled_scene.h"
+#include "distributed.h"
+#include "hittable_list.h"
+#include "image_writer.h"
+#include "material.h"
+#include "mesh_loader.h"
+#include "sampler.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "simd.h"
+#include "sphere.h"
+#include "sphere_group.h"
+#include "triangle_mesh.h"
+#include "wide_bvh.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Benchmarks for the ray tracer. Build the rtweekend_bench target, or by
+// hand with optimizations enabled:
+//   g++ -std=c++20 -O2 -o bench rtweekend/bench.cpp
+//
+// usage: bench [--json file] [section...]
+// Runs the named sections, or all of them, printing tables. With --json the
+// key numbers also go to file, for tracking regressions across commits.
+
+using bench_clock = std::chrono::steady_clock;
+
+static volatile double bench_sink; // keeps benchmarked results alive
+
+struct bench_result {
+    std::string name;
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+static std::vector<bench_result> bench_results;
+
+static void record(const std::string &name, const char *metric,
+                   double value) {
+    // Metrics of the same benchmark recorded one after another are grouped
+    if (bench_results.empty() || bench_results.back().name != name)
+        bench_results.push_back({name, {}});
+
+    bench_results.back().metrics.push_back({metric, value});
+}
+
+static const char *precision_name() {
+    return sizeof(real) == sizeof(float) ? "float" : "double";
+}
+
+static bool write_json(const char *path) {
+    // Names never need escaping. Six significant digits are plenty for
+    // timings, and non-finite values print as null, which JSON lacks.
+    std::ofstream out(path);
+
+    if (!out)
+        return false;
+
+    out << "{\n  \"simd\": \"" << simd_level_name(active_simd_level())
+        << "\",\n  \"precision\": \"" << precision_name()
+        << "\",\n  \"hardware_threads\": "
+        << std::thread::hardware_concurrency() << ",\n  \"benchmarks\": [";
+
+    for (size_t i = 0; i < bench_results.size(); i++) {
+        const auto &result = bench_results[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << result.name << '"';
+
+        for (const auto &[metric, value] : result.metrics) {
+            char number[32] = "null";
+
+            if (std::isfinite(value))
+                std::snprintf(number, sizeof(number), "%.6g", value);
+
+            out << ", \"" << metric << "\": " << number;
+        }
+
+        out << '}';
+    }
+
+    out << "\n  ]\n}\n";
+
+    return bool(out);
+}
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+class cache_miss_counter {
+  public:
+    // Last level cache misses of the calling thread, through perf events.
+    // Virtual machines and locked down kernels often don't expose hardware
+    // counters, then available() is false and read() returns -1.
+    cache_miss_counter() {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    };
+
+    ~cache_miss_counter() {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    };
+
+    bool available() const { return fd >= 0; };
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    };
+
+    long long read() {
+        long long count = -1;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (::read(fd, &count, sizeof(count)) != sizeof(count))
+                count = -1;
+        }
+#endif
+        return count;
+    };
+
+  private:
+    int fd = -1;
+};
+
+static hittable_list random_sphere_volume(int count,
+                                          material_table &materials) {
+    // Small spheres scattered through a volume that grows with the count so
+    // the density, and thus the overlap along a ray, stays the same. Seeded
+    // by the count, so every run builds the same scene.
+    seed_thread_rng(uint64_t(count), 1);
+
+    hittable_list world;
+    uint32_t palette[] = {
+        materials.add(lambertian(color(0.5, 0.5, 0.5))),
+        materials.add(lambertian(color(0.7, 0.3, 0.2))),
+        materials.add(metal(color(0.8, 0.8, 0.9), 0.1)),
+        materials.add(dielectric(1.5)),
+    };
+    double extent = 2 * std::cbrt(double(count));
+
+    for (int i = 0; i < count; i++) {
+        point3 center(random_double(-extent, extent),
+                      random_double(-extent, extent),
+                      random_double(-extent, extent));
+        world.add(std::make_shared<sphere>(center, 0.5, palette[i % 4]));
+    }
+
+    return world;
+}
+
+static std::vector<ray> random_rays(const hittable &world, int count) {
+    // Rays from random points on the scene bounds towards random points inside
+    std::vector<ray> rays;
+    auto box = world.bounding_box();
+
+    auto random_point = [&]() {
+        return point3(random_double(box.x.min, box.x.max),
+                      random_double(box.y.min, box.y.max),
+                      random_double(box.z.min, box.z.max));
+    };
+
+    for (int i = 0; i < count; i++) {
+        point3 from = random_point();
+        from[i % 3] = (i & 1) ? box.axis_interval(i % 3).min
+                              : box.axis_interval(i % 3).max;
+        rays.push_back(ray(from, random_point() - from));
+    }
+
+    return rays;
+}
+
+static double trace(const hittable &world, const std::vector<ray> &rays,
+                    int &hits) {
+    auto start = bench_clock::now();
+    hit_record rec;
+    hits = 0;
+
+    for (const auto &r : rays)
+        hits += world.hit(r, interval(0.001, infinity), rec);
+
+    return seconds_since(start);
+}
+
+static void bench_bvh() {
+    std::printf("%-10s %12s %12s %14s %14s %8s\n", "spheres", "build ms",
+                "nodes", "list Mrays/s", "bvh Mrays/s", "speedup");
+
+    for (int count : {485, 10000, 100000}) {
+        material_table materials;
+        auto world = random_sphere_volume(count, materials);
+
+        auto start = bench_clock::now();
+        bvh tree(world);
+        double build_time = seconds_since(start);
+
+        // The flat list is linear in the scene size, keep its run short
+        auto rays = random_rays(world, 200000);
+        auto list_rays =
+            std::vector<ray>(rays.begin(), rays.begin() + 2000000 / count);
+
+        int list_hits, bvh_hits, check_hits;
+        double list_time = trace(world, list_rays, list_hits);
+        double bvh_time = trace(tree, rays, bvh_hits);
+        trace(tree, list_rays, check_hits);
+
+        if (check_hits != list_hits)
+            std::fprintf(stderr, "bvh and list disagree: %d vs %d hits\n",
+                         check_hits, list_hits);
+
+        double list_rate = list_rays.size() / list_time / 1e6;
+        double bvh_rate = rays.size() / bvh_time / 1e6;
+
+        std::printf("%-10d %12.2f %12zu %14.3f %14.3f %7.1fx\n", count,
+                    build_time * 1e3, tree.node_count(), list_rate, bvh_rate,
+                    bvh_rate / list_rate);
+
+        auto name = "bvh/" + std::to_string(count);
+        record(name, "build_ms", build_time * 1e3);
+        record(name, "list_rays_per_second", list_rate * 1e6);
+        record(name, "bvh_rays_per_second", bvh_rate * 1e6);
+    }
+}
+
+static double legacy_random_double() {
+    // The std::rand based generator random_double() used to call
+    return std::rand() / (RAND_MAX + 1.0);
+}
+
+static vec3 legacy_random_unit_vector() {
+    while (true) {
+        auto p = vec3(2 * legacy_random_double() - 1,
+                      2 * legacy_random_double() - 1,
+                      2 * legacy_random_double() - 1);
+        auto lensq = p.length_squared();
+
+        if (1e-160 < lensq && lensq <= 1)
+            return p / sqrt(lensq);
+    }
+}
+
+template <typename F>
+static void report_rate(const char *name, int n, F f, int per_call = 1) {
+    double sink = 0;
+    auto start = bench_clock::now();
+
+    for (int i = 0; i < n; i++)
+        sink += f();
+
+    double rate = double(n) * per_call / seconds_since(start) / 1e6;
+    bench_sink = sink;
+
+    std::printf("%-36s %10.1f M/s\n", name, rate);
+    record(std::string("rng/") + name, "per_second", rate * 1e6);
+}
+
+static void bench_rng() {
+    const int n = 20000000;
+
+    report_rate("std::rand random_double", n, legacy_random_double);
+    report_rate("xoshiro256+ random_double", n, [] { return random_double(); });
+    report_rate(
+        "xoshiro256+ random_doubles x8", n / 8,
+        [] {
+            double u[8];
+            random_doubles(u, 8);
+
+            return u[0] + u[1] + u[2] + u[3] + u[4] + u[5] + u[6] + u[7];
+        },
+        8);
+
+    report_rate("std::rand random_unit_vector", n / 4,
+                [] { return legacy_random_unit_vector().x(); });
+    report_rate("xoshiro256+ random_unit_vector", n / 4,
+                [] { return random_unit_vector().x(); });
+    report_rate("xoshiro256+ random_in_unit_disk", n / 4,
+                [] { return random_in_unit_disk().x(); });
+
+    // Reseeding happens once per camera sample
+    uint64_t index = 0;
+    report_rate("seed + random_unit_vector", n / 4, [&] {
+        seed_thread_rng(index++, 7);
+
+        return random_unit_vector().x();
+    });
+}
+
+static double rmse(const std::vector<color> &image,
+                   const std::vector<color> &reference) {
+    double sum = 0;
+
+    for (size_t i = 0; i < image.size(); i++) {
+        vec3 diff = image[i] - reference[i];
+        sum += diff.length_squared() / 3;
+    }
+
+    return std::sqrt(sum / image.size());
+}
+
+static void bench_samplers() {
+    // RMSE against a high sample count reference of the book cover scene,
+    // at a small resolution so the reference stays affordable
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    bvh tree(world);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 80;
+    cam.show_progress = false;
+
+    const int reference_spp = 4096;
+    auto start = bench_clock::now();
+    cam.samples_per_pixel = reference_spp;
+    auto reference = cam.render_pixels(tree, materials);
+
+    std::printf("reference: %d spp independent, %.1f s\n", reference_spp,
+                seconds_since(start));
+
+    struct candidate {
+        const char *name;
+        std::shared_ptr<sampler> smp;
+    };
+
+    // Seeded apart from the reference so its noise does not correlate
+    candidate samplers[] = {
+        {"independent", std::make_shared<independent_sampler>()},
+        {"stratified", std::make_shared<stratified_sampler>(1)},
+        {"halton", std::make_shared<halton_sampler>(1)},
+        {"sobol", std::make_shared<sobol_sampler>(1)},
+    };
+
+    std::printf("%-6s", "spp");
+
+    for (const auto &c : samplers)
+        std::printf(" %14s", c.name);
+
+    std::printf("\n");
+
+    for (int spp : {1, 4, 16, 64, 256}) {
+        std::printf("%-6d", spp);
+
+        for (const auto &c : samplers) {
+            cam.samples_per_pixel = spp;
+            cam.pixel_sampler = c.smp;
+
+            double error = rmse(cam.render_pixels(tree, materials), reference);
+
+            std::printf(" %14.5f", error);
+            record(std::string("samplers/") + c.name + "/" +
+                       std::to_string(spp),
+                   "rmse", error);
+        }
+
+        std::printf("\n");
+    }
+}
+
+static std::vector<ray> camera_rays(const camera &cam, int width, int height,
+                                    int rays_per_pixel) {
+    // Pinhole rays of the cover scene camera, rays_per_pixel jittered ones
+    // per pixel one after the other, the way the camera emits them
+    vec3 w = unit_vector(cam.look_from - cam.look_at);
+    vec3 u = unit_vector(cross(cam.vup, w));
+    vec3 v = cross(w, u);
+
+    double h = std::tan(degrees_to_radians(cam.vfov) / 2);
+    double aspect = double(width) / height;
+    std::vector<ray> rays;
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            for (int k = 0; k < rays_per_pixel; k++) {
+                double x = (2 * (i + random_double()) / width - 1) * h * aspect;
+                double y = (1 - 2 * (j + random_double()) / height) * h;
+                rays.push_back(ray(cam.look_from, x * u + y * v - w));
+            }
+        }
+    }
+
+    return rays;
+}
+
+static void bench_simd() {
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    auto rays = random_rays(world, 100000);
+    auto group = sphere_group(world);
+    simd_level best = active_simd_level();
+
+    std::printf("one ray against all %zu spheres of the cover scene\n",
+                world.objects.size());
+
+    int list_hits;
+    double list_time = trace(world, rays, list_hits);
+    double tests = double(rays.size()) * world.objects.size();
+
+    std::printf("%-24s %10.3f Mrays/s %8.2f ns/test\n", "hittable_list",
+                rays.size() / list_time / 1e6, list_time / tests * 1e9);
+    record("simd/hittable_list", "rays_per_second", rays.size() / list_time);
+    record("simd/hittable_list", "ns_per_intersection",
+           list_time / tests * 1e9);
+
+    const simd_level levels[] = {simd_level::scalar, simd_level::sse2,
+                                 simd_level::avx2};
+
+    for (auto level : levels) {
+        if (level > best)
+            continue;
+
+        active_simd_level() = level;
+
+        int hits;
+        double time = trace(group, rays, hits);
+        auto name = std::string("sphere_group ") + simd_level_name(level);
+
+        std::printf("%-24s %10.3f Mrays/s %8.2f ns/test%s\n", name.c_str(),
+                    rays.size() / time / 1e6, time / tests * 1e9,
+                    hits == list_hits ? "" : "  (hit count differs!)");
+
+        name = std::string("simd/sphere_group/") + simd_level_name(level);
+        record(name, "rays_per_second", rays.size() / time);
+        record(name, "ns_per_intersection", time / tests * 1e9);
+    }
+
+    // Coherent camera rays through the bvh, one by one and as packets
+    bvh tree(world);
+    camera cam;
+    random_spheres_camera(cam);
+    auto primary = camera_rays(cam, 320, 180, ray_packet::size);
+
+    std::printf("%zu camera rays through the bvh\n", primary.size());
+
+    active_simd_level() = best;
+    auto start = bench_clock::now();
+    hit_record rec;
+    int single_hits = 0;
+
+    for (const auto &r : primary)
+        single_hits += tree.hit(r, interval(0.001, infinity), rec);
+
+    double single_time = seconds_since(start);
+
+    std::printf("%-24s %10.3f Mrays/s\n", "single rays",
+                primary.size() / single_time / 1e6);
+    record("simd/camera_rays/single", "rays_per_second",
+           primary.size() / single_time);
+
+    for (auto level : levels) {
+        if (level > best)
+            continue;
+
+        active_simd_level() = level;
+
+        start = bench_clock::now();
+        primitive_hit hits[ray_packet::size];
+        int packet_hits = 0;
+
+        for (size_t first = 0; first < primary.size();
+             first += ray_packet::size) {
+            ray_packet packet(0.001);
+
+            for (int k = 0; k < ray_packet::size; k++)
+                packet.add(primary[first + k]);
+
+            tree.intersect_packet(packet, hits);
+
+            // The same surfaces as the single rays get
+            for (int k = 0; k < ray_packet::size; k++) {
+                if (packet.hit[k]) {
+                    hits[k].object->surface(primary[first + k], hits[k], rec);
+                    packet_hits++;
+                }
+            }
+        }
+
+        double time = seconds_since(start);
+        std::string name = std::string("packets ") + simd_level_name(level);
+
+        std::printf("%-24s %10.3f Mrays/s%s\n", name.c_str(),
+                    primary.size() / time / 1e6,
+                    packet_hits == single_hits ? "" : "  (hit count differs!)");
+        record(std::string("simd/camera_rays/packets/") +
+                   simd_level_name(level),
+               "rays_per_second", primary.size() / time);
+    }
+
+    active_simd_level() = best;
+}
+
+static void bench_scene() {
+    // Pointer based bvh over shared_ptr spheres against the compiled scene,
+    // both built by the same builder so they visit the same nodes
+    cache_miss_counter misses;
+
+    if (!misses.available())
+        std::printf("hardware cache miss counter unavailable here\n");
+
+    std::printf("%-10s %14s %12s %14s %12s %8s\n", "spheres", "bvh Mrays/s",
+                "misses/ray", "flat Mrays/s", "misses/ray", "speedup");
+
+    for (int count : {10000, 100000, 1000000}) {
+        material_table materials;
+        auto world = random_sphere_volume(count, materials);
+        bvh tree(world);
+        compiled_scene flat(world);
+        auto rays = random_rays(world, 500000);
+
+        int tree_hits, flat_hits;
+
+        misses.start();
+        double tree_time = trace(tree, rays, tree_hits);
+        double tree_misses = double(misses.read()) / rays.size();
+
+        misses.start();
+        double flat_time = trace(flat, rays, flat_hits);
+        double flat_misses = double(misses.read()) / rays.size();
+
+        if (tree_hits != flat_hits)
+            std::fprintf(stderr, "bvh and compiled scene disagree: %d vs %d\n",
+                         tree_hits, flat_hits);
+
+        double tree_rate = rays.size() / tree_time / 1e6;
+        double flat_rate = rays.size() / flat_time / 1e6;
+
+        auto per_ray = [&](double value) {
+            return misses.available() ? std::to_string(value) : "n/a";
+        };
+
+        std::printf("%-10d %14.3f %12.12s %14.3f %12.12s %7.2fx\n", count,
+                    tree_rate, per_ray(tree_misses).c_str(), flat_rate,
+                    per_ray(flat_misses).c_str(), flat_rate / tree_rate);
+
+        auto name = "scene/" + std::to_string(count);
+        record(name, "bvh_rays_per_second", tree_rate * 1e6);
+        record(name, "compiled_rays_per_second", flat_rate * 1e6);
+
+        if (misses.available()) {
+            record(name, "bvh_cache_misses_per_ray", tree_misses);
+            record(name, "compiled_cache_misses_per_ray", flat_misses);
+        }
+    }
+
+    // Coherent camera rays through the cover scene
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    bvh tree(world);
+    compiled_scene flat(world);
+    camera cam;
+    random_spheres_camera(cam);
+    auto primary = camera_rays(cam, 320, 180, 8);
+
+    int tree_hits, flat_hits;
+    double tree_time = trace(tree, primary, tree_hits);
+    double flat_time = trace(flat, primary, flat_hits);
+
+    std::printf("%-10s %14.3f %12s %14.3f %12s %7.2fx\n", "cover",
+                primary.size() / tree_time / 1e6, "",
+                primary.size() / flat_time / 1e6, "", tree_time / flat_time);
+}
+
+static void bench_image() {
+    // Writing a 4K framebuffer to memory, the old P3 text path against the
+    // binary writers
+    const int width = 3840, height = 2160;
+    std::vector<color> pixels(size_t(width) * height);
+
+    for (auto &pixel : pixels)
+        pixel = color::random() * 1.2;
+
+    auto time_write = [&](const char *name, auto write) {
+        std::ostringstream out;
+        auto start = bench_clock::now();
+        write(out);
+        double time = seconds_since(start);
+
+        std::printf("%-24s %10.1f ms %10.1f MB\n", name, time * 1e3,
+                    out.str().size() / 1e6);
+        record(std::string("image/") + name, "ms", time * 1e3);
+    };
+
+    time_write("P3 write_color", [&](std::ostream &out) {
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+
+        for (const auto &pixel : pixels)
+            write_color(out, pixel);
+    });
+
+    time_write("P6", [&](std::ostream &out) {
+        write_image(out, image_format::ppm, width, height, pixels);
+    });
+
+    time_write("PNG", [&](std::ostream &out) {
+        write_image(out, image_format::png, width, height, pixels);
+    });
+
+    time_write("PFM", [&](std::ostream &out) {
+        write_image(out, image_format::pfm, width, height, pixels);
+    });
+
+    // The gamma and quantization pass on its own
+    simd_level best = active_simd_level();
+    std::vector<uint8_t> bytes(sizeof(color) / sizeof(real) * pixels.size());
+    const simd_level levels[] = {simd_level::scalar, simd_level::sse2,
+                                 simd_level::avx2};
+
+    for (auto level : levels) {
+        if (level > best)
+            continue;
+
+        auto start = bench_clock::now();
+        quantize(level, pixels.data()->e, bytes.data(), bytes.size());
+        double time = seconds_since(start);
+        auto name = std::string("quantize ") + simd_level_name(level);
+
+        std::printf("%-24s %10.1f ms %10.1f Mpixels/s\n", name.c_str(),
+                    time * 1e3, pixels.size() / time / 1e6);
+        record(std::string("image/quantize/") + simd_level_name(level),
+               "pixels_per_second", pixels.size() / time);
+    }
+}
+
+static double display_rmse(const std::vector<color> &image,
+                           const std::vector<color> &reference) {
+    // RMSE after gamma correction, the error a viewer of the image sees
+    auto gamma = [](const color &c) {
+        return color(linear_to_gamma(c.x()), linear_to_gamma(c.y()),
+                     linear_to_gamma(c.z()));
+    };
+
+    double sum = 0;
+
+    for (size_t i = 0; i < image.size(); i++)
+        sum += (gamma(image[i]) - gamma(reference[i])).length_squared() / 3;
+
+    return std::sqrt(sum / image.size());
+}
+
+static void bench_adaptive() {
+    // Time and error of uniform against adaptive sampling on the cover
+    // scene. Equal error at lower time is the win.
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    compiled_scene flat(world);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 120;
+    cam.show_progress = false;
+
+    const int reference_spp = 2048;
+    auto start = bench_clock::now();
+    cam.samples_per_pixel = reference_spp;
+    auto reference = cam.render_pixels(flat, materials);
+
+    std::printf("reference: %d spp, %.1f s\n", reference_spp,
+                seconds_since(start));
+
+    cam.pixel_sampler = std::make_shared<sobol_sampler>(1);
+
+    std::printf("%-22s %10s %10s %12s\n", "mode", "time s", "mean spp",
+                "display rmse");
+
+    auto run = [&](const std::string &name) {
+        auto start = bench_clock::now();
+        auto image = cam.render_pixels(flat, materials);
+        double time = seconds_since(start);
+
+        double spent = 0;
+
+        for (int n : cam.samples_spent)
+            spent += n;
+
+        double mean_spp = spent / cam.samples_spent.size();
+        double error = display_rmse(image, reference);
+
+        std::printf("%-22s %10.2f %10.1f %12.5f\n", name.c_str(), time,
+                    mean_spp, error);
+        record("adaptive/" + name, "seconds", time);
+        record("adaptive/" + name, "mean_spp", mean_spp);
+        record("adaptive/" + name, "display_rmse", error);
+    };
+
+    for (int spp : {16, 32, 64, 128, 256}) {
+        cam.adaptive_sampling = false;
+        cam.samples_per_pixel = spp;
+
+        run("uniform_" + std::to_string(spp));
+    }
+
+    for (double threshold : {0.04, 0.02, 0.01, 0.005}) {
+        cam.adaptive_sampling = true;
+        cam.samples_per_pixel = 1024;
+        cam.noise_threshold = threshold;
+
+        run("threshold_" + std::to_string(threshold).substr(0, 6));
+    }
+}
+
+static bool read_pfm(const std::string &path, int &width, int &height,
+                     std::vector<color> &pixels) {
+    // Reads back what write_pfm writes: RGB, little endian, bottom to top
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    double scale;
+
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" ||
+        scale >= 0)
+        return false;
+
+    in.get();
+    std::vector<float> row(size_t(width) * 3);
+    pixels.assign(size_t(width) * height, color());
+
+    for (int y = height - 1; y >= 0; y--) {
+        if (!in.read(reinterpret_cast<char *>(row.data()),
+                     row.size() * sizeof(float)))
+            return false;
+
+        for (int x = 0; x < width; x++)
+            pixels[size_t(y) * width + x] =
+                color(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+    }
+
+    return true;
+}
+
+static void bench_precision() {
+    // The cover scene as main renders it, in the precision of this build.
+    // The linear image is kept in precision_<name>.pfm in the working
+    // directory. When the other precision's file is there as well the two
+    // images are compared, so running both bench targets one after the
+    // other gives the speedup and the difference.
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    compiled_scene flat(world);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 32;
+    cam.show_progress = false;
+
+    auto start = bench_clock::now();
+    auto image = cam.render_pixels(flat, materials);
+    double time = seconds_since(start);
+
+    int width = cam.image_width;
+    int height = int(image.size()) / width;
+    double samples = double(image.size()) * cam.samples_per_pixel;
+    std::string name = precision_name();
+
+    std::printf("%-8s %10s %10s %14s\n", "real", "vec3 B", "render s",
+                "Msamples/s");
+    std::printf("%-8s %10zu %10.2f %14.3f\n", name.c_str(), sizeof(vec3), time,
+                samples / time / 1e6);
+    record("precision/" + name, "vec3_bytes", double(sizeof(vec3)));
+    record("precision/" + name, "samples_per_second", samples / time);
+
+    std::ofstream out("precision_" + name + ".pfm", std::ios::binary);
+    write_pfm(out, width, height, image);
+    out.close();
+
+    std::string other = name == "float" ? "double" : "float";
+    std::vector<color> reference;
+    int other_width, other_height;
+
+    if (!read_pfm("precision_" + other + ".pfm", other_width, other_height,
+                  reference) ||
+        other_width != width || other_height != height)
+        return;
+
+    // Stored images are floats either way, compare the rounded pixels too
+    auto bytes = quantize_pixels(image);
+    auto other_bytes = quantize_pixels(reference);
+    size_t changed = 0;
+
+    for (size_t i = 0; i < image.size(); i++)
+        changed += std::memcmp(&bytes[3 * i], &other_bytes[3 * i], 3) != 0;
+
+    double error = display_rmse(image, reference);
+    double fraction = double(changed) / image.size();
+
+    std::printf("against %s: display rmse %.5f, %.2f%% of pixels differ\n",
+                other.c_str(), error, 100 * fraction);
+    record("precision/" + name + "_vs_" + other, "display_rmse", error);
+    record("precision/" + name + "_vs_" + other, "pixels_differing", fraction);
+}
+
+static void bench_micro() {
+    // The innermost routines, one call at a time
+    const int n = 2000000;
+    material_table materials;
+    auto gray = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+
+    auto report_ns = [](const std::string &name, const char *metric,
+                        double time, double calls) {
+        std::printf("%-36s %10.2f ns\n", name.c_str(), time / calls * 1e9);
+        record("micro/" + name, metric, time / calls * 1e9);
+    };
+
+    // Rays from a shell around a unit sphere towards points near it, so
+    // about half of them hit
+    seed_thread_rng(11);
+    sphere ball(point3(0, 0, 0), 1, gray);
+    std::vector<ray> rays;
+
+    for (int i = 0; i < 1000; i++) {
+        point3 from = 4 * random_unit_vector();
+        rays.push_back(ray(from, 1.5 * random_unit_vector() - from));
+    }
+
+    auto start = bench_clock::now();
+    hit_record rec;
+    int hits = 0;
+
+    for (int i = 0; i < n; i++)
+        hits += ball.hit(rays[i % rays.size()], interval(0.001, infinity), rec);
+
+    report_ns("sphere::hit", "ns_per_intersection", seconds_since(start), n);
+    bench_sink = hits;
+
+    auto world = random_spheres_scene(materials);
+    auto list_rays = random_rays(world, n / int(world.objects.size()));
+    double list_time = trace(world, list_rays, hits);
+
+    report_ns("hittable_list::hit", "ns_per_intersection", list_time,
+              double(list_rays.size()) * world.objects.size());
+
+    // Every material scattering a ray that arrives at a fixed hit, through
+    // the material table like the camera does
+    struct variant {
+        const char *name;
+        uint32_t mat;
+    };
+
+    variant variants[] = {
+        {"lambertian::scatter", gray},
+        {"metal::scatter", materials.add(metal(color(0.8, 0.8, 0.8), 0.3))},
+        {"dielectric::scatter", materials.add(dielectric(1.5))},
+    };
+
+    rec.p = point3(0, 0, 0);
+    rec.t = 1;
+    ray incoming(point3(-1, 1, 0), vec3(1, -1, 0));
+    rec.set_face_normal(incoming, vec3(0, 1, 0));
+
+    for (const auto &v : variants) {
+        independent_sampler smp;
+        smp.set_samples_per_pixel(n);
+        rec.mat = v.mat;
+
+        double sink = 0;
+        start = bench_clock::now();
+
+        for (int i = 0; i < n; i++) {
+            color attenuation;
+            ray scattered;
+            smp.start_pixel_sample(0, 0, i);
+
+            if (materials.scatter(v.mat, incoming, rec, attenuation,
+                                  scattered, smp))
+                sink += scattered.direction().x();
+        }
+
+        report_ns(v.name, "ns_per_call", seconds_since(start), n);
+        bench_sink = sink;
+    }
+
+    double sink = 0;
+    start = bench_clock::now();
+
+    for (int i = 0; i < n; i++)
+        sink += random_unit_vector().x();
+
+    report_ns("random_unit_vector", "ns_per_call", seconds_since(start), n);
+    bench_sink = sink;
+}
+
+static void bench_render() {
+    // End to end camera::render of fixed seed scenes through the compiled
+    // scene, as main renders them, with the image written to memory
+    std::printf("%-10s %12s %10s %14s\n", "scene", "build ms", "render s",
+                "Msamples/s");
+
+    auto run = [](const std::string &name, const hittable_list &world,
+                  const material_table &materials, camera &cam) {
+        cam.show_progress = false;
+
+        auto start = bench_clock::now();
+        compiled_scene flat(world);
+        double build_time = seconds_since(start);
+
+        std::ostringstream out;
+        start = bench_clock::now();
+        cam.render(flat, materials, out);
+        double time = seconds_since(start);
+
+        int height = int(cam.samples_spent.size()) / cam.image_width;
+        double samples =
+            double(cam.image_width) * height * cam.samples_per_pixel;
+
+        std::printf("%-10s %12.1f %10.2f %14.3f\n", name.c_str(),
+                    build_time * 1e3, time, samples / time / 1e6);
+        record("render/" + name, "build_ms", build_time * 1e3);
+        record("render/" + name, "samples_per_second", samples / time);
+    };
+
+    camera cover;
+    random_spheres_camera(cover);
+    cover.image_width = 160;
+    cover.samples_per_pixel = 8;
+    material_table cover_materials;
+    run("cover", random_spheres_scene(cover_materials), cover_materials,
+        cover);
+
+    for (int count : {10000, 100000, 1000000}) {
+        material_table materials;
+        auto world = random_sphere_volume(count, materials);
+        double extent = 2 * std::cbrt(double(count));
+
+        camera cam;
+        cam.aspect_ratio = 16.0 / 9.0;
+        cam.image_width = 160;
+        cam.samples_per_pixel = 8;
+        cam.max_depth = 10;
+        cam.vfov = 50;
+        cam.look_from = point3(0.5, 0.3, 2.5) * extent;
+        cam.look_at = point3(0, 0, 0);
+
+        run(std::to_string(count), world, materials, cam);
+    }
+}
+
+static mesh_data bumpy_sphere_mesh(int rings, int segments) {
+    // A closed sphere with a wavy surface, rings by segments vertices. The
+    // band between two rings is a row of quads, split along one diagonal,
+    // the bands at the poles are triangle fans.
+    mesh_data mesh;
+    mesh.vertices.push_back(point3(0, 1, 0));
+
+    for (int i = 1; i < rings; i++) {
+        double theta = pi * i / rings;
+
+        for (int j = 0; j < segments; j++) {
+            double phi = 2 * pi * j / segments;
+            double radius = 1 + 0.05 * std::sin(7 * theta) * std::sin(5 * phi);
+
+            mesh.vertices.push_back(radius *
+                                    point3(std::sin(theta) * std::cos(phi),
+                                           std::cos(theta),
+                                           std::sin(theta) * std::sin(phi)));
+        }
+    }
+
+    mesh.vertices.push_back(point3(0, -1, 0));
+
+    uint32_t south = uint32_t(mesh.vertices.size() - 1);
+    auto ring = [&](int i, int j) {
+        return uint32_t(1 + (i - 1) * segments + j % segments);
+    };
+
+    for (int j = 0; j < segments; j++)
+        mesh.indices.insert(mesh.indices.end(),
+                            {0, ring(1, j + 1), ring(1, j)});
+
+    for (int i = 1; i + 1 < rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            uint32_t a = ring(i, j), b = ring(i, j + 1);
+            uint32_t c = ring(i + 1, j + 1), d = ring(i + 1, j);
+
+            mesh.indices.insert(mesh.indices.end(), {a, b, c, a, c, d});
+        }
+    }
+
+    for (int j = 0; j < segments; j++)
+        mesh.indices.insert(mesh.indices.end(), {south, ring(rings - 1, j),
+                                                 ring(rings - 1, j + 1)});
+
+    return mesh;
+}
+
+static bool write_obj(const std::string &path, const mesh_data &mesh) {
+    // Quads where two consecutive triangles share their first and third
+    // vertex, so the loader's fan splits them back into the same triangles
+    std::string text;
+    char line[96];
+
+    for (const point3 &v : mesh.vertices) {
+        int n = std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n",
+                              double(v.x()), double(v.y()), double(v.z()));
+        text.append(line, size_t(n));
+    }
+
+    const auto &idx = mesh.indices;
+
+    for (size_t i = 0; i < idx.size(); i += 3) {
+        int n;
+
+        if (i + 6 <= idx.size() && idx[i + 3] == idx[i] &&
+            idx[i + 4] == idx[i + 2]) {
+            n = std::snprintf(line, sizeof(line), "f %u %u %u %u\n",
+                              idx[i] + 1, idx[i + 1] + 1, idx[i + 2] + 1,
+                              idx[i + 5] + 1);
+            i += 3;
+        } else {
+            n = std::snprintf(line, sizeof(line), "f %u %u %u\n", idx[i] + 1,
+                              idx[i + 1] + 1, idx[i + 2] + 1);
+        }
+
+        text.append(line, size_t(n));
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(text.data(), std::streamsize(text.size()));
+
+    return bool(out);
+}
+
+static bool write_ply(const std::string &path, const mesh_data &mesh) {
+    // Binary little endian, float positions and triangles only
+    std::ofstream out(path, std::ios::binary);
+
+    out << "ply\nformat binary_little_endian 1.0\n"
+        << "element vertex " << mesh.vertices.size() << '\n'
+        << "property float x\nproperty float y\nproperty float z\n"
+        << "element face " << mesh.triangle_count() << '\n'
+        << "property list uchar uint vertex_indices\nend_header\n";
+
+    std::vector<char> body;
+    body.reserve(12 * mesh.vertices.size() + 13 * mesh.triangle_count());
+
+    auto put = [&](auto value) {
+        static_assert(std::endian::native == std::endian::little);
+        const char *p = reinterpret_cast<const char *>(&value);
+        body.insert(body.end(), p, p + sizeof(value));
+    };
+
+    for (const point3 &v : mesh.vertices) {
+        put(float(v.x()));
+        put(float(v.y()));
+        put(float(v.z()));
+    }
+
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+        put(uint8_t(3));
+        put(mesh.indices[i]);
+        put(mesh.indices[i + 1]);
+        put(mesh.indices[i + 2]);
+    }
+
+    out.write(body.data(), std::streamsize(body.size()));
+
+    return bool(out);
+}
+
+static void bench_mesh() {
+    // Loading a two million triangle mesh from OBJ and binary PLY, on one
+    // thread and on all of them, then building and tracing the mesh
+    auto source = bumpy_sphere_mesh(1024, 1024);
+    auto dir = std::filesystem::temp_directory_path();
+    std::string obj_path = (dir / "rtweekend_bench.obj").string();
+    std::string ply_path = (dir / "rtweekend_bench.ply").string();
+
+    if (!write_obj(obj_path, source) || !write_ply(ply_path, source)) {
+        std::fprintf(stderr, "cannot write the bench meshes to %s\n",
+                     dir.string().c_str());
+        return;
+    }
+
+    std::vector<unsigned> thread_counts = {1};
+    unsigned threads = std::thread::hardware_concurrency();
+
+    if (threads > 1)
+        thread_counts.push_back(threads);
+
+    std::printf("%-6s %8s %10s %10s %10s %12s\n", "format", "threads",
+                "file MB", "load ms", "MB/s", "Mtris/s");
+
+    mesh_data mesh;
+
+    for (const auto &path : {obj_path, ply_path}) {
+        const char *format = path == obj_path ? "obj" : "ply";
+        double size = double(std::filesystem::file_size(path));
+
+        for (unsigned count : thread_counts) {
+            std::string error;
+            mesh = mesh_data();
+
+            auto start = bench_clock::now();
+            bool loaded = load_mesh(path, mesh, error, int(count));
+            double time = seconds_since(start);
+
+            if (!loaded) {
+                std::fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+                continue;
+            }
+
+            if (mesh.indices != source.indices)
+                std::fprintf(stderr, "%s: triangles differ from the source\n",
+                             path.c_str());
+
+            double tris = double(mesh.triangle_count());
+
+            std::printf("%-6s %8u %10.1f %10.1f %10.1f %12.2f\n", format,
+                        count, size / 1e6, time * 1e3, size / time / 1e6,
+                        tris / time / 1e6);
+
+            auto name = std::string("mesh/") + format + "/" +
+                        std::to_string(count) + "_threads";
+            record(name, "load_ms", time * 1e3);
+            record(name, "megabytes_per_second", size / time / 1e6);
+        }
+    }
+
+    std::filesystem::remove(obj_path);
+    std::filesystem::remove(ply_path);
+
+    size_t tris = source.triangle_count();
+    double loaded_bytes = double(source.vertices.size() * sizeof(point3) +
+                                 source.indices.size() * sizeof(uint32_t));
+
+    auto start = bench_clock::now();
+    triangle_mesh object(std::move(source.vertices), std::move(source.indices),
+                         0);
+    double build_time = seconds_since(start);
+
+    // Rays from the centre of a closed mesh must all hit it, a miss is a
+    // ray that slipped through a shared edge or vertex
+    seed_thread_rng(1);
+    std::vector<ray> inside;
+
+    for (int i = 0; i < 1000000; i++)
+        inside.push_back(ray(point3(0, 0, 0), random_unit_vector()));
+
+    int inside_hits, hits;
+    trace(object, inside, inside_hits);
+
+    auto rays = random_rays(object, 1000000);
+    double time = trace(object, rays, hits);
+    double per_triangle = double(object.memory_bytes()) / tris;
+
+    std::printf("%zu triangles, %.1f B/triangle loaded, %.1f B/triangle with "
+                "bvh\n",
+                tris, loaded_bytes / tris, per_triangle);
+    std::printf("bvh build %.1f ms, %.3f Mrays/s, %zu of %zu rays from "
+                "inside leak\n",
+                build_time * 1e3, rays.size() / time / 1e6,
+                inside.size() - size_t(inside_hits), inside.size());
+
+    record("mesh/triangle_mesh", "build_ms", build_time * 1e3);
+    record("mesh/triangle_mesh", "bytes_per_triangle", per_triangle);
+    record("mesh/triangle_mesh", "rays_per_second", rays.size() / time);
+    record("mesh/triangle_mesh", "leaked_rays",
+           double(inside.size() - size_t(inside_hits)));
+}
+
+static void bench_instancing() {
+    // A small mesh instanced a thousand and a million times over the cover
+    // ground: memory against a flattened copy, build time and render speed
+    std::printf("%-10s %10s %12s %14s %12s %14s\n", "instances", "build ms",
+                "memory MB", "flattened MB", "Mrays/s", "Msamples/s");
+
+    auto mesh = bumpy_sphere_mesh(64, 64);
+    size_t geometry_bytes =
+        triangle_mesh(mesh.vertices, mesh.indices, 0).memory_bytes();
+
+    for (int count : {1000, 1000000}) {
+        material_table materials;
+
+        auto start = bench_clock::now();
+        auto world = instanced_mesh_scene(materials, mesh, count);
+        double build_time = seconds_since(start);
+
+        const auto &top = static_cast<const tlas &>(*world.objects[1]);
+        double memory = double(top.memory_bytes() + geometry_bytes);
+        double flattened = double(geometry_bytes) * count;
+
+        int hits;
+        auto rays = random_rays(top, 200000);
+        double ray_time = trace(top, rays, hits);
+
+        camera cam;
+        random_spheres_camera(cam);
+        cam.image_width = 160;
+        cam.samples_per_pixel = 8;
+        cam.max_depth = 10;
+        cam.show_progress = false;
+
+        compiled_scene flat(world);
+        std::ostringstream out;
+        start = bench_clock::now();
+        cam.render(flat, materials, out);
+        double time = seconds_since(start);
+
+        int height = int(cam.samples_spent.size()) / cam.image_width;
+        double samples =
+            double(cam.image_width) * height * cam.samples_per_pixel;
+
+        std::printf("%-10d %10.1f %12.1f %14.1f %12.3f %14.3f\n", count,
+                    build_time * 1e3, memory / 1e6, flattened / 1e6,
+                    rays.size() / ray_time / 1e6, samples / time / 1e6);
+
+        auto name = "instancing/" + std::to_string(count);
+        record(name, "build_ms", build_time * 1e3);
+        record(name, "bytes_per_instance", double(top.memory_bytes()) / count);
+        record(name, "memory_ratio", memory / flattened);
+        record(name, "rays_per_second", rays.size() / ray_time);
+        record(name, "samples_per_second", samples / time);
+    }
+}
+
+static void bench_wide() {
+    // Binary bvh against the quantized 4 and 8 wide trees over the same
+    // primitives: node memory and rays per second
+    std::printf("%-10s %-6s %12s %10s %12s %12s\n", "spheres", "tree",
+                "build ms", "nodes", "B/prim", "Mrays/s");
+
+    for (int count : {10000, 100000, 1000000}) {
+        material_table materials;
+        auto world = random_sphere_volume(count, materials);
+        auto rays = random_rays(world, 500000);
+        int reference = -1;
+
+        auto run = [&](const char *name, const auto &tree, double build_time,
+                       size_t nodes, size_t bytes) {
+            int hits;
+            double time = trace(tree, rays, hits);
+
+            if (reference < 0)
+                reference = hits;
+            else if (hits != reference)
+                std::fprintf(stderr, "%s disagrees: %d vs %d hits\n", name,
+                             hits, reference);
+
+            double per_prim = double(bytes) / count;
+            double rate = rays.size() / time / 1e6;
+
+            std::printf("%-10d %-6s %12.1f %10zu %12.1f %12.3f\n", count, name,
+                        build_time * 1e3, nodes, per_prim, rate);
+
+            auto key = "wide/" + std::to_string(count) + "/" + name;
+            record(key, "build_ms", build_time * 1e3);
+            record(key, "node_bytes_per_primitive", per_prim);
+            record(key, "rays_per_second", rate * 1e6);
+        };
+
+        auto start = bench_clock::now();
+        bvh binary(world);
+        double build_time = seconds_since(start);
+        run("bvh2", binary, build_time, binary.node_count(),
+            binary.node_count() * sizeof(bvh_node));
+
+        start = bench_clock::now();
+        wide_bvh<4> wide4(world);
+        build_time = seconds_since(start);
+        run("bvh4", wide4, build_time, wide4.node_count(),
+            wide4.memory_bytes());
+
+        start = bench_clock::now();
+        wide_bvh<8> wide8(world);
+        build_time = seconds_since(start);
+        run("bvh8", wide8, build_time, wide8.node_count(),
+            wide8.memory_bytes());
+    }
+}
+
+static void bench_animation() {
+    // A hundred frames moving a few spheres of a large volume: refit and
+    // partial rebuild per frame against a full rebuild, and what the
+    // updated tree costs in traversal against a fresh one
+    std::printf("%-8s %-8s %8s %12s %12s %12s %12s\n", "spheres", "motion",
+                "moved", "full ms", "update ms", "rebuilt", "Mrays/s");
+
+    for (bool teleport : {false, true}) {
+        const int count = 100000, per_frame = 100, frames = 100;
+        material_table materials;
+        auto world = random_sphere_volume(count, materials);
+        double extent = 2 * std::cbrt(double(count));
+
+        bvh tree(world);
+        double update_time = 0;
+        int rebuilt = 0;
+
+        for (int frame = 0; frame < frames; frame++) {
+            std::vector<int> moved;
+
+            // Jitter moves spheres by up to a radius, teleports anywhere
+            for (int k = 0; k < per_frame; k++) {
+                int i = int(random_double() * count);
+                auto &s = static_cast<sphere &>(*world.objects[i]);
+                point3 to = teleport ? point3(random_double(-extent, extent),
+                                              random_double(-extent, extent),
+                                              random_double(-extent, extent))
+                                     : s.center() + 0.5 * random_unit_vector();
+
+                s.move_to(to);
+                moved.push_back(i);
+            }
+
+            auto start = bench_clock::now();
+            tree.refit(moved);
+            rebuilt += tree.rebuild_degraded();
+            update_time += seconds_since(start);
+        }
+
+        auto start = bench_clock::now();
+        bvh fresh(world);
+        double full_time = seconds_since(start);
+
+        auto rays = random_rays(world, 200000);
+        int hits, fresh_hits;
+        double time = trace(tree, rays, hits);
+        double fresh_time = trace(fresh, rays, fresh_hits);
+
+        if (hits != fresh_hits)
+            std::fprintf(stderr, "updated and fresh bvh disagree: %d vs %d\n",
+                         hits, fresh_hits);
+
+        const char *motion = teleport ? "teleport" : "jitter";
+        double per_frame_ms = update_time / frames * 1e3;
+
+        std::printf("%-8d %-8s %8d %12.2f %12.3f %12d %12.3f\n", count,
+                    motion, per_frame, full_time * 1e3, per_frame_ms,
+                    rebuilt / frames, rays.size() / time / 1e6);
+        std::printf("%-8s %-8s %8s %12s %12s %12s %12.3f\n", "", "fresh", "",
+                    "", "", "", rays.size() / fresh_time / 1e6);
+
+        auto name = std::string("animation/") + motion;
+        record(name, "full_rebuild_ms", full_time * 1e3);
+        record(name, "update_ms_per_frame", per_frame_ms);
+        record(name, "rebuilt_per_frame", double(rebuilt) / frames);
+        record(name, "rays_per_second", rays.size() / time);
+        record(name, "fresh_rays_per_second", rays.size() / fresh_time);
+    }
+}
+
+static void bench_scene_file() {
+    // Startup of the cover scene and of a two million triangle mesh scene:
+    // building in code, or loading the PLY and building its bvh, against
+    // mapping a binary scene file. The first rays after startup include the
+    // page faults of the mapping; the page cache is warm throughout, as the
+    // file has just been written.
+    std::printf("%-6s %-8s %10s %12s %14s %12s\n", "scene", "from",
+                "file MB", "startup ms", "first rays ms", "Mrays/s");
+
+    auto dir = std::filesystem::temp_directory_path();
+    std::string ply_path = (dir / "rtweekend_bench.ply").string();
+    std::string scene_path = (dir / "rtweekend_bench.rtws").string();
+
+    if (!write_ply(ply_path, bumpy_sphere_mesh(1024, 1024))) {
+        std::fprintf(stderr, "cannot write %s\n", ply_path.c_str());
+        return;
+    }
+
+    for (const char *scene : {"cover", "mesh"}) {
+        bool cover = std::strcmp(scene, "cover") == 0;
+        material_table materials;
+        hittable_list source, world;
+        std::string error;
+
+        auto start = bench_clock::now();
+
+        if (cover) {
+            source = random_spheres_scene(materials);
+            world = hittable_list(std::make_shared<compiled_scene>(source));
+        } else {
+            mesh_data mesh;
+
+            if (!load_mesh(ply_path, mesh, error)) {
+                std::fprintf(stderr, "%s: %s\n", ply_path.c_str(),
+                             error.c_str());
+                return;
+            }
+
+            source = world = mesh_scene(materials, std::move(mesh));
+        }
+
+        double build_time = seconds_since(start);
+
+        camera cam;
+        random_spheres_camera(cam);
+
+        if (!write_scene_file(scene_path, source, materials, cam, error)) {
+            std::fprintf(stderr, "%s: %s\n", scene_path.c_str(),
+                         error.c_str());
+            return;
+        }
+
+        // Rays aimed at the spheres or the mesh rather than the ground
+        auto rays = random_rays(*source.objects.back(), 1000000);
+        std::vector<ray> first(rays.begin(), rays.begin() + 1000);
+        int hits, mapped_hits;
+
+        auto run = [&](const char *from, const hittable &object,
+                       double startup, double size) {
+            double first_time = trace(object, first, hits);
+            double time = trace(object, rays, hits);
+
+            std::printf("%-6s %-8s %10.1f %12.2f %14.2f %12.3f\n", scene,
+                        from, size / 1e6, startup * 1e3, first_time * 1e3,
+                        rays.size() / time / 1e6);
+
+            auto name = std::string("scene_file/") + scene + "/" + from;
+            record(name, "startup_ms", startup * 1e3);
+            record(name, "first_rays_ms", first_time * 1e3);
+            record(name, "rays_per_second", rays.size() / time);
+        };
+
+        double size =
+            cover ? 0 : double(std::filesystem::file_size(ply_path));
+        run(cover ? "code" : "ply", world, build_time, size);
+        int built_hits = hits;
+
+        start = bench_clock::now();
+        scene_file mapped;
+        material_table mapped_materials;
+        camera mapped_cam;
+
+        if (!mapped.open(scene_path, error)) {
+            std::fprintf(stderr, "%s: %s\n", scene_path.c_str(),
+                         error.c_str());
+            return;
+        }
+
+        mapped.load_materials(mapped_materials);
+        mapped.load_camera(mapped_cam);
+        double open_time = seconds_since(start);
+
+        run("mapped", mapped, open_time, double(mapped.file_size()));
+        mapped_hits = hits;
+
+        if (mapped_hits != built_hits)
+            std::fprintf(stderr, "mapped and built scenes disagree: %d vs %d\n",
+                         mapped_hits, built_hits);
+    }
+
+    std::filesystem::remove(ply_path);
+    std::filesystem::remove(scene_path);
+}
+
+static void bench_denoise() {
+    // Error against a converged reference of uniform sampling alone and
+    // followed by the denoiser, on the cover scene. A denoised render that
+    // matches the error of a plain one with many times the samples is the
+    // win. Then the filter's own speed at each SIMD level.
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    compiled_scene flat(world);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.show_progress = false;
+
+    // Wider than the adaptive bench: the filter pays off more as features
+    // span more pixels
+    const int reference_spp = 1024;
+    auto start = bench_clock::now();
+    cam.samples_per_pixel = reference_spp;
+    auto reference = cam.render_pixels(flat, materials);
+
+    std::printf("reference: %d spp, %.1f s\n", reference_spp,
+                seconds_since(start));
+    std::printf("%-16s %10s %10s %12s\n", "mode", "render s", "filter s",
+                "display rmse");
+
+    cam.keep_features = true;
+
+    for (int spp : {16, 32, 64, 128, 256}) {
+        cam.samples_per_pixel = spp;
+
+        start = bench_clock::now();
+        auto image = cam.render_pixels(flat, materials);
+        double render_time = seconds_since(start);
+
+        start = bench_clock::now();
+        auto filtered = cam.denoised(image);
+        double filter_time = seconds_since(start);
+
+        for (bool denoised : {false, true}) {
+            double error =
+                display_rmse(denoised ? filtered : image, reference);
+            auto name = (denoised ? "denoised_" : "uniform_") +
+                        std::to_string(spp);
+
+            std::printf("%-16s %10.2f %10.3f %12.5f\n", name.c_str(),
+                        render_time, denoised ? filter_time : 0.0, error);
+            record("denoise/" + name, "render_seconds", render_time);
+            record("denoise/" + name, "display_rmse", error);
+        }
+    }
+
+    // The filter alone on a full size frame
+    cam.image_width = 720;
+    cam.samples_per_pixel = 4;
+    auto image = cam.render_pixels(flat, materials);
+    double pixels = double(image.size());
+    simd_level saved = active_simd_level();
+    std::vector<color> first;
+
+    std::printf("%-16s %10s %12s\n", "filter", "ms", "Mpixels/s");
+
+    for (simd_level level :
+         {simd_level::scalar, simd_level::sse2, simd_level::avx2}) {
+        if (level > saved)
+            continue;
+
+        active_simd_level() = level;
+        start = bench_clock::now();
+        auto filtered = cam.denoised(image);
+        double time = seconds_since(start);
+
+        bool same = first.empty() ||
+                    std::memcmp(filtered.data(), first.data(),
+                                filtered.size() * sizeof(color)) == 0;
+
+        if (first.empty())
+            first = filtered;
+        else if (!same)
+            std::fprintf(stderr, "%s denoiser differs from scalar\n",
+                         simd_level_name(level));
+
+        std::printf("%-16s %10.1f %12.2f\n", simd_level_name(level),
+                    time * 1e3, pixels / time / 1e6);
+        record(std::string("denoise/filter_") + simd_level_name(level),
+               "pixels_per_second", pixels / time);
+    }
+
+    active_simd_level() = saved;
+}
+
+static void bench_stats() {
+    // The render counters of the cover scene through each structure: work
+    // per ray shows what a traversal costs apart from the machine, and the
+    // spread of tile times shows how evenly the work divides
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 8;
+    cam.show_progress = false;
+
+    std::printf("%-10s %10s %12s %12s %12s\n", "structure", "render s",
+                "Mrays/s", "boxes/ray", "prims/ray");
+
+    auto run = [&](const char *name, const hittable &structure) {
+        auto start = bench_clock::now();
+        cam.render_pixels(structure, materials);
+        double time = seconds_since(start);
+        const render_stats &stats = cam.stats;
+        double rays = double(stats.rays());
+
+        std::printf("%-10s %10.3f %12.3f %12.2f %12.2f\n", name, time,
+                    rays / time / 1e6, stats.box_tests / rays,
+                    stats.primitive_tests / rays);
+
+        auto key = std::string("stats/") + name;
+        record(key, "rays_per_second", rays / time);
+        record(key, "box_tests_per_ray", stats.box_tests / rays);
+        record(key, "primitive_tests_per_ray", stats.primitive_tests / rays);
+    };
+
+    run("bvh2", bvh(world));
+    run("bvh4", wide_bvh<4>(world));
+    run("bvh8", wide_bvh<8>(world));
+    run("compiled", compiled_scene(world));
+
+    // Paths and tiles of the last render
+    const render_stats &stats = cam.stats;
+    uint64_t paths = 0, bounces = 0;
+
+    for (int i = 0; i < render_stats::path_buckets; i++) {
+        paths += stats.path_lengths[i];
+        bounces += i * stats.path_lengths[i];
+    }
+
+    std::printf("hits:");
+
+    for (int i = 0; i < render_stats::material_kinds; i++)
+        std::printf(" %s %llu", material_names[i],
+                    (unsigned long long)stats.hits[i]);
+
+    std::printf(", escaped %llu, absorbed %llu, depth limited %llu\n",
+                (unsigned long long)stats.escaped,
+                (unsigned long long)stats.absorbed,
+                (unsigned long long)stats.depth_limited);
+
+    double slowest = 0, total = 0;
+
+    for (const tile_stats &tile : cam.tile_timings) {
+        slowest = std::max(slowest, tile.seconds);
+        total += tile.seconds;
+    }
+
+    double mean = total / cam.tile_timings.size();
+
+    std::printf("mean bounces %.3f, slowest tile %.2fx the mean\n",
+                double(bounces) / paths, slowest / mean);
+    record("stats/paths", "mean_bounces", double(bounces) / paths);
+    record("stats/tiles", "slowest_over_mean", slowest / mean);
+}
+
+static void bench_wavefront() {
+    // Depth first against wavefront tracing of the same samples, which must
+    // give the same image, over wavefront sizes and tile sizes. Bigger
+    // tiles let a wavefront hold more paths.
+    material_table materials;
+    auto world = random_spheres_scene(materials);
+    compiled_scene flat(world);
+
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 32;
+    cam.show_progress = false;
+
+    auto start = bench_clock::now();
+    auto reference = cam.render_pixels(flat, materials);
+    double reference_time = seconds_since(start);
+    double samples = double(reference.size()) * cam.samples_per_pixel;
+
+    std::printf("%-22s %10s %14s\n", "integrator", "render s",
+                "Msamples/s");
+    std::printf("%-22s %10.3f %14.3f\n", "depth_first", reference_time,
+                samples / reference_time / 1e6);
+    record("wavefront/depth_first", "samples_per_second",
+           samples / reference_time);
+
+    cam.wavefront = true;
+
+    for (int tile : {16, 64}) {
+        for (int size : {1024, 8192, 65536}) {
+            cam.tile_size = tile;
+            cam.wavefront_size = size;
+
+            start = bench_clock::now();
+            auto image = cam.render_pixels(flat, materials);
+            double time = seconds_since(start);
+
+            if (std::memcmp(image.data(), reference.data(),
+                            image.size() * sizeof(color)) != 0)
+                std::fprintf(stderr, "wavefront image differs\n");
+
+            auto name = "tile" + std::to_string(tile) + "_wave" +
+                        std::to_string(size);
+
+            std::printf("%-22s %10.3f %14.3f\n", name.c_str(), time,
+                        samples / time / 1e6);
+            record("wavefront/" + name, "samples_per_second",
+                   samples / time);
+        }
+    }
+}
+
+static hittable_list glass_spheres_scene(material_table &materials) {
+    // Two layers of touching glass balls on a grey floor, among a few
+    // diffuse and metal ones, so that most paths bounce many times
+    hittable_list world;
+
+    auto ground = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    auto glass = materials.add(dielectric(1.5));
+    auto red = materials.add(lambertian(color(0.7, 0.2, 0.1)));
+    auto gold = materials.add(metal(color(0.8, 0.6, 0.3), 0.1));
+
+    world.add(std::make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
+
+    for (int layer = 0; layer < 2; layer++) {
+        for (int a = -3; a <= 3; a++) {
+            for (int b = -3; b <= 3; b++) {
+                point3 center(a + 0.5 * layer, 0.5 + 0.8 * layer,
+                              b + 0.5 * layer);
+                uint32_t mat = glass;
+
+                if ((a + b + layer) % 5 == 0)
+                    mat = layer ? gold : red;
+
+                world.add(std::make_shared<sphere>(center, 0.5, mat));
+            }
+        }
+    }
+
+    return world;
+}
+
+static void bench_roulette() {
+    // Equal sample renders with and without russian roulette against a
+    // converged reference without it. Roulette trades shorter paths for
+    // more noise per sample, so the figure of merit is the inverse of
+    // error squared times time. The mean luminance checks for bias.
+    std::printf("%-18s %9s %9s %12s %12s %11s\n", "mode", "render s",
+                "bounces", "display rmse", "efficiency", "mean ratio");
+
+    auto luminance_sum = [](const std::vector<color> &image) {
+        double sum = 0;
+
+        for (const color &c : image)
+            sum += 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+
+        return sum;
+    };
+
+    auto run = [&](const char *scene, const hittable &world,
+                   const material_table &materials, camera &cam) {
+        cam.image_width = 240;
+        cam.show_progress = false;
+        cam.russian_roulette = false;
+        cam.samples_per_pixel = 1024;
+        auto reference = cam.render_pixels(world, materials);
+        double reference_sum = luminance_sum(reference);
+
+        cam.samples_per_pixel = 32;
+
+        for (bool roulette : {false, true}) {
+            cam.russian_roulette = roulette;
+
+            auto start = bench_clock::now();
+            auto image = cam.render_pixels(world, materials);
+            double time = seconds_since(start);
+            double error = display_rmse(image, reference);
+            double efficiency = 1 / (error * error * time);
+            auto name = std::string(scene) + (roulette ? "_roulette" : "");
+
+            std::printf("%-18s %9.3f %9.3f %12.5f %12.0f %11.4f\n",
+                        name.c_str(), time, cam.stats.mean_path_length(),
+                        error, efficiency,
+                        luminance_sum(image) / reference_sum);
+            record("roulette/" + name, "render_seconds", time);
+            record("roulette/" + name, "mean_path_length",
+                   cam.stats.mean_path_length());
+            record("roulette/" + name, "display_rmse", error);
+            record("roulette/" + name, "efficiency", efficiency);
+        }
+    };
+
+    material_table cover_materials;
+    compiled_scene cover(random_spheres_scene(cover_materials));
+    camera cover_cam;
+    random_spheres_camera(cover_cam);
+    run("cover", cover, cover_materials, cover_cam);
+
+    material_table glass_materials;
+    compiled_scene glass(glass_spheres_scene(glass_materials));
+    camera glass_cam;
+    random_spheres_camera(glass_cam);
+    glass_cam.look_from = point3(7, 5, 9);
+    glass_cam.look_at = point3(0, 0.5, 0);
+    glass_cam.vfov = 40;
+    glass_cam.defocus_angle = 0;
+    run("glass", glass, glass_materials, glass_cam);
+}
+
+static void bench_lights() {
+    // The night scene at equal samples, first with only the bsdf finding
+    // its small lamps, then sampling them directly and weighting both by
+    // the power heuristic, against a converged reference. Then shadow
+    // queries, which stop at any hit, against closest hit queries over
+    // the same segments.
+    material_table materials;
+    hittable_list scene = night_spheres_scene(materials);
+    auto lights = std::make_shared<light_list>(scene, materials);
+    compiled_scene world(scene);
+    camera cam;
+    night_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.show_progress = false;
+    cam.lights = lights;
+
+    auto luminance_sum = [](const std::vector<color> &image) {
+        double sum = 0;
+
+        for (const color &c : image)
+            sum += 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+
+        return sum;
+    };
+
+    cam.samples_per_pixel = 1024;
+    auto reference = cam.render_pixels(world, materials);
+    double reference_sum = luminance_sum(reference);
+
+    std::printf("%u lights\n%-10s %9s %12s %12s %11s\n",
+                unsigned(lights->size()), "mode", "render s", "display rmse",
+                "efficiency", "mean ratio");
+
+    cam.samples_per_pixel = 32;
+
+    for (bool sampled : {false, true}) {
+        cam.lights = sampled ? lights : nullptr;
+
+        auto start = bench_clock::now();
+        auto image = cam.render_pixels(world, materials);
+        double time = seconds_since(start);
+        double error = display_rmse(image, reference);
+        double efficiency = 1 / (error * error * time);
+        const char *name = sampled ? "nee_mis" : "bsdf";
+
+        std::printf("%-10s %9.3f %12.5f %12.0f %11.4f\n", name, time, error,
+                    efficiency, luminance_sum(image) / reference_sum);
+        record(std::string("lights/") + name, "render_seconds", time);
+        record(std::string("lights/") + name, "display_rmse", error);
+        record(std::string("lights/") + name, "efficiency", efficiency);
+    }
+
+    // Segments between random points of the scene bounds
+    seed_thread_rng(2);
+    auto rays = random_rays(world, 1 << 20);
+    interval segment(0.001, 0.999);
+    int blocked = 0, hits = 0;
+    hit_record rec;
+
+    auto start = bench_clock::now();
+
+    for (const auto &r : rays)
+        blocked += world.occluded(r, segment);
+
+    double any_time = seconds_since(start);
+    start = bench_clock::now();
+
+    for (const auto &r : rays)
+        hits += world.hit(r, segment, rec);
+
+    double closest_time = seconds_since(start);
+
+    std::printf("shadow rays: occluded %.2f Mrays/s, hit %.2f Mrays/s, "
+                "%d of %d blocked%s\n",
+                rays.size() / any_time / 1e6, rays.size() / closest_time / 1e6,
+                blocked, int(rays.size()),
+                blocked == hits ? "" : " (MISMATCH)");
+    record("lights/occluded", "mrays_per_second",
+           rays.size() / any_time / 1e6);
+    record("lights/hit", "mrays_per_second", rays.size() / closest_time / 1e6);
+}
+
+static void bench_distributed() {
+    // The cover scene rendered in this process, then by a coordinator and
+    // three single thread workers over localhost. A fourth worker takes a
+    // list of tiles and hangs up without rendering them, which must see
+    // them requeued, and the two frames must match bit for bit.
+    material_table materials;
+    compiled_scene world(random_spheres_scene(materials));
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 16;
+    cam.show_progress = false;
+
+    auto start = bench_clock::now();
+    auto local = cam.render_pixels(world, materials);
+    double local_time = seconds_since(start);
+
+    render_coordinator coordinator;
+    coordinator.show_progress = false;
+    std::string error;
+
+    if (!coordinator.listen(0, error)) {
+        std::printf("distributed: %s\n", error.c_str());
+        return;
+    }
+
+    int port = coordinator.port();
+    std::vector<camera> worker_cams(3, cam);
+    std::atomic<bool> quitter_done = false;
+    std::vector<std::thread> threads;
+
+    threads.emplace_back([&] {
+        std::string quitter_error;
+        int fd = connect_to("127.0.0.1", port, 10, quitter_error);
+
+        if (fd >= 0) {
+            worker_hello hello = {};
+            std::memcpy(hello.magic, "RTWTILES", 8);
+            hello.version = tile_protocol_version;
+            hello.threads = 1;
+            hello.fingerprint =
+                frame_fingerprint(worker_cams[0], world, materials);
+            message_header header;
+            std::vector<char> payload;
+
+            send_message(fd, hello_message, &hello, sizeof(hello));
+            receive_message(fd, header, payload);
+            ::close(fd);
+        }
+
+        quitter_done = true;
+    });
+
+    for (camera &worker_cam : worker_cams) {
+        worker_cam.thread_count = 1;
+
+        threads.emplace_back([&] {
+            while (!quitter_done)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            std::string worker_error;
+            render_worker().serve("127.0.0.1", port, worker_cam, world,
+                                  materials, worker_error);
+        });
+    }
+
+    std::vector<color> frame;
+    start = bench_clock::now();
+    bool rendered = coordinator.render(cam, world, materials, frame, error);
+    double distributed_time = seconds_since(start);
+
+    for (auto &thread : threads)
+        thread.join();
+
+    bool identical = rendered && frame.size() == local.size();
+
+    for (size_t p = 0; identical && p < frame.size(); p++)
+        for (int k = 0; k < 3; k++)
+            identical = identical && frame[p][k] == local[p][k];
+
+    std::printf("local %.3f s, 3 workers %.3f s, %d lost, %d tiles "
+                "requeued, frames %s\n",
+                local_time, distributed_time, coordinator.workers_lost,
+                coordinator.tiles_requeued,
+                identical ? "identical" : "DIFFER");
+    record("distributed/local", "render_seconds", local_time);
+    record("distributed/workers", "render_seconds", distributed_time);
+    record("distributed/workers", "tiles_requeued",
+           coordinator.tiles_requeued);
+    record("distributed/workers", "identical", identical);
+}
+
+static void bench_progressive() {
+    // The cover scene at 64 samples in passes of 16, saved after each,
+    // against one render straight through. Then the same passes again in
+    // a child process killed part way and resumed here, and as a render
+    // to 32 samples extended to 64: both must match the uninterrupted
+    // passes bit for bit. The float sums cost the straight render's image
+    // a little precision, measured as display rmse.
+    material_table materials;
+    compiled_scene world(random_spheres_scene(materials));
+    camera cam;
+    random_spheres_camera(cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 64;
+    cam.pass_samples = 16;
+    cam.show_progress = false;
+
+    auto dir = std::filesystem::temp_directory_path();
+    std::string path = (dir / "rtweekend_bench_accumulation.bin").string();
+    std::string error;
+    std::vector<color> progressive, resumed, extended;
+
+    auto start = bench_clock::now();
+    auto straight = cam.render_pixels(world, materials);
+    double straight_time = seconds_since(start);
+
+    std::filesystem::remove(path);
+    start = bench_clock::now();
+
+    if (!cam.render_progressive(world, materials, path, progressive, error)) {
+        std::printf("progressive: %s\n", error.c_str());
+        return;
+    }
+
+    double progressive_time = seconds_since(start);
+    auto file_size = std::filesystem::file_size(path);
+
+    // Killed once its first pass is saved, unless it ended before
+    std::filesystem::remove(path);
+    pid_t child = fork();
+
+    if (child == 0) {
+        cam.render_progressive(world, materials, path, resumed, error);
+        _exit(0);
+    }
+
+    for (int passes = 0;
+         passes < 1 && waitpid(child, nullptr, WNOHANG) == 0;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        accumulation_header header = {};
+        std::ifstream in(path, std::ios::binary);
+
+        if (in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+            passes = int(header.passes);
+    }
+
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    bool resume_ok =
+        cam.render_progressive(world, materials, path, resumed, error);
+
+    std::filesystem::remove(path);
+    cam.samples_per_pixel = 32;
+    bool extend_ok =
+        cam.render_progressive(world, materials, path, extended, error);
+    cam.samples_per_pixel = 64;
+    extend_ok = extend_ok &&
+                cam.render_progressive(world, materials, path, extended, error);
+    std::filesystem::remove(path);
+
+    auto same = [&](const std::vector<color> &image) {
+        bool identical = image.size() == progressive.size();
+
+        for (size_t p = 0; identical && p < image.size(); p++)
+            for (int k = 0; k < 3; k++)
+                identical = identical && image[p][k] == progressive[p][k];
+
+        return identical;
+    };
+
+    bool resume_same = resume_ok && same(resumed);
+    bool extend_same = extend_ok && same(extended);
+    double error_vs_straight = display_rmse(progressive, straight);
+
+    std::printf("straight %.3f s, progressive %.3f s, file %.2f MB, "
+                "display rmse %.2e\nkilled and resumed %s, extended %s\n",
+                straight_time, progressive_time, file_size / 1e6,
+                error_vs_straight, resume_same ? "identical" : "DIFFER",
+                extend_same ? "identical" : "DIFFER");
+    record("progressive/straight", "render_seconds", straight_time);
+    record("progressive/passes", "render_seconds", progressive_time);
+    record("progressive/passes", "display_rmse", error_vs_straight);
+    record("progressive/resumed", "identical", resume_same);
+    record("progressive/extended", "identical", extend_same);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json_path = nullptr;
+    std::vector<const char *> sections;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json_path = argv[++i];
+        else
+            sections.push_back(argv[i]);
+    }
+
+    // With no sections run everything, otherwise only the named ones
+    auto selected = [&](const char *name) {
+        if (sections.empty())
+            return true;
+
+        for (const char *section : sections)
+            if (std::strcmp(section, name) == 0)
+                return true;
+
+        return false;
+    };
+
+    if (selected("micro"))
+        bench_micro();
+
+    if (selected("render"))
+        bench_render();
+
+    if (selected("bvh"))
+        bench_bvh();
+
+    if (selected("rng"))
+        bench_rng();
+
+    if (selected("samplers"))
+        bench_samplers();
+
+    if (selected("simd"))
+        bench_simd();
+
+    if (selected("scene"))
+        bench_scene();
+
+    if (selected("image"))
+        bench_image();
+
+    if (selected("adaptive"))
+        bench_adaptive();
+
+    if (selected("precision"))
+        bench_precision();
+
+    if (selected("mesh"))
+        bench_mesh();
+
+    if (selected("instancing"))
+        bench_instancing();
+
+    if (selected("wide"))
+        bench_wide();
+
+    if (selected("animation"))
+        bench_animation();
+
+    if (selected("scene_file"))
+        bench_scene_file();
+
+    if (selected("denoise"))
+        bench_denoise();
+
+    if (selected("stats"))
+        bench_stats();
+
+    if (selected("wavefront"))
+        bench_wavefront();
+
+    if (selected("roulette"))
+        bench_roulette();
+
+    if (selected("lights"))
+        bench_lights();
+
+    if (selected("distributed"))
+        bench_distributed();
+
+    if (selected("progressive"))
+        bench_progressive();
+
+    if (json_path && !write_json(json_path)) {
+        std::fprintf(stderr, "cannot write %s\n", json_path);
+        return 1;
+    }
+
+    return 0;
+}
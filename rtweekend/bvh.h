@@ -0,0 +1,811 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "aabb_kernels.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+struct bvh_node {
+    aabb bbox;
+    int first; // left child for interior nodes (right is first + 1), or the
+               // first primitive index for leaves
+    int count; // number of primitives in a leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; };
+};
+
+class bvh_builder {
+  public:
+    // Binned surface area heuristic builder over a set of primitive bounding
+    // boxes. It knows nothing about the primitives themselves, the caller
+    // reorders its primitives with the returned order so leaves can address
+    // them as contiguous ranges.
+    static constexpr int bin_count = 16;
+    static constexpr int max_leaf_size = 4;
+    static constexpr int max_depth = 64; // traversal stack size
+
+    static constexpr double traversal_cost = 1.0;
+    static constexpr double intersection_cost = 1.0;
+
+    bvh_builder(const std::vector<aabb> &boxes) : boxes(boxes) {
+        centroids.reserve(boxes.size());
+
+        for (const auto &box : boxes)
+            centroids.push_back(box.centroid());
+    };
+
+    void build(std::vector<bvh_node> &nodes, std::vector<int> &order) {
+        nodes.clear();
+        order.resize(boxes.size());
+
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = int(i);
+
+        nodes.reserve(2 * boxes.size());
+        nodes.push_back({aabb(), 0, int(boxes.size())});
+
+        if (boxes.empty())
+            return;
+
+        build_subtree(nodes, order, 0, 0);
+    };
+
+    void build_subtree(std::vector<bvh_node> &nodes, std::vector<int> &order,
+                       int root, int root_depth) {
+        // Splits the leaf nodes[root] until the SAH says stop. Children are
+        // appended to nodes, so this also rebuilds a subtree of an existing
+        // hierarchy in place.
+        struct task {
+            int node;
+            int depth;
+        };
+
+        std::vector<task> pending = {{root, root_depth}};
+
+        while (!pending.empty()) {
+            auto [node_index, depth] = pending.back();
+            pending.pop_back();
+
+            int first = nodes[node_index].first;
+            int count = nodes[node_index].count;
+
+            nodes[node_index].bbox = range_bounds(order, first, count);
+
+            if (count <= 1)
+                continue;
+
+            int mid = split(nodes[node_index].bbox, order, first, count, depth);
+
+            if (mid < 0)
+                continue;
+
+            int left = int(nodes.size());
+            nodes.push_back({aabb(), first, mid - first});
+            nodes.push_back({aabb(), mid, first + count - mid});
+
+            nodes[node_index].first = left;
+            nodes[node_index].count = 0;
+
+            pending.push_back({left, depth + 1});
+            pending.push_back({left + 1, depth + 1});
+        }
+    };
+
+  private:
+    const std::vector<aabb> &boxes;
+    std::vector<point3> centroids;
+
+    struct bin {
+        aabb bbox;
+        int count = 0;
+    };
+
+    aabb range_bounds(const std::vector<int> &order, int first,
+                      int count) const {
+        aabb bbox;
+
+        for (int i = first; i < first + count; i++)
+            bbox = aabb(bbox, boxes[order[i]]);
+
+        return bbox;
+    };
+
+    int split(const aabb &bbox, std::vector<int> &order, int first, int count,
+              int depth) {
+        // Returns the partition point of the primitive range, or -1 to keep
+        // the range as a leaf
+        aabb centroid_bounds;
+
+        for (int i = first; i < first + count; i++) {
+            const point3 &c = centroids[order[i]];
+            centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+        }
+
+        int best_axis = -1;
+        int best_bin = 0;
+        double best_cost = infinity;
+
+        // Deep trees would overflow the traversal stack, fall back to object
+        // median splits which finish in log2(count) levels.
+        bool force_median = depth >= max_depth - 32;
+
+        for (int axis = 0; axis < 3 && !force_median; axis++) {
+            const interval &extent = centroid_bounds.axis_interval(axis);
+
+            if (extent.size() <= 0)
+                continue;
+
+            bin bins[bin_count];
+            double scale = bin_count / extent.size();
+
+            for (int i = first; i < first + count; i++) {
+                int b = bin_index(centroids[order[i]][axis], extent.min, scale);
+                bins[b].count++;
+                bins[b].bbox = aabb(bins[b].bbox, boxes[order[i]]);
+            }
+
+            // Sweep from the right to get the cost of every right half, then
+            // from the left to combine it with every left half
+            double right_area[bin_count - 1];
+            int right_count[bin_count - 1];
+            aabb right_box;
+            int right_sum = 0;
+
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_box = aabb(right_box, bins[b].bbox);
+                right_sum += bins[b].count;
+                right_area[b - 1] = right_box.surface_area();
+                right_count[b - 1] = right_sum;
+            }
+
+            aabb left_box;
+            int left_sum = 0;
+
+            for (int b = 0; b < bin_count - 1; b++) {
+                left_box = aabb(left_box, bins[b].bbox);
+                left_sum += bins[b].count;
+
+                if (left_sum == 0 || right_count[b] == 0)
+                    continue;
+
+                double cost = left_box.surface_area() * left_sum +
+                              right_area[b] * right_count[b];
+
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        double parent_area = bbox.surface_area();
+        double leaf_cost = intersection_cost * count;
+        double split_cost =
+            parent_area > 0
+                ? traversal_cost + intersection_cost * best_cost / parent_area
+                : infinity;
+
+        if (best_axis >= 0 &&
+            (split_cost < leaf_cost || count > max_leaf_size)) {
+            const interval &extent = centroid_bounds.axis_interval(best_axis);
+            double scale = bin_count / extent.size();
+
+            auto it = std::partition(
+                order.begin() + first, order.begin() + first + count,
+                [&](int prim) {
+                    return bin_index(centroids[prim][best_axis], extent.min,
+                                     scale) <= best_bin;
+                });
+
+            return int(it - order.begin());
+        }
+
+        if (count <= max_leaf_size)
+            return -1;
+
+        // Every centroid falls in one bin (or we are too deep), split the
+        // range in half along the longest centroid axis instead
+        int axis = centroid_bounds.longest_axis();
+        int mid = first + count / 2;
+
+        std::nth_element(order.begin() + first, order.begin() + mid,
+                         order.begin() + first + count, [&](int a, int b) {
+                             return centroids[a][axis] < centroids[b][axis];
+                         });
+
+        return mid;
+    };
+
+    static int bin_index(double c, double min, double scale) {
+        int b = int((c - min) * scale);
+
+        return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+    };
+};
+
+template <typename Leaf>
+inline bool traverse_closest(const bvh_node *nodes, const ray &r,
+                             interval ray_t, Leaf &&leaf) {
+    // Closest hit traversal of a non empty tree. leaf(first, count, ray_t)
+    // tests the primitives of a leaf, narrows ray_t.max to its closest hit
+    // and returns whether it found one.
+    const point3 &orig = r.origin();
+    const vec3 &dir = r.direction();
+    vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+
+    if (nodes[0].bbox.hit_distance(orig, inv_dir, ray_t) == infinity) {
+        count_traversal(1, 0);
+        return false;
+    }
+
+    struct entry {
+        int node;
+        real t;
+    };
+
+    entry stack[bvh_builder::max_depth];
+    int stack_size = 0;
+    int node_index = 0;
+    bool hit_anything = false;
+    uint64_t box_tests = 1, primitive_tests = 0;
+
+    while (true) {
+        const bvh_node &node = nodes[node_index];
+
+        if (node.is_leaf()) {
+            primitive_tests += node.count;
+
+            if (leaf(node.first, node.count, ray_t))
+                hit_anything = true;
+        } else {
+            // Visit the nearer child first and defer the other one
+            int near = node.first;
+            int far = node.first + 1;
+            box_tests += 2;
+
+            real t_near = nodes[near].bbox.hit_distance(orig, inv_dir, ray_t);
+            real t_far = nodes[far].bbox.hit_distance(orig, inv_dir, ray_t);
+
+            if (t_far < t_near) {
+                std::swap(near, far);
+                std::swap(t_near, t_far);
+            }
+
+            if (t_near != infinity) {
+                if (t_far != infinity)
+                    stack[stack_size++] = {far, t_far};
+
+                node_index = near;
+                continue;
+            }
+        }
+
+        // Pop the next subtree that still lies in front of the closest hit
+        while (stack_size > 0 && stack[stack_size - 1].t > ray_t.max)
+            stack_size--;
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size].node;
+    }
+
+    count_traversal(box_tests, primitive_tests);
+
+    return hit_anything;
+}
+
+template <typename Leaf>
+inline bool traverse_any(const bvh_node *nodes, const ray &r, interval ray_t,
+                         Leaf &&leaf) {
+    // Any hit traversal of a non empty tree, for shadow rays.
+    // leaf(first, count, ray_t) returns whether any primitive of a leaf is
+    // hit inside ray_t, and the first one that does ends the search. Order
+    // does not matter, so children are visited as they are stored.
+    const point3 &orig = r.origin();
+    const vec3 &dir = r.direction();
+    vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+
+    if (nodes[0].bbox.hit_distance(orig, inv_dir, ray_t) == infinity) {
+        count_traversal(1, 0);
+        return false;
+    }
+
+    int stack[bvh_builder::max_depth];
+    int stack_size = 0;
+    int node_index = 0;
+    uint64_t box_tests = 1, primitive_tests = 0;
+
+    while (true) {
+        const bvh_node &node = nodes[node_index];
+
+        if (node.is_leaf()) {
+            primitive_tests += node.count;
+
+            if (leaf(node.first, node.count, ray_t)) {
+                count_traversal(box_tests, primitive_tests);
+                return true;
+            }
+        } else {
+            int left = node.first;
+            int right = node.first + 1;
+            box_tests += 2;
+
+            bool enter_left =
+                nodes[left].bbox.hit_distance(orig, inv_dir, ray_t) !=
+                infinity;
+            bool enter_right =
+                nodes[right].bbox.hit_distance(orig, inv_dir, ray_t) !=
+                infinity;
+
+            if (enter_left && enter_right)
+                stack[stack_size++] = right;
+
+            if (enter_left || enter_right) {
+                node_index = enter_left ? left : right;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+
+    count_traversal(box_tests, primitive_tests);
+
+    return false;
+}
+
+class bvh : public hittable {
+  public:
+    bvh(const hittable_list &list) : bvh(list.objects) {};
+
+    bvh(const std::vector<std::shared_ptr<hittable>> &src_objects) {
+        std::vector<aabb> boxes;
+        boxes.reserve(src_objects.size());
+
+        for (const auto &object : src_objects)
+            boxes.push_back(object->bounding_box());
+
+        bvh_builder(boxes).build(nodes, source_of);
+
+        objects.reserve(source_of.size());
+        position_of.resize(source_of.size());
+
+        for (size_t pos = 0; pos < source_of.size(); pos++) {
+            objects.push_back(src_objects[source_of[pos]]);
+            position_of[source_of[pos]] = int(pos);
+        }
+
+        if (!objects.empty())
+            link(0, -1);
+
+        full_build_sum = area_sum;
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        if (objects.empty())
+            return false;
+
+        auto leaf = [&](int first, int count, interval &ray_t) {
+            bool hit_anything = false;
+
+            for (int i = first; i < first + count; i++) {
+                if (objects[i]->intersect(r, ray_t, hit)) {
+                    hit_anything = true;
+                    ray_t.max = hit.t;
+                }
+            }
+
+            return hit_anything;
+        };
+
+        return traverse_closest(nodes.data(), r, ray_t, leaf);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        if (objects.empty())
+            return false;
+
+        auto leaf = [&](int first, int count, interval ray_t) {
+            for (int i = first; i < first + count; i++)
+                if (objects[i]->occluded(r, ray_t))
+                    return true;
+
+            return false;
+        };
+
+        return traverse_any(nodes.data(), r, ray_t, leaf);
+    }
+
+    void intersect_packet(ray_packet &packet,
+                          primitive_hit *hits) const override {
+        // Packet traversal: a node is visited once for the whole packet if
+        // any lane enters its box, and leaves hand the packet on to their
+        // objects. Coherent rays visit nearly the same nodes anyway, so this
+        // trades a few wasted lane tests for a single pass over the tree.
+        if (objects.empty())
+            return;
+
+        simd_level level = active_simd_level();
+
+        if (packet_box_entry(level, nodes[0].bbox, packet) == infinity) {
+            count_traversal(packet.count, 0);
+            return;
+        }
+
+        struct entry {
+            int node;
+            real t;
+        };
+
+        entry stack[bvh_builder::max_depth];
+        int stack_size = 0;
+        int node_index = 0;
+        uint64_t box_tests = 1, primitive_tests = 0;
+
+        while (true) {
+            const bvh_node &node = nodes[node_index];
+
+            if (node.is_leaf()) {
+                primitive_tests += node.count;
+
+                for (int i = node.first; i < node.first + node.count; i++)
+                    objects[i]->intersect_packet(packet, hits);
+            } else {
+                int near = node.first;
+                int far = node.first + 1;
+                box_tests += 2;
+
+                real t_near =
+                    packet_box_entry(level, nodes[near].bbox, packet);
+                real t_far =
+                    packet_box_entry(level, nodes[far].bbox, packet);
+
+                if (t_far < t_near) {
+                    std::swap(near, far);
+                    std::swap(t_near, t_far);
+                }
+
+                if (t_near != infinity) {
+                    if (t_far != infinity)
+                        stack[stack_size++] = {far, t_far};
+
+                    node_index = near;
+                    continue;
+                }
+            }
+
+            real packet_max = packet.max_t();
+
+            while (stack_size > 0 && stack[stack_size - 1].t > packet_max)
+                stack_size--;
+
+            if (stack_size == 0)
+                break;
+
+            node_index = stack[--stack_size].node;
+        }
+
+        // Every lane takes part in every test of the packet
+        count_traversal(box_tests * packet.count,
+                        primitive_tests * packet.count);
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    size_t node_count() const { return nodes.size() - dead_nodes; };
+
+    // Animation: move some primitives, refit with their indices in the list
+    // the tree was built from, then rebuild what degraded. Both cost time
+    // in proportion to the primitives moved, not to the scene.
+
+    int refit(const std::vector<int> &moved) {
+        // Recomputes the leaf boxes of the moved primitives and widens or
+        // shrinks their ancestors to match, stopping early where a box comes
+        // out unchanged. Returns the number of nodes updated.
+        int updated = 0;
+
+        for (int source : moved) {
+            int node = leaf_of[position_of[source]];
+
+            while (node >= 0) {
+                aabb box = node_bounds(node);
+
+                if (same_box(box, nodes[node].bbox))
+                    break;
+
+                area_sum -= nodes[node].bbox.surface_area();
+                area_sum += box.surface_area();
+                nodes[node].bbox = box;
+                touched.push_back(node);
+                updated++;
+                node = parents[node];
+            }
+        }
+
+        return updated;
+    };
+
+    double growth(int node) const {
+        // Surface area against the area when the subtree was last built, a
+        // cheap measure of how far refits have loosened it
+        double area = nodes[node].bbox.surface_area();
+
+        return built_area[node] > 0 ? area / built_area[node]
+                                    : (area > 0 ? infinity : 1);
+    };
+
+    int rebuild_degraded(double max_growth = 2) {
+        // Rebuilds the topmost subtrees touched by refits since the last
+        // call that grew past max_growth. Local rebuilds can't bring back
+        // primitives that moved far, so once the summed area of all nodes,
+        // the SAH traversal cost, grows past max_cost_growth times its value
+        // after the last full build the whole tree is rebuilt. Returns the
+        // primitives rebuilt.
+        std::vector<int> roots;
+
+        for (int node : touched) {
+            if (growth(node) <= max_growth)
+                continue;
+
+            // Only the highest degraded ancestor is rebuilt
+            int top = node;
+
+            for (int p = parents[node]; p >= 0; p = parents[p])
+                if (growth(p) > max_growth)
+                    top = p;
+
+            roots.push_back(top);
+        }
+
+        touched.clear();
+        std::sort(roots.begin(), roots.end());
+        roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+
+        std::vector<int> outer;
+        int total = 0;
+
+        for (int root : roots) {
+            if (!inside_any(root, roots)) {
+                outer.push_back(root);
+                total += primitive_range(root).second;
+            }
+        }
+
+        // Past half the primitives one full build is cheaper
+        int rebuilt = 0;
+
+        if (2 * size_t(total) <= objects.size())
+            for (int root : outer)
+                rebuilt += rebuild_subtree(root);
+
+        if (!objects.empty() && (2 * size_t(total) > objects.size() ||
+                                 area_sum > max_cost_growth * full_build_sum)) {
+            rebuilt = rebuild_subtree(0);
+            full_build_sum = area_sum;
+        }
+
+        // Rebuilt subtrees leave their old nodes behind
+        if (dead_nodes > nodes.size() / 2)
+            compact();
+
+        return rebuilt;
+    };
+
+  private:
+    static constexpr double max_cost_growth = 1.25;
+
+    std::vector<bvh_node> nodes;
+    std::vector<std::shared_ptr<hittable>> objects;
+
+    // Bookkeeping for refits and partial rebuilds
+    std::vector<int> source_of;   // list index of the object at a position
+    std::vector<int> position_of; // position of the object at a list index
+    std::vector<int> leaf_of;     // leaf holding the object at a position
+    std::vector<int> parents;     // parent of each node, -1 for the root
+    std::vector<real> built_area; // surface area of each node when built
+    std::vector<int> touched;     // nodes refit since the last rebuild
+    size_t dead_nodes = 0;        // nodes left unused by rebuilds
+    double area_sum = 0;          // surface areas of the live nodes
+    double full_build_sum = 0;    // area_sum after the last full build
+
+    void link(int root, int parent) {
+        // Fills in parents, built areas and leaf_of for a fresh subtree
+        parents.resize(nodes.size());
+        built_area.resize(nodes.size());
+        leaf_of.resize(objects.size());
+
+        std::vector<std::pair<int, int>> pending = {{root, parent}};
+
+        while (!pending.empty()) {
+            auto [node, up] = pending.back();
+            pending.pop_back();
+
+            parents[node] = up;
+            built_area[node] = nodes[node].bbox.surface_area();
+            area_sum += built_area[node];
+
+            if (nodes[node].is_leaf()) {
+                for (int i = 0; i < nodes[node].count; i++)
+                    leaf_of[nodes[node].first + i] = node;
+            } else {
+                pending.push_back({nodes[node].first, node});
+                pending.push_back({nodes[node].first + 1, node});
+            }
+        }
+    };
+
+    aabb node_bounds(int node) const {
+        const bvh_node &n = nodes[node];
+
+        if (!n.is_leaf())
+            return aabb(nodes[n.first].bbox, nodes[n.first + 1].bbox);
+
+        aabb box;
+
+        for (int i = n.first; i < n.first + n.count; i++)
+            box = aabb(box, objects[i]->bounding_box());
+
+        return box;
+    };
+
+    static bool same_box(const aabb &a, const aabb &b) {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval &u = a.axis_interval(axis);
+            const interval &v = b.axis_interval(axis);
+
+            if (u.min != v.min || u.max != v.max)
+                return false;
+        }
+
+        return true;
+    };
+
+    bool inside_any(int node, const std::vector<int> &roots) const {
+        for (int p = parents[node]; p >= 0; p = parents[p])
+            if (std::binary_search(roots.begin(), roots.end(), p))
+                return true;
+
+        return false;
+    };
+
+    std::pair<int, int> primitive_range(int root) const {
+        // First position and count of the primitives under root, which are
+        // one contiguous run from its leftmost leaf to its rightmost
+        int left = root, right = root;
+
+        while (!nodes[left].is_leaf())
+            left = nodes[left].first;
+
+        while (!nodes[right].is_leaf())
+            right = nodes[right].first + 1;
+
+        int first = nodes[left].first;
+
+        return {first, nodes[right].first + nodes[right].count - first};
+    };
+
+    int rebuild_subtree(int root) {
+        // Builds the primitives under root afresh in a scratch tree, then
+        // splices it in place of the old subtree
+        auto [first, count] = primitive_range(root);
+        int depth = 0;
+
+        for (int p = parents[root]; p >= 0; p = parents[p])
+            depth++;
+
+        std::vector<aabb> boxes;
+        boxes.reserve(count);
+
+        for (int i = first; i < first + count; i++)
+            boxes.push_back(objects[i]->bounding_box());
+
+        std::vector<bvh_node> scratch = {{aabb(), 0, count}};
+        std::vector<int> order(count);
+
+        for (int i = 0; i < count; i++)
+            order[i] = i;
+
+        bvh_builder(boxes).build_subtree(scratch, order, 0, depth);
+
+        // The old interior nodes below root are dropped
+        dead_nodes += drop_subtree(root) - 1;
+
+        std::vector<std::shared_ptr<hittable>> moved(count);
+        std::vector<int> sources(count);
+
+        for (int i = 0; i < count; i++) {
+            moved[i] = objects[first + order[i]];
+            sources[i] = source_of[first + order[i]];
+        }
+
+        for (int i = 0; i < count; i++) {
+            objects[first + i] = std::move(moved[i]);
+            source_of[first + i] = sources[i];
+            position_of[sources[i]] = first + i;
+        }
+
+        // Scratch node k > 0 lands at base + k - 1, the root stays put
+        int base = int(nodes.size());
+
+        for (size_t k = 0; k < scratch.size(); k++) {
+            bvh_node n = scratch[k];
+            n.first += n.is_leaf() ? first : base - 1;
+
+            if (k == 0)
+                nodes[root] = n;
+            else
+                nodes.push_back(n);
+        }
+
+        link(root, parents[root]);
+
+        return count;
+    };
+
+    size_t drop_subtree(int root) {
+        // Takes the nodes of a subtree out of the area sums, returns their
+        // count
+        size_t size = 0;
+        std::vector<int> pending = {root};
+
+        while (!pending.empty()) {
+            int node = pending.back();
+            pending.pop_back();
+            size++;
+            area_sum -= nodes[node].bbox.surface_area();
+
+            if (!nodes[node].is_leaf()) {
+                pending.push_back(nodes[node].first);
+                pending.push_back(nodes[node].first + 1);
+            }
+        }
+
+        return size;
+    };
+
+    void compact() {
+        // Copies the live nodes into fresh arrays, siblings kept together
+        std::vector<bvh_node> live = {nodes[0]};
+        std::vector<real> live_area = {built_area[0]};
+        std::vector<int> live_parents = {-1};
+
+        for (size_t i = 0; i < live.size(); i++) {
+            if (live[i].is_leaf()) {
+                for (int k = 0; k < live[i].count; k++)
+                    leaf_of[live[i].first + k] = int(i);
+
+                continue;
+            }
+
+            int old = live[i].first;
+            live[i].first = int(live.size());
+
+            for (int c = old; c < old + 2; c++) {
+                live.push_back(nodes[c]);
+                live_area.push_back(built_area[c]);
+                live_parents.push_back(int(i));
+            }
+        }
+
+        nodes = std::move(live);
+        built_area = std::move(live_area);
+        parents = std::move(live_parents);
+        dead_nodes = 0;
+    };
+};
+
+#endif // !BVH_H
@@ -1,7 +1,23 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "accumulation.h"
+#include "denoiser.h"
+#include "image_writer.h"
+#include "lights.h"
 #include "material.h"
+#include "path_state.h"
+#include "pixel_estimate.h"
+#include "render_stats.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <vector>
 
 class camera {
   public:
@@ -19,31 +35,380 @@ class camera {
     double focus_dist =
         10; // distance from camera loof from point to plane of perfect focus
 
-    void render(const hittable &world) {
+    int thread_count = 0; // render threads, 0 uses every hardware thread
+    int tile_size = 16;   // edge length in pixels of a unit of render work
+    bool show_progress = true; // tile progress and thread stats on std::clog
+    bool packet_camera_rays = true; // trace a pixel's camera rays as packets
+
+    // The wavefront integrator traces the samples of a tile wavefront_size
+    // paths at a time, a bounce at a time with one scatter loop per
+    // material kind, instead of following each path to its end
+    bool wavefront = false;
+    int wavefront_size = 1 << 13;
+
+    // Russian roulette stops paths that have bounced roulette_depth times
+    // at random, each bounce keeping a path with a chance equal to its
+    // throughput's largest component, at most 1. Survivors are scaled up by
+    // the inverse of that chance, so the image stays unbiased.
+    bool russian_roulette = false;
+    int roulette_depth = 5;
+
+    // The geometry and materials of the scene, hashed by whoever built it:
+    // its input file, or whatever chose a built in scene. Part of
+    // sample_fingerprint, which cannot read the content of a world itself.
+    uint64_t scene_hash = 0;
+
+    // Source of the per-sample random numbers, independent uniform if unset
+    std::shared_ptr<sampler> pixel_sampler;
+
+    // Emitters sampled directly at every diffuse or rough metal bounce, with
+    // multiple importance sampling against the material's own scatter.
+    // Without them light is only found by scattering into it.
+    std::shared_ptr<light_list> lights;
+    bool sky = true; // the sky lights the scene, else the background is black
+
+    // Adaptive sampling gives every pixel min_samples, or two if that is
+    // fewer, then keeps adding batches until its estimated error in the
+    // written image drops below noise_threshold or it reaches
+    // samples_per_pixel
+    bool adaptive_sampling = false;
+    int min_samples = 16;
+    double noise_threshold = 0.005;
+
+    std::vector<int> samples_spent; // per pixel, filled by render_pixels
+
+    // A progressive render adds at most pass_samples samples to each pixel
+    // per pass over the frame, saving the sums after every pass
+    int pass_samples = 16;
+
+    // Denoising lets render filter the image before writing it. It keeps
+    // per pixel features while rendering: the mean albedo and normal of each
+    // sample's first diffuse hit, seen through any mirrors and glass before
+    // it, and the variance of the pixel's mean. keep_features fills the
+    // feature buffers without denoising.
+    bool denoise = false;
+    bool keep_features = false;
+    denoiser pixel_denoiser;
+
+    std::vector<color> albedo_buffer;
+    std::vector<vec3> normal_buffer;
+    std::vector<double> variance_buffer;
+
+    // Filled by render_pixels: counters for the frame, and the time and
+    // counters of every tile in row major order
+    render_stats stats;
+    std::vector<tile_stats> tile_timings;
+    double render_seconds = 0;
+
+    image_format output_format = image_format::ppm; // format render writes
+
+    void render(const hittable &world, const material_table &materials,
+                std::ostream &out = std::cout) {
+        write_frame(render_pixels(world, materials), out);
+    };
+
+    void write_frame(std::vector<color> framebuffer,
+                     std::ostream &out = std::cout) {
+        // Denoises a rendered framebuffer if asked, then writes it
+        if (denoise)
+            framebuffer = denoised(framebuffer);
+
+        write_image(out, output_format, image_width, image_height,
+                    framebuffer);
+    };
+
+    std::vector<color> render_pixels(const hittable &world,
+                                     const material_table &materials) {
+        // Renders the image into a row major framebuffer of linear colors
+        auto framebuffer = begin_frame();
+        std::vector<int> tiles(tile_count());
+
+        for (int tile = 0; tile < int(tiles.size()); tile++)
+            tiles[tile] = tile;
+
+        render_tiles(world, materials, tiles, framebuffer);
+
+        return framebuffer;
+    };
+
+    std::vector<color> begin_frame() {
+        // Sets the camera up for a frame and clears the per pixel buffers,
+        // returning a black framebuffer for render_tiles to fill
         initialize();
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        std::vector<color> framebuffer(size_t(image_width) * image_height);
+        samples_spent.assign(framebuffer.size(), 0);
 
-        for (int j = 0; j < image_height; j++) {
-            std::clog << "\nScanlines remaining: " << (image_height - j) << ' '
-                      << std::flush;
+        for (auto *buffer : {&albedo_buffer, &normal_buffer})
+            buffer->assign(wants_features() ? framebuffer.size() : 0,
+                           color(0, 0, 0));
 
-            for (int i = 0; i < image_width; i++) {
-                color pixel_color(0, 0, 0);
-                for (int sample = 0; sample < samples_per_pixel; sample++) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
+        variance_buffer.assign(wants_features() ? framebuffer.size() : 0, 0);
+        tile_timings.assign(tile_count(), {});
+        stats = render_stats();
+        render_seconds = 0;
+
+        return framebuffer;
+    };
+
+    bool render_progressive(const hittable &world,
+                            const material_table &materials,
+                            const std::string &path,
+                            std::vector<color> &framebuffer,
+                            std::string &error) {
+        // Renders in passes, accumulating into the file at path and
+        // starting from what it already holds, until every pixel has
+        // samples_per_pixel or adaptive sampling stops adding any. A file
+        // from a render with fewer samples is extended. Fills framebuffer
+        // and the per pixel buffers as render_pixels would, with stats and
+        // tile timings summed over this call's passes.
+        framebuffer = begin_frame();
+
+        accumulation_file file;
+        uint32_t flags =
+            (adaptive_sampling ? uint32_t(accumulate_variance) : 0u) |
+            (wants_features()
+                 ? uint32_t(accumulate_variance | accumulate_features)
+                 : 0u);
+
+        if (!file.open(path, image_width, image_height,
+                       sample_fingerprint(world, materials), flags, error)) {
+            error = path + ": " + error;
+            return false;
+        }
+
+        std::vector<int> tiles(tile_count());
+
+        for (int tile = 0; tile < int(tiles.size()); tile++)
+            tiles[tile] = tile;
+
+        bool progress = show_progress, ok = true;
+        render_stats totals;
+        std::vector<tile_stats> timings(tiles.size());
+        double seconds = 0;
+        accumulation = &file;
+        show_progress = false;
+
+        for (bool sampling = true; sampling;) {
+            render_tiles(world, materials, tiles, framebuffer);
+
+            if (!(ok = file.commit(error))) {
+                error = path + ": " + error;
+                break;
             }
+
+            totals.merge(stats);
+            seconds += render_seconds;
+
+            for (size_t t = 0; t < tiles.size(); t++) {
+                render_stats counters = timings[t].counters;
+                counters.merge(tile_timings[t].counters);
+                double tile_seconds =
+                    timings[t].seconds + tile_timings[t].seconds;
+
+                timings[t] = tile_timings[t];
+                timings[t].seconds = tile_seconds;
+                timings[t].counters = counters;
+            }
+
+            int fewest = *std::min_element(samples_spent.begin(),
+                                           samples_spent.end());
+            sampling = stats.camera_rays > 0 && fewest < samples_per_pixel;
+
+            if (progress)
+                std::clog << "\rPass " << file.passes() << ": " << fewest
+                          << " to "
+                          << *std::max_element(samples_spent.begin(),
+                                               samples_spent.end())
+                          << " samples per pixel, saved " << std::flush;
+        }
+
+        accumulation = nullptr;
+        show_progress = progress;
+        stats = totals;
+        tile_timings = timings;
+        render_seconds = seconds;
+
+        if (progress && ok)
+            std::clog << "\nDone.\n";
+
+        return ok;
+    };
+
+    uint64_t sample_fingerprint(const hittable &world,
+                                const material_table &materials) const {
+        // A hash of what any one sample of a pixel depends on, so sums
+        // from another scene or camera are not mixed in. The scene is
+        // scene_hash; the bounds and material count only back it up. How
+        // many samples a pixel takes is left out, unless the sampler's
+        // pattern depends on it.
+        uint64_t hash = hash_seed;
+
+        auto add = [&](const auto &value) {
+            hash = hash_bytes(hash, &value, sizeof(value));
+        };
+
+        auto add_vec3 = [&](const vec3 &v) {
+            for (int i = 0; i < 3; i++)
+                add(double(v[i]));
+        };
+
+        add(sizeof(real));
+        add(aspect_ratio);
+        add(image_width);
+        add(max_depth);
+        add(vfov);
+        add_vec3(look_from);
+        add_vec3(look_at);
+        add_vec3(vup);
+        add(defocus_angle);
+        add(focus_dist);
+        add(russian_roulette);
+        add(roulette_depth);
+        add(sky);
+        add(lights ? lights->size() : size_t(0));
+
+        const sampler *smp = pixel_sampler.get();
+        const char *sampler_name = smp ? typeid(*smp).name() : "independent";
+
+        for (const char *c = sampler_name; *c; c++)
+            add(*c);
+
+        if (dynamic_cast<const stratified_sampler *>(smp))
+            add(samples_per_pixel);
+
+        aabb box = world.bounding_box();
+
+        for (int axis = 0; axis < 3; axis++) {
+            add(double(box.axis_interval(axis).min));
+            add(double(box.axis_interval(axis).max));
+        }
+
+        add(materials.size());
+        add(scene_hash);
+
+        return hash;
+    };
+
+    // The tiles of the frame begin_frame set up, numbered in row major order
+    int tile_count() const { return tiles_across() * tiles_down(); };
+
+    void tile_bounds(int tile, int &x0, int &y0, int &x1, int &y1) const {
+        x0 = (tile % tiles_across()) * tile_size;
+        y0 = (tile / tiles_across()) * tile_size;
+        x1 = std::min(x0 + tile_size, image_width);
+        y1 = std::min(y0 + tile_size, image_height);
+    };
+
+    void render_tiles(const hittable &world, const material_table &materials,
+                      const std::vector<int> &tiles,
+                      std::vector<color> &framebuffer) {
+        // Renders the given tiles of the frame into framebuffer and the per
+        // pixel buffers. Every tile comes out the same whichever call or
+        // process renders it, as samples depend only on pixel and index.
+        // stats and render_seconds cover this call.
+        int tile_count = int(tiles.size());
+
+        thread_pool pool(thread_count);
+        std::vector<int> tiles_per_thread(pool.size(), 0);
+        std::vector<render_stats> worker_stats(pool.size());
+        std::vector<wavefront_batch> waves(pool.size());
+        int tiles_remaining = tile_count;
+        std::mutex progress_mutex;
+
+        std::vector<std::unique_ptr<sampler>> samplers;
+
+        for (int i = 0; i < pool.size(); i++) {
+            samplers.push_back(pixel_sampler
+                                   ? pixel_sampler->clone()
+                                   : std::make_unique<independent_sampler>());
+            samplers.back()->set_samples_per_pixel(samples_per_pixel);
         }
 
-        std::clog << "\nDone.\n";
+        auto frame_start = std::chrono::steady_clock::now();
+
+        pool.run(tile_count, [&](int task, int worker) {
+            int tile = tiles[task], x0, y0, x1, y1;
+            tile_bounds(tile, x0, y0, x1, y1);
+
+            // The worker's counters start from zero, so they end up holding
+            // this tile's share
+            render_stats &counters = thread_render_stats();
+            counters = render_stats();
+            auto start = std::chrono::steady_clock::now();
+
+            render_tile(world, materials, framebuffer, *samplers[worker],
+                        waves[worker], x0, y0, x1, y1);
+
+            std::chrono::duration<double> seconds =
+                std::chrono::steady_clock::now() - start;
+            tile_timings[tile] = {x0, y0, x1, y1, worker, seconds.count(),
+                                  counters};
+            worker_stats[worker].merge(counters);
+            tiles_per_thread[worker]++;
+
+            if (!show_progress)
+                return;
+
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::clog << "\rTiles remaining: " << --tiles_remaining << ' '
+                      << std::flush;
+        });
+
+        std::chrono::duration<double> frame_seconds =
+            std::chrono::steady_clock::now() - frame_start;
+        render_seconds = frame_seconds.count();
+        stats = render_stats();
+
+        for (const auto &counters : worker_stats)
+            stats.merge(counters);
+
+        if (show_progress) {
+            // Uneven counts show which threads got stuck in expensive tiles
+            std::clog << "\nTiles per thread:";
+
+            for (int count : tiles_per_thread)
+                std::clog << ' ' << count;
+
+            std::clog << "\nRays: " << stats.camera_rays << " camera, "
+                      << stats.secondary_rays << " secondary, "
+                      << stats.rays() / render_seconds / 1e6 << " Mrays/s"
+                      << "\nMean path length: " << stats.mean_path_length()
+                      << " bounces";
+            std::clog << "\nDone.\n";
+        }
+    };
+
+    std::vector<color> denoised(const std::vector<color> &framebuffer) const {
+        // Filters a framebuffer from the last render_pixels, guided by the
+        // features it kept
+        thread_pool pool(thread_count);
+
+        return pixel_denoiser.filter(pool, image_width, image_height,
+                                     framebuffer, albedo_buffer, normal_buffer,
+                                     variance_buffer);
+    };
+
+    void write_stats(std::ostream &out) const {
+        // The counters and tile timings of the last render_pixels as JSON
+        write_stats_json(out, stats, tile_timings, image_width, image_height,
+                         render_seconds, material_names);
+    };
+
+    std::vector<color> tile_heatmap() const {
+        // Time per pixel of every tile of the last render_pixels, blue for
+        // none up to red for the slowest tile
+        auto cost = tile_cost(tile_timings, image_width, image_height);
+        double slowest = 0;
+
+        for (double c : cost)
+            slowest = std::max(slowest, c);
+
+        return heatmap(cost, slowest);
     };
 
   private:
     int image_height;
-    double pixel_samples_scale;
     point3 center;
     point3 pixel00_loc;
     vec3 pixel_delta_u;
@@ -52,12 +417,21 @@ class camera {
     vec3 defocus_disk_u;
     vec3 defocus_disk_v;
 
+    // Set while render_progressive runs, tiles start from and end in it
+    accumulation_file *accumulation = nullptr;
+
+    int tiles_across() const {
+        return (image_width + tile_size - 1) / tile_size;
+    };
+
+    int tiles_down() const {
+        return (image_height + tile_size - 1) / tile_size;
+    };
+
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        pixel_samples_scale = 1.0 / samples_per_pixel;
-
         center = look_from;
 
         // Determine viewport dimenstions
@@ -96,43 +470,616 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     };
 
-    ray get_ray(int i, int j) const {
-        auto offset = sample_square();
+    void render_tile(const hittable &world, const material_table &materials,
+                     std::vector<color> &framebuffer, sampler &smp,
+                     wavefront_batch &wave, int x0, int y0, int x1, int y1) {
+        int width = x1 - x0;
+        int height = y1 - y0;
+        std::vector<pixel_estimate> estimates(size_t(width) * height);
+        std::vector<int> limits(estimates.size(), samples_per_pixel);
+        std::vector<sample_run> runs;
+
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                size_t p = size_t(j - y0) * width + (i - x0);
+                pixel_estimate &estimate = estimates[p];
+
+                // A progressive pass goes on from the last one
+                if (accumulation) {
+                    accumulation->load(size_t(j) * image_width + i, estimate);
+                    limits[p] = std::min(samples_per_pixel,
+                                         estimate.samples + pass_samples);
+                }
+
+                // Two samples at least, the fewest with a variance
+                int first_batch =
+                    adaptive_sampling
+                        ? std::min(std::max(min_samples, 2), limits[p])
+                        : limits[p];
+
+                if (estimate.samples < first_batch)
+                    runs.push_back(
+                        {i, j, first_batch - estimate.samples, &estimate});
+            }
+        }
+
+        trace_runs(world, materials, smp, wave, runs);
+
+        // Passes over the tile, doubling the samples of every pixel that is
+        // still too noisy. A pixel's error is the larger of its own and its
+        // neighbourhood's mean, which keeps it from stopping on a lucky run
+        // of samples that happened to miss its rare bright paths.
+        std::vector<double> errors(estimates.size());
+        bool refining = adaptive_sampling;
+
+        while (refining) {
+            runs.clear();
+
+            for (size_t p = 0; p < estimates.size(); p++)
+                errors[p] = estimates[p].display_error();
+
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    pixel_estimate &estimate = estimates[y * width + x];
+                    int limit = limits[y * width + x];
+
+                    if (estimate.samples >= limit ||
+                        neighbourhood_error(errors, width, height, x, y) <=
+                            noise_threshold)
+                        continue;
+
+                    int batch = std::max(
+                        1, std::min(estimate.samples, limit - estimate.samples));
+                    runs.push_back({x0 + x, y0 + y, batch, &estimate});
+                }
+            }
+
+            trace_runs(world, materials, smp, wave, runs);
+            refining = !runs.empty();
+        }
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const pixel_estimate &estimate = estimates[y * width + x];
+                size_t index = size_t(y0 + y) * image_width + x0 + x;
+
+                framebuffer[index] = estimate.mean();
+                samples_spent[index] = estimate.samples;
+
+                if (accumulation)
+                    accumulation->store(index, estimate);
+
+                if (wants_features()) {
+                    albedo_buffer[index] = estimate.mean_albedo();
+                    normal_buffer[index] = estimate.mean_normal();
+                    variance_buffer[index] = estimate.mean_variance();
+                }
+            }
+        }
+    };
+
+    static double neighbourhood_error(const std::vector<double> &errors,
+                                      int width, int height, int x, int y) {
+        double sum = 0;
+        int count = 0;
+
+        for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1);
+             ny++) {
+            for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1);
+                 nx++) {
+                sum += errors[ny * width + nx];
+                count++;
+            }
+        }
+
+        return std::max(errors[y * width + x], sum / count);
+    };
+
+    bool wants_features() const { return denoise || keep_features; };
+
+    void trace_runs(const hittable &world, const material_table &materials,
+                    sampler &smp, wavefront_batch &wave,
+                    const std::vector<sample_run> &runs) const {
+        if (wavefront) {
+            trace_wavefront(world, materials, smp, wave, runs);
+            return;
+        }
+
+        for (const sample_run &run : runs)
+            trace_samples(world, materials, smp, run.i, run.j, run.count,
+                          *run.estimate);
+    };
+
+    void trace_wavefront(const hittable &world,
+                         const material_table &materials, sampler &smp,
+                         wavefront_batch &wave,
+                         const std::vector<sample_run> &runs) const {
+        // Every sample of the runs in order, traced in wavefronts. Results
+        // are added to the estimates in sample order, so the image matches
+        // the depth first one.
+        std::vector<wavefront_sample> samples;
+
+        for (const sample_run &run : runs)
+            for (int s = 0; s < run.count; s++)
+                samples.push_back({run.i, run.j, run.estimate->samples + s,
+                                   run.estimate});
+
+        size_t size = std::max(wavefront_size, 1);
+
+        for (size_t first = 0; first < samples.size(); first += size) {
+            size_t count = std::min(size, samples.size() - first);
+
+            wave.start(count);
+            std::copy_n(samples.begin() + first, count, wave.samples.begin());
+            trace_wave(world, materials, smp, wave);
+
+            for (size_t p = 0; p < count; p++) {
+                pixel_estimate &estimate = *wave.samples[p].estimate;
+
+                if (wants_features())
+                    estimate.add_features(wave.albedo[p], wave.normal[p]);
+
+                estimate.add(wave.radiance[p]);
+            }
+        }
+    };
+
+    void trace_wave(const hittable &world, const material_table &materials,
+                    sampler &smp, wavefront_batch &wave) const {
+        // Runs the paths of wave to their ends, a bounce at a time
+        render_stats &counters = thread_render_stats();
+        size_t count = wave.samples.size();
+
+        for (size_t p = 0; p < count; p++) {
+            const wavefront_sample &s = wave.samples[p];
+
+            smp.start_pixel_sample(s.i, s.j, s.sample);
+            wave.rays[p] = get_ray(s.i, s.j, smp);
+        }
+
+        counters.camera_rays += count;
+
+        for (int bounce = 0; !wave.active.empty(); bounce++) {
+            if (bounce >= max_depth) {
+                for (uint32_t p : wave.active) {
+                    counters.depth_limited++;
+                    counters.end_path(bounce);
+                    wave.finish(p, color(0, 0, 0), color(0, 0, 0),
+                                vec3(0, 0, 0));
+                }
+
+                break;
+            }
+
+            intersect_wave(world, wave, bounce, counters);
+            wave.compact();
+            wave.bucket(materials);
+
+            for (int kind = 0; kind < wavefront_batch::material_kinds; kind++)
+                counters.hits[kind] += wave.queues[kind].size();
+
+            // Only diffuse hits give features
+            for (uint32_t p : wave.queues[0])
+                wave.record_features(p,
+                                     wave.throughput[p] *
+                                         materials.albedo(wave.hits[p].mat),
+                                     wave.hits[p].normal);
+
+            scatter_queue<lambertian>(world, materials, smp, wave,
+                                      wave.queues[0], bounce, counters);
+            scatter_queue<metal>(world, materials, smp, wave, wave.queues[1],
+                                 bounce, counters);
+            scatter_queue<dielectric>(world, materials, smp, wave,
+                                      wave.queues[2], bounce, counters);
+            scatter_queue<diffuse_light>(world, materials, smp, wave,
+                                         wave.queues[3], bounce, counters);
+            wave.compact();
+        }
+    };
+
+    void intersect_wave(const hittable &world, wavefront_batch &wave,
+                        int bounce, render_stats &counters) const {
+        // Finds the hit of every active path, finishing the ones that miss.
+        // Camera rays go as packets of consecutive samples, which share a
+        // pixel.
+        auto miss = [&](uint32_t p) {
+            color c = wave.throughput[p] * background(wave.rays[p]);
+
+            counters.escaped++;
+            counters.end_path(bounce);
+            wave.finish(p, c, c, vec3(0, 0, 0));
+            wave.alive[p] = 0;
+        };
+
+        for (uint32_t p : wave.active)
+            wave.alive[p] = 1;
+
+        if (bounce > 0)
+            counters.secondary_rays += wave.active.size();
+
+        if (bounce > 0 || !packet_camera_rays) {
+            for (uint32_t p : wave.active)
+                if (!world.hit(wave.rays[p], interval(0.001, infinity),
+                               wave.hits[p]))
+                    miss(p);
+
+            return;
+        }
+
+        const std::vector<uint32_t> &active = wave.active;
+
+        for (size_t first = 0; first < active.size();
+             first += ray_packet::size) {
+            int size = int(std::min(size_t(ray_packet::size),
+                                    active.size() - first));
+            ray_packet packet(0.001);
+            primitive_hit hits[ray_packet::size];
+
+            for (int k = 0; k < size; k++)
+                packet.add(wave.rays[active[first + k]]);
+
+            world.intersect_packet(packet, hits);
+
+            for (int k = 0; k < size; k++) {
+                uint32_t p = active[first + k];
+
+                if (packet.hit[k])
+                    hits[k].object->surface(wave.rays[p], hits[k],
+                                            wave.hits[p]);
+                else
+                    miss(p);
+            }
+        }
+    };
+
+    template <typename T>
+    void scatter_queue(const hittable &world,
+                       const material_table &materials, sampler &smp,
+                       wavefront_batch &wave,
+                       const std::vector<uint32_t> &queue, int bounce,
+                       render_stats &counters) const {
+        // Scatters every path in queue off a material of kind T, so the loop
+        // runs the same code for each path. Emission and light samples are
+        // gathered first, in the same order as trace_path.
+        for (uint32_t p : queue) {
+            const wavefront_sample &s = wave.samples[p];
+            const hit_record &rec = wave.hits[p];
+
+            // Each path resumes its own sample at this bounce's dimensions
+            smp.start_pixel_sample(s.i, s.j, s.sample);
+
+            if (materials.emissive(rec.mat))
+                wave.radiance[p] +=
+                    wave.throughput[p] *
+                    emitted_light(materials, wave.rays[p], rec,
+                                  wave.scatter_pdf[p]);
+
+            if (samples_lights(materials, rec.mat))
+                wave.radiance[p] +=
+                    wave.throughput[p] *
+                    direct_light(world, materials, wave.rays[p], rec, bounce,
+                                 smp);
+
+            smp.set_dimension(sampler::camera_dimensions +
+                              bounce * sampler::bounce_dimensions);
+
+            ray scattered;
+            color attenuation;
+
+            if (!std::get<T>(materials[rec.mat])
+                     .scatter(wave.rays[p], rec, attenuation, scattered,
+                              smp)) {
+                counters.absorbed++;
+                counters.end_path(bounce);
+                wave.finish(p, color(0, 0, 0), color(0, 0, 0), rec.normal);
+                wave.alive[p] = 0;
+                continue;
+            }
+
+            wave.scatter_pdf[p] = scatter_density(materials, wave.rays[p], rec,
+                                                  scattered);
+            wave.throughput[p] = wave.throughput[p] * attenuation;
+            wave.rays[p] = scattered;
+
+            if (!survives_roulette(wave.throughput[p], bounce, smp)) {
+                counters.roulette_ended++;
+                counters.end_path(bounce + 1);
+                wave.finish(p, color(0, 0, 0), color(0, 0, 0),
+                            vec3(0, 0, 0));
+                wave.alive[p] = 0;
+            }
+        }
+    };
+
+    void trace_samples(const hittable &world, const material_table &materials,
+                       sampler &smp, int i, int j, int count,
+                       pixel_estimate &estimate) const {
+        // Adds the next count samples of pixel (i, j) to its estimate
+        if (packet_camera_rays && max_depth > 0)
+            sample_packets(world, materials, smp, i, j, count, estimate);
+        else
+            sample_rays(world, materials, smp, i, j, count, estimate);
+    };
+
+    void sample_rays(const hittable &world, const material_table &materials,
+                     sampler &smp, int i, int j, int count,
+                     pixel_estimate &estimate) const {
+        int first = estimate.samples;
+
+        for (int sample = first; sample < first + count; sample++) {
+            // Samples depend on pixel and sample number only, so the image
+            // does not depend on which thread rendered a tile
+            smp.start_pixel_sample(i, j, sample);
+            thread_render_stats().camera_rays++;
+
+            path_state path(get_ray(i, j, smp));
+            hit_record rec;
+            estimate.add(trace_path(path, rec, false, world, materials, smp,
+                                    wants_features() ? &estimate : nullptr));
+        }
+    };
+
+    void sample_packets(const hittable &world, const material_table &materials,
+                        sampler &smp, int i, int j, int count,
+                        pixel_estimate &estimate) const {
+        // The camera rays of one pixel start from nearly the same point in
+        // nearly the same direction, so they are intersected as packets.
+        // Each path then continues on its own from its first hit.
+        int end = estimate.samples + count;
+
+        for (int first = estimate.samples; first < end;
+             first += ray_packet::size) {
+            int size = std::min(ray_packet::size, end - first);
+
+            ray_packet packet(0.001);
+            primitive_hit hits[ray_packet::size];
+
+            for (int k = 0; k < size; k++) {
+                smp.start_pixel_sample(i, j, first + k);
+                packet.add(get_ray(i, j, smp));
+            }
+
+            thread_render_stats().camera_rays += size;
+
+            world.intersect_packet(packet, hits);
+
+            for (int k = 0; k < size; k++) {
+                // Restarting the sample is fine, each bounce seeks to its
+                // own sampler dimensions
+                smp.start_pixel_sample(i, j, first + k);
+
+                path_state path(packet.get(k));
+
+                if (!packet.hit[k]) {
+                    thread_render_stats().escaped++;
+                    thread_render_stats().end_path(0);
+                    estimate.add(background(path.r));
+
+                    if (wants_features())
+                        estimate.add_features(background(path.r),
+                                              vec3(0, 0, 0));
+
+                    continue;
+                }
+
+                hit_record rec;
+                hits[k].object->surface(path.r, hits[k], rec);
+                estimate.add(
+                    trace_path(path, rec, true, world, materials, smp,
+                               wants_features() ? &estimate : nullptr));
+            }
+        }
+    };
+
+    ray get_ray(int i, int j, sampler &smp) const {
+        auto offset = sample_square(smp);
         auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) +
                             ((j + offset.y()) * pixel_delta_v);
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        auto lens_sample = smp.get_2d();
+        auto ray_origin =
+            (defocus_angle <= 0) ? center : defocus_disk_sample(lens_sample);
         auto ray_direction = pixel_sample - ray_origin;
 
         return ray(ray_origin, ray_direction);
     };
 
-    vec3 sample_square() const {
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    vec3 sample_square(sampler &smp) const {
+        auto u = smp.get_2d();
+
+        return vec3(u.x() - 0.5, u.y() - 0.5, 0);
     };
 
-    vec3 defocus_disk_sample() const {
-        auto p = random_in_unit_disk();
+    vec3 defocus_disk_sample(const vec3 &u) const {
+        auto p = sample_unit_disk(u);
 
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world) const {
-        // if we exceed the ray bounce limit, no more light is required
-        if (depth <= 0)
-            return color(0, 0, 0);
+    color trace_path(path_state &path, hit_record &rec, bool hit_known,
+                     const hittable &world, const material_table &materials,
+                     sampler &smp, pixel_estimate *features = nullptr) const {
+        // Follows a path until it escapes to the background, is absorbed or
+        // runs out of bounces. rec is reused for every hit, and holds the
+        // first one already when hit_known is set. features, if given, gets
+        // the path's first diffuse hit, or what the path ended on before
+        // finding one.
+        auto record_features = [&](const color &albedo, const vec3 &normal) {
+            if (features)
+                features->add_features(albedo, normal);
+
+            features = nullptr;
+        };
 
-        hit_record rec;
+        render_stats &counters = thread_render_stats();
+
+        for (;; path.bounce++) {
+            // if we exceed the ray bounce limit, no more light is gathered
+            if (path.bounce >= max_depth) {
+                counters.depth_limited++;
+                counters.end_path(path.bounce);
+                record_features(color(0, 0, 0), vec3(0, 0, 0));
+                return path.radiance;
+            }
+
+            // Camera rays are counted where they are made
+            if (!hit_known && path.bounce > 0)
+                counters.secondary_rays++;
+
+            if (!hit_known &&
+                !world.hit(path.r, interval(0.001, infinity), rec)) {
+                counters.escaped++;
+                counters.end_path(path.bounce);
+                record_features(path.throughput * background(path.r),
+                                vec3(0, 0, 0));
+                return path.radiance + path.throughput * background(path.r);
+            }
+
+            hit_known = false;
+            counters.hits[materials.kind(rec.mat)]++;
+
+            if (materials.emissive(rec.mat))
+                path.radiance +=
+                    path.throughput *
+                    emitted_light(materials, path.r, rec, path.scatter_pdf);
+
+            if (features && materials.diffuse(rec.mat))
+                record_features(path.throughput * materials.albedo(rec.mat),
+                                rec.normal);
+
+            if (samples_lights(materials, rec.mat))
+                path.radiance +=
+                    path.throughput * direct_light(world, materials, path.r,
+                                                   rec, path.bounce, smp);
+
+            // Every bounce owns a fixed block of sampler dimensions
+            smp.set_dimension(sampler::camera_dimensions +
+                              path.bounce * sampler::bounce_dimensions);
 
-        if (world.hit(r, interval(0.001, infinity), rec)) {
             ray scattered;
             color attenuation;
 
-            if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-                return attenuation * ray_color(scattered, depth - 1, world);
+            if (!materials.scatter(rec.mat, path.r, rec, attenuation,
+                                   scattered, smp)) {
+                counters.absorbed++;
+                counters.end_path(path.bounce);
+                record_features(color(0, 0, 0), rec.normal);
+                return path.radiance;
             }
 
-            return color(0, 0, 0);
+            path.scatter_pdf =
+                scatter_density(materials, path.r, rec, scattered);
+            path.throughput = path.throughput * attenuation;
+            path.r = scattered;
+
+            if (!survives_roulette(path.throughput, path.bounce, smp)) {
+                counters.roulette_ended++;
+                counters.end_path(path.bounce + 1);
+                record_features(color(0, 0, 0), vec3(0, 0, 0));
+                return path.radiance;
+            }
         }
+    };
+
+    bool samples_lights(const material_table &materials, uint32_t id) const {
+        return lights && !lights->empty() && materials.samples_lights(id);
+    };
+
+    double scatter_density(const material_table &materials, const ray &r_in,
+                           const hit_record &rec,
+                           const ray &scattered) const {
+        // The density of a scatter direction, only needed to weigh the
+        // emitters it may hit against light samples
+        if (!samples_lights(materials, rec.mat))
+            return 0;
+
+        return materials.pdf(rec.mat, r_in, rec, scattered.direction());
+    };
+
+    color emitted_light(const material_table &materials, const ray &r,
+                        const hit_record &rec, double scatter_pdf) const {
+        // The emission a path finds at rec after scattering into r with
+        // density scatter_pdf. If a light sample could have found the same
+        // point, the two are weighed by the power heuristic.
+        color emit = materials.emitted(rec.mat);
+
+        if (scatter_pdf <= 0 || !lights || lights->empty())
+            return emit;
+
+        double light_pdf = lights->pdf(r.origin(), r.direction(),
+                                       rec.t * r.direction().length());
+
+        return power_heuristic(scatter_pdf, light_pdf) * emit;
+    };
+
+    color direct_light(const hittable &world, const material_table &materials,
+                       const ray &r_in, const hit_record &rec, int bounce,
+                       sampler &smp) const {
+        // Next event estimation: one point on a light, drawn from the last
+        // three dimensions of the bounce's block, and a shadow ray to it
+        smp.set_dimension(sampler::camera_dimensions +
+                          bounce * sampler::bounce_dimensions + 3);
+
+        double u_pick = smp.get_1d();
+        light_sample s;
+
+        if (!lights->sample(rec.p, u_pick, smp.get_2d(), s))
+            return color(0, 0, 0);
+
+        double scatter_pdf = materials.pdf(rec.mat, r_in, rec, s.direction);
+
+        if (scatter_pdf <= 0)
+            return color(0, 0, 0);
+
+        // Stops short of the light, so its own surface does not count
+        thread_render_stats().shadow_rays++;
+
+        if (world.occluded(ray(rec.p, s.direction),
+                           interval(0.001, s.distance * (1 - 1e-3))))
+            return color(0, 0, 0);
+
+        // The BSDF times the cosine is the attenuation times scatter_pdf
+        double weight = power_heuristic(s.pdf, scatter_pdf);
+
+        return (weight * scatter_pdf / s.pdf) * materials.albedo(rec.mat) *
+               s.radiance;
+    };
+
+    static double power_heuristic(double pdf, double other_pdf) {
+        double a = pdf * pdf, b = other_pdf * other_pdf;
+
+        return a / (a + b);
+    };
+
+    bool survives_roulette(color &throughput, int bounce,
+                           sampler &smp) const {
+        // Plays russian roulette after the scatter of bounce, scaling
+        // throughput up if the path goes on. The draw is dimension 2 of the
+        // bounce's block, after the two scatter dimensions and before the
+        // three of the light sample.
+        if (!russian_roulette || bounce + 1 < roulette_depth)
+            return true;
+
+        double survival = std::fmin(
+            1, std::fmax(throughput.x(),
+                         std::fmax(throughput.y(), throughput.z())));
+
+        if (survival >= 1)
+            return true;
+
+        smp.set_dimension(sampler::camera_dimensions +
+                          bounce * sampler::bounce_dimensions + 2);
+
+        if (smp.get_1d() >= survival)
+            return false;
+
+        throughput = throughput / survival;
+
+        return true;
+    };
+
+    color background(const ray &r) const {
+        if (!sky)
+            return color(0, 0, 0);
 
         vec3 unit_direction = unit_vector(r.direction());
         auto a = 0.5 * (unit_direction.y() + 1.0);
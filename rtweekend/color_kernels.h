@@ -0,0 +1,138 @@
+#ifndef COLOR_KERNELS_H
+#define COLOR_KERNELS_H
+
+#include "color.h"
+#include "interval.h"
+#include "simd.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Gamma correction and 8 bit quantization of a whole buffer of linear color
+// components, in scalar, SSE2 and AVX2 flavours for either precision. Every
+// flavour produces the same bytes as write_color: square roots are correctly
+// rounded either way, and max(v, 0) maps negative and NaN components to 0
+// like linear_to_gamma.
+
+inline void quantize_scalar(const real *in, uint8_t *out, size_t n) {
+    static const interval intensity(0.000, 0.999);
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = uint8_t(int(256 * intensity.clamp(linear_to_gamma(in[i]))));
+}
+
+#if defined(RTW_X86) && !defined(RTW_FLOAT)
+inline void quantize_sse2(const double *in, uint8_t *out, size_t n) {
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(0.999);
+    const __m128d scale = _mm_set1_pd(256);
+
+    auto to_int = [&](const double *p) {
+        __m128d v = _mm_sqrt_pd(_mm_max_pd(_mm_loadu_pd(p), zero));
+
+        return _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(v, top), scale));
+    };
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_unpacklo_epi64(to_int(in + i), to_int(in + i + 2));
+        __m128i hi = _mm_unpacklo_epi64(to_int(in + i + 4), to_int(in + i + 6));
+        __m128i words = _mm_packs_epi32(lo, hi);
+
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+
+    quantize_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline void
+quantize_avx2(const double *in, uint8_t *out, size_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d top = _mm256_set1_pd(0.999);
+    const __m256d scale = _mm256_set1_pd(256);
+
+    auto to_int = [&](const double *p) __attribute__((target("avx2"))) {
+        __m256d v = _mm256_sqrt_pd(_mm256_max_pd(_mm256_loadu_pd(p), zero));
+
+        return _mm256_cvttpd_epi32(
+            _mm256_mul_pd(_mm256_min_pd(v, top), scale));
+    };
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_packs_epi32(to_int(in + i), to_int(in + i + 4));
+        __m128i hi = _mm_packs_epi32(to_int(in + i + 8), to_int(in + i + 12));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    quantize_scalar(in + i, out + i, n - i);
+}
+#endif
+
+#if defined(RTW_X86) && defined(RTW_FLOAT)
+inline void quantize_sse2(const real *in, uint8_t *out, size_t n) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 top = _mm_set1_ps(0.999f);
+    const __m128 scale = _mm_set1_ps(256);
+
+    auto to_int = [&](const real *p) {
+        __m128 v = _mm_sqrt_ps(_mm_max_ps(_mm_loadu_ps(p), zero));
+
+        return _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(v, top), scale));
+    };
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_packs_epi32(to_int(in + i), to_int(in + i + 4));
+        __m128i hi = _mm_packs_epi32(to_int(in + i + 8), to_int(in + i + 12));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    quantize_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline void
+quantize_avx2(const real *in, uint8_t *out, size_t n) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 top = _mm256_set1_ps(0.999f);
+    const __m256 scale = _mm256_set1_ps(256);
+
+    auto to_words = [&](const real *p) __attribute__((target("avx2"))) {
+        __m256 v = _mm256_sqrt_ps(_mm256_max_ps(_mm256_loadu_ps(p), zero));
+        __m256i ints =
+            _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(v, top), scale));
+
+        return _mm_packs_epi32(_mm256_castsi256_si128(ints),
+                               _mm256_extracti128_si256(ints, 1));
+    };
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = to_words(in + i), hi = to_words(in + i + 8);
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    quantize_scalar(in + i, out + i, n - i);
+}
+#endif
+
+inline void quantize(simd_level level, const real *in, uint8_t *out,
+                     size_t n) {
+#ifdef RTW_X86
+    if (level == simd_level::avx2)
+        return quantize_avx2(in, out, n);
+    if (level == simd_level::sse2)
+        return quantize_sse2(in, out, n);
+#endif
+
+    quantize_scalar(in, out, n);
+}
+
+#endif // !COLOR_KERNELS_H
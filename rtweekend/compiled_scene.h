@@ -0,0 +1,371 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "aabb_kernels.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+#include "sphere.h"
+#include "sphere_kernels.h"
+
+#include <cstdint>
+#include <vector>
+
+class compiled_scene : public hittable {
+  public:
+    // The spheres of a list flattened into contiguous buffers behind one
+    // bvh. Centers and squared radii are packed four to a cache aligned
+    // block for the kernels, radii and material indices sit in parallel
+    // arrays indexed like the block lanes. Traversal never goes through a
+    // pointer per object. Objects that are not spheres stay in a plain list
+    // and are tested after the spheres.
+    compiled_scene(const hittable_list &list) {
+        std::vector<std::shared_ptr<sphere>> spheres;
+        std::vector<aabb> boxes;
+
+        for (const auto &object : list.objects) {
+            auto s = std::dynamic_pointer_cast<sphere>(object);
+
+            if (s) {
+                spheres.push_back(s);
+                boxes.push_back(s->bounding_box());
+            } else {
+                others.add(object);
+            }
+        }
+
+        bbox = list.bounding_box();
+
+        if (spheres.empty())
+            return;
+
+        std::vector<int> order;
+        std::vector<bvh_node> tree;
+        bvh_builder(boxes).build(tree, order);
+        collapse(tree);
+
+        // Leaves start on a block boundary, so they address their spheres as
+        // a range of whole blocks: first is the first block and count the
+        // number of blocks.
+        for (auto &node : nodes) {
+            if (!node.is_leaf())
+                continue;
+
+            int first_block = int(blocks.size());
+
+            for (int i = 0; i < node.count; i++) {
+                const sphere &s = *spheres[order[node.first + i]];
+                int lane = i % sphere_block::lanes;
+
+                if (lane == 0) {
+                    blocks.emplace_back();
+                    radii.resize(radii.size() + sphere_block::lanes, 0);
+                    material_ids.resize(radii.size(), 0);
+                }
+
+                size_t index = radii.size() - sphere_block::lanes + lane;
+
+                blocks.back().set(lane, s.center(), s.radius());
+                radii[index] = s.radius();
+                material_ids[index] = s.material_id();
+            }
+
+            node.first = first_block;
+            node.count = int(blocks.size()) - first_block;
+        }
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        int closest = blocks.empty() ? -1 : closest_sphere(r, ray_t);
+
+        // Anything else only counts if it is in front of the closest sphere
+        if (others.intersect(r, ray_t, hit))
+            return true;
+
+        if (closest < 0)
+            return false;
+
+        hit = {ray_t.max, this, uint32_t(closest)};
+
+        return true;
+    }
+
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        set_hit_record(int(hit.prim), r, hit.t, rec);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        if (!blocks.empty()) {
+            simd_level level = active_simd_level();
+
+            auto leaf = [&](int first, int count, interval ray_t) {
+                // Counted as one primitive test per block, not per lane
+                for (int b = first; b < first + count; b++) {
+                    real t;
+
+                    if (hit_sphere_block(level, blocks[b], r, ray_t, t) >= 0)
+                        return true;
+                }
+
+                return false;
+            };
+
+            if (traverse_any(nodes.data(), r, ray_t, leaf))
+                return true;
+        }
+
+        return others.occluded(r, ray_t);
+    }
+
+    void intersect_packet(ray_packet &packet,
+                          primitive_hit *hits) const override {
+        if (!blocks.empty()) {
+            int closest[ray_packet::size];
+            closest_spheres(packet, closest);
+
+            for (int k = 0; k < packet.count; k++) {
+                if (closest[k] >= 0)
+                    hits[k] = {packet.t_max[k], this, uint32_t(closest[k])};
+            }
+        }
+
+        others.intersect_packet(packet, hits);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    std::vector<bvh_node> nodes;
+    std::vector<sphere_block> blocks;
+    std::vector<real> radii;
+    std::vector<uint32_t> material_ids;
+    hittable_list others;
+    aabb bbox;
+
+    struct entry {
+        int node;
+        real t;
+    };
+
+    void collapse(const std::vector<bvh_node> &tree) {
+        // Copies the builder's tree into nodes depth first, so a subtree is
+        // one contiguous run of memory. Subtrees that fit in a block become a
+        // single leaf: the kernel tests four spheres for the price of one.
+        // Children always come after their parent, so one backwards pass
+        // gives every subtree's sphere count and first sphere.
+        std::vector<int> size(tree.size()), first(tree.size());
+
+        for (size_t i = tree.size(); i-- > 0;) {
+            const bvh_node &node = tree[i];
+
+            size[i] = node.is_leaf() ? node.count
+                                     : size[node.first] + size[node.first + 1];
+            first[i] = node.is_leaf() ? node.first : first[node.first];
+        }
+
+        struct copy {
+            int from;
+            int to;
+        };
+
+        nodes.assign(1, bvh_node());
+        std::vector<copy> pending = {{0, 0}};
+
+        while (!pending.empty()) {
+            auto [from, to] = pending.back();
+            pending.pop_back();
+
+            const bvh_node &node = tree[from];
+
+            if (node.is_leaf() || size[from] <= sphere_block::lanes) {
+                nodes[to] = {node.bbox, first[from], size[from]};
+                continue;
+            }
+
+            int left = int(nodes.size());
+            nodes.resize(nodes.size() + 2);
+            nodes[to] = {node.bbox, left, 0};
+
+            pending.push_back({node.first + 1, left + 1});
+            pending.push_back({node.first, left});
+        }
+    };
+
+    int closest_sphere(const ray &r, interval &ray_t) const {
+        // Index of the closest sphere hit, narrowing ray_t.max to its root
+        simd_level level = active_simd_level();
+        const point3 &orig = r.origin();
+        const vec3 &dir = r.direction();
+        vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+
+        if (nodes[0].bbox.hit_distance(orig, inv_dir, ray_t) == infinity) {
+            count_traversal(1, 0);
+            return -1;
+        }
+
+        entry stack[bvh_builder::max_depth];
+        int stack_size = 0;
+        int node_index = 0;
+        int closest = -1;
+        uint64_t box_tests = 1, primitive_tests = 0;
+
+        while (true) {
+            const bvh_node &node = nodes[node_index];
+
+            if (node.is_leaf()) {
+                // A block counts as all its lanes, padding included
+                primitive_tests += node.count * sphere_block::lanes;
+
+                for (int b = node.first; b < node.first + node.count; b++) {
+                    real t;
+                    int lane = hit_sphere_block(level, blocks[b], r, ray_t, t);
+
+                    if (lane >= 0) {
+                        closest = b * sphere_block::lanes + lane;
+                        ray_t.max = t;
+                    }
+                }
+            } else {
+                int near = node.first;
+                int far = node.first + 1;
+                box_tests += 2;
+
+                real t_near =
+                    nodes[near].bbox.hit_distance(orig, inv_dir, ray_t);
+                real t_far =
+                    nodes[far].bbox.hit_distance(orig, inv_dir, ray_t);
+
+                if (t_far < t_near) {
+                    std::swap(near, far);
+                    std::swap(t_near, t_far);
+                }
+
+                if (t_near != infinity) {
+                    if (t_far != infinity)
+                        stack[stack_size++] = {far, t_far};
+
+                    node_index = near;
+                    continue;
+                }
+            }
+
+            while (stack_size > 0 && stack[stack_size - 1].t > ray_t.max)
+                stack_size--;
+
+            if (stack_size == 0)
+                break;
+
+            node_index = stack[--stack_size].node;
+        }
+
+        count_traversal(box_tests, primitive_tests);
+
+        return closest;
+    };
+
+    void closest_spheres(ray_packet &packet, int *closest) const {
+        // Packet version of closest_sphere, one index per lane
+        simd_level level = active_simd_level();
+
+        for (int k = 0; k < ray_packet::size; k++)
+            closest[k] = -1;
+
+        if (packet_box_entry(level, nodes[0].bbox, packet) == infinity) {
+            count_traversal(packet.count, 0);
+            return;
+        }
+
+        entry stack[bvh_builder::max_depth];
+        int stack_size = 0;
+        int node_index = 0;
+        uint64_t box_tests = 1, primitive_tests = 0;
+
+        while (true) {
+            const bvh_node &node = nodes[node_index];
+
+            if (node.is_leaf()) {
+                primitive_tests += node.count * sphere_block::lanes;
+
+                for (int b = node.first; b < node.first + node.count; b++)
+                    hit_block_packet(level, b, packet, closest);
+            } else {
+                int near = node.first;
+                int far = node.first + 1;
+                box_tests += 2;
+
+                real t_near =
+                    packet_box_entry(level, nodes[near].bbox, packet);
+                real t_far =
+                    packet_box_entry(level, nodes[far].bbox, packet);
+
+                if (t_far < t_near) {
+                    std::swap(near, far);
+                    std::swap(t_near, t_far);
+                }
+
+                if (t_near != infinity) {
+                    if (t_far != infinity)
+                        stack[stack_size++] = {far, t_far};
+
+                    node_index = near;
+                    continue;
+                }
+            }
+
+            real packet_max = packet.max_t();
+
+            while (stack_size > 0 && stack[stack_size - 1].t > packet_max)
+                stack_size--;
+
+            if (stack_size == 0)
+                break;
+
+            node_index = stack[--stack_size].node;
+        }
+
+        count_traversal(box_tests * packet.count,
+                        primitive_tests * packet.count);
+    };
+
+    void hit_block_packet(simd_level level, int b, ray_packet &packet,
+                          int *closest) const {
+        const sphere_block &block = blocks[b];
+
+        for (int lane = 0; lane < sphere_block::lanes; lane++) {
+            if (block.r2[lane] < 0)
+                break;
+
+            point3 center(block.cx[lane], block.cy[lane], block.cz[lane]);
+            real roots[ray_packet::size];
+            int mask =
+                hit_sphere_packet(level, packet, center, block.r2[lane], roots);
+
+            for (; mask != 0; mask &= mask - 1) {
+                int k = std::countr_zero(unsigned(mask));
+
+                closest[k] = b * sphere_block::lanes + lane;
+                packet.t_max[k] = roots[k];
+                packet.hit[k] = true;
+            }
+        }
+    };
+
+    void set_hit_record(int index, const ray &r, real root,
+                        hit_record &rec) const {
+        // Same surface as sphere::set_hit_record, from the flat buffers
+        const sphere_block &block = blocks[index / sphere_block::lanes];
+        int lane = index % sphere_block::lanes;
+        point3 center(block.cx[lane], block.cy[lane], block.cz[lane]);
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radii[index];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = material_ids[index];
+    };
+};
+
+#endif // !COMPILED_SCENE_H
@@ -0,0 +1,326 @@
+#ifndef DENOISE_KERNELS_H
+#define DENOISE_KERNELS_H
+
+#include "simd.h"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// One pass of the edge avoiding a-trous filter over a row of planar single
+// precision buffers, in scalar, SSE2 and AVX2 flavours. Every output pixel
+// is a weighted mean of 5x5 taps spaced step pixels apart. The B3 spline
+// weight of a tap is scaled down by how much it differs from the centre in
+// color, relative to the centre's standard error, in albedo and in normal.
+// Taps outside the image are left out. The vector flavours only run where
+// every tap of the row lies inside the image, and do the same operations
+// in the same order as the scalar one, so all of them produce the same
+// bits.
+
+struct denoise_planes {
+    // width * height floats each. color and variance are the pass input,
+    // the guides stay the same for every pass.
+    const float *color[3];
+    const float *variance;
+    const float *albedo[3];
+    const float *normal[3];
+};
+
+struct denoise_output {
+    float *color[3];
+    float *variance;
+};
+
+struct atrous_pass {
+    int width, height;
+    int step;           // tap spacing, 2^pass
+    float color_sigma2; // allowed color difference, in variances
+    float albedo_scale; // 1 / albedo_sigma^2
+    float normal_scale; // 1 / normal_sigma^2
+};
+
+constexpr float atrous_kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f,
+                                    1 / 16.0f};
+
+// Keeps a pixel with no variance from dividing by zero
+constexpr float atrous_variance_floor = 1e-10f;
+
+// e^-x = 2^-t with t = x log2(e), split into the nearest integer power of
+// two and a Taylor series for the remaining fraction in [-0.5, 0.5],
+// accurate to about 5e-5, which is plenty for weights. t is capped, so
+// large differences give a weight of 2^-20 rather than an underflow, and the
+// squared weights in the variance stay clear of denormals.
+constexpr float atrous_log2e = 1.44269504f;
+constexpr float atrous_max_exponent = 20;
+constexpr float atrous_exp_terms[5] = {1.0f, -0.693147182f, 0.240226507f,
+                                        -0.0555041097f, 0.0096181286f};
+
+inline float atrous_exp_scalar(float x) {
+    float t = x * atrous_log2e;
+    t = t < atrous_max_exponent ? t : atrous_max_exponent;
+
+    int whole = int(t + 0.5f);
+    float f = t - float(whole);
+    float p = atrous_exp_terms[4];
+
+    for (int k = 3; k >= 0; k--)
+        p = p * f + atrous_exp_terms[k];
+
+    return p * std::bit_cast<float>(uint32_t(127 - whole) << 23);
+}
+
+inline void atrous_pixels_scalar(const denoise_planes &in,
+                                 const atrous_pass &pass, int y, int x0,
+                                 int x1, const denoise_output &out) {
+    for (int x = x0; x < x1; x++) {
+        size_t p = size_t(y) * pass.width + x;
+        float color_scale =
+            1 / (in.variance[p] * pass.color_sigma2 + atrous_variance_floor);
+        float sum_w = 0, sum_v = 0, sum_c[3] = {0, 0, 0};
+
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * pass.step;
+
+            if (qy < 0 || qy >= pass.height)
+                continue;
+
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * pass.step;
+
+                if (qx < 0 || qx >= pass.width)
+                    continue;
+
+                size_t q = size_t(qy) * pass.width + qx;
+                float dc = 0, da = 0, dn = 0;
+
+                for (int k = 0; k < 3; k++) {
+                    float d = in.color[k][p] - in.color[k][q];
+                    dc = dc + d * d;
+                    d = in.albedo[k][p] - in.albedo[k][q];
+                    da = da + d * d;
+                    d = in.normal[k][p] - in.normal[k][q];
+                    dn = dn + d * d;
+                }
+
+                float e = dc * color_scale + da * pass.albedo_scale +
+                          dn * pass.normal_scale;
+                float w = atrous_kernel[dy + 2] * atrous_kernel[dx + 2] *
+                          atrous_exp_scalar(e);
+
+                sum_w = sum_w + w;
+                sum_v = sum_v + w * w * in.variance[q];
+
+                for (int k = 0; k < 3; k++)
+                    sum_c[k] = sum_c[k] + w * in.color[k][q];
+            }
+        }
+
+        for (int k = 0; k < 3; k++)
+            out.color[k][p] = sum_c[k] / sum_w;
+
+        out.variance[p] = sum_v / (sum_w * sum_w);
+    }
+}
+
+#ifdef RTW_X86
+inline __m128 atrous_exp_sse2(__m128 x) {
+    __m128 t = _mm_min_ps(_mm_mul_ps(x, _mm_set1_ps(atrous_log2e)),
+                          _mm_set1_ps(atrous_max_exponent));
+    __m128i whole = _mm_cvttps_epi32(_mm_add_ps(t, _mm_set1_ps(0.5f)));
+    __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(whole));
+    __m128 p = _mm_set1_ps(atrous_exp_terms[4]);
+
+    for (int k = 3; k >= 0; k--)
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(atrous_exp_terms[k]));
+
+    __m128i bits =
+        _mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127), whole), 23);
+
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+inline void atrous_pixels_sse2(const denoise_planes &in,
+                               const atrous_pass &pass, int y, int x,
+                               const denoise_output &out) {
+    // Four pixels from x, none of whose taps leave the row
+    size_t p = size_t(y) * pass.width + x;
+    __m128 c[3], a[3], n[3];
+
+    for (int k = 0; k < 3; k++) {
+        c[k] = _mm_loadu_ps(in.color[k] + p);
+        a[k] = _mm_loadu_ps(in.albedo[k] + p);
+        n[k] = _mm_loadu_ps(in.normal[k] + p);
+    }
+
+    __m128 color_scale = _mm_div_ps(
+        _mm_set1_ps(1),
+        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in.variance + p),
+                              _mm_set1_ps(pass.color_sigma2)),
+                   _mm_set1_ps(atrous_variance_floor)));
+    __m128 albedo_scale = _mm_set1_ps(pass.albedo_scale);
+    __m128 normal_scale = _mm_set1_ps(pass.normal_scale);
+    __m128 sum_w = _mm_setzero_ps(), sum_v = _mm_setzero_ps();
+    __m128 sum_c[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+
+    for (int dy = -2; dy <= 2; dy++) {
+        int qy = y + dy * pass.step;
+
+        if (qy < 0 || qy >= pass.height)
+            continue;
+
+        for (int dx = -2; dx <= 2; dx++) {
+            size_t q = size_t(qy) * pass.width + x + dx * pass.step;
+            __m128 dc = _mm_setzero_ps(), da = _mm_setzero_ps(),
+                   dn = _mm_setzero_ps(), cq[3];
+
+            for (int k = 0; k < 3; k++) {
+                cq[k] = _mm_loadu_ps(in.color[k] + q);
+                __m128 d = _mm_sub_ps(c[k], cq[k]);
+                dc = _mm_add_ps(dc, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(a[k], _mm_loadu_ps(in.albedo[k] + q));
+                da = _mm_add_ps(da, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(n[k], _mm_loadu_ps(in.normal[k] + q));
+                dn = _mm_add_ps(dn, _mm_mul_ps(d, d));
+            }
+
+            __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dc, color_scale),
+                                             _mm_mul_ps(da, albedo_scale)),
+                                  _mm_mul_ps(dn, normal_scale));
+            __m128 w = _mm_mul_ps(
+                _mm_set1_ps(atrous_kernel[dy + 2] * atrous_kernel[dx + 2]),
+                atrous_exp_sse2(e));
+
+            sum_w = _mm_add_ps(sum_w, w);
+            sum_v = _mm_add_ps(sum_v,
+                               _mm_mul_ps(_mm_mul_ps(w, w),
+                                          _mm_loadu_ps(in.variance + q)));
+
+            for (int k = 0; k < 3; k++)
+                sum_c[k] = _mm_add_ps(sum_c[k], _mm_mul_ps(w, cq[k]));
+        }
+    }
+
+    for (int k = 0; k < 3; k++)
+        _mm_storeu_ps(out.color[k] + p, _mm_div_ps(sum_c[k], sum_w));
+
+    _mm_storeu_ps(out.variance + p,
+                  _mm_div_ps(sum_v, _mm_mul_ps(sum_w, sum_w)));
+}
+
+__attribute__((target("avx2"))) inline __m256 atrous_exp_avx2(__m256 x) {
+    __m256 t = _mm256_min_ps(_mm256_mul_ps(x, _mm256_set1_ps(atrous_log2e)),
+                             _mm256_set1_ps(atrous_max_exponent));
+    __m256i whole = _mm256_cvttps_epi32(_mm256_add_ps(t, _mm256_set1_ps(0.5f)));
+    __m256 f = _mm256_sub_ps(t, _mm256_cvtepi32_ps(whole));
+    __m256 p = _mm256_set1_ps(atrous_exp_terms[4]);
+
+    for (int k = 3; k >= 0; k--)
+        p = _mm256_add_ps(_mm256_mul_ps(p, f),
+                          _mm256_set1_ps(atrous_exp_terms[k]));
+
+    __m256i bits = _mm256_slli_epi32(
+        _mm256_sub_epi32(_mm256_set1_epi32(127), whole), 23);
+
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2"))) inline void
+atrous_pixels_avx2(const denoise_planes &in, const atrous_pass &pass, int y,
+                   int x, const denoise_output &out) {
+    // Eight pixels from x, none of whose taps leave the row
+    size_t p = size_t(y) * pass.width + x;
+    __m256 c[3], a[3], n[3];
+
+    for (int k = 0; k < 3; k++) {
+        c[k] = _mm256_loadu_ps(in.color[k] + p);
+        a[k] = _mm256_loadu_ps(in.albedo[k] + p);
+        n[k] = _mm256_loadu_ps(in.normal[k] + p);
+    }
+
+    __m256 color_scale = _mm256_div_ps(
+        _mm256_set1_ps(1),
+        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in.variance + p),
+                                    _mm256_set1_ps(pass.color_sigma2)),
+                      _mm256_set1_ps(atrous_variance_floor)));
+    __m256 albedo_scale = _mm256_set1_ps(pass.albedo_scale);
+    __m256 normal_scale = _mm256_set1_ps(pass.normal_scale);
+    __m256 sum_w = _mm256_setzero_ps(), sum_v = _mm256_setzero_ps();
+    __m256 sum_c[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                       _mm256_setzero_ps()};
+
+    for (int dy = -2; dy <= 2; dy++) {
+        int qy = y + dy * pass.step;
+
+        if (qy < 0 || qy >= pass.height)
+            continue;
+
+        for (int dx = -2; dx <= 2; dx++) {
+            size_t q = size_t(qy) * pass.width + x + dx * pass.step;
+            __m256 dc = _mm256_setzero_ps(), da = _mm256_setzero_ps(),
+                   dn = _mm256_setzero_ps(), cq[3];
+
+            for (int k = 0; k < 3; k++) {
+                cq[k] = _mm256_loadu_ps(in.color[k] + q);
+                __m256 d = _mm256_sub_ps(c[k], cq[k]);
+                dc = _mm256_add_ps(dc, _mm256_mul_ps(d, d));
+                d = _mm256_sub_ps(a[k], _mm256_loadu_ps(in.albedo[k] + q));
+                da = _mm256_add_ps(da, _mm256_mul_ps(d, d));
+                d = _mm256_sub_ps(n[k], _mm256_loadu_ps(in.normal[k] + q));
+                dn = _mm256_add_ps(dn, _mm256_mul_ps(d, d));
+            }
+
+            __m256 e = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(dc, color_scale),
+                              _mm256_mul_ps(da, albedo_scale)),
+                _mm256_mul_ps(dn, normal_scale));
+            __m256 w = _mm256_mul_ps(
+                _mm256_set1_ps(atrous_kernel[dy + 2] * atrous_kernel[dx + 2]),
+                atrous_exp_avx2(e));
+
+            sum_w = _mm256_add_ps(sum_w, w);
+            sum_v = _mm256_add_ps(
+                sum_v, _mm256_mul_ps(_mm256_mul_ps(w, w),
+                                     _mm256_loadu_ps(in.variance + q)));
+
+            for (int k = 0; k < 3; k++)
+                sum_c[k] = _mm256_add_ps(sum_c[k], _mm256_mul_ps(w, cq[k]));
+        }
+    }
+
+    for (int k = 0; k < 3; k++)
+        _mm256_storeu_ps(out.color[k] + p, _mm256_div_ps(sum_c[k], sum_w));
+
+    _mm256_storeu_ps(out.variance + p,
+                     _mm256_div_ps(sum_v, _mm256_mul_ps(sum_w, sum_w)));
+}
+#endif
+
+inline void atrous_row(simd_level level, const denoise_planes &in,
+                       const atrous_pass &pass, int y,
+                       const denoise_output &out) {
+    // The edges of the row, where taps fall outside, go through the scalar
+    // flavour
+    int x = 0;
+
+#ifdef RTW_X86
+    int reach = 2 * pass.step;
+    int lanes = level == simd_level::avx2   ? 8
+                : level == simd_level::sse2 ? 4
+                                            : 0;
+
+    if (lanes > 0 && pass.width - reach - lanes >= reach) {
+        atrous_pixels_scalar(in, pass, y, 0, reach, out);
+
+        for (x = reach; x + lanes <= pass.width - reach; x += lanes) {
+            if (lanes == 8)
+                atrous_pixels_avx2(in, pass, y, x, out);
+            else
+                atrous_pixels_sse2(in, pass, y, x, out);
+        }
+    }
+#endif
+
+    atrous_pixels_scalar(in, pass, y, x, pass.width, out);
+}
+
+#endif // !DENOISE_KERNELS_H
@@ -0,0 +1,146 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "color.h"
+#include "denoise_kernels.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+class denoiser {
+  public:
+    // An edge avoiding a-trous wavelet filter (Dammertz et al. 2010) guided
+    // by the albedo and normal of each pixel's first diffuse hits, with the
+    // color weight measured against the pixel's own noise as in SVGF
+    // (Schied et al. 2017). Each pass doubles the tap spacing, so n passes
+    // of 5x5 taps reach 2 (2^n - 1) pixels either way, 125 across for the
+    // default five. Lighting is filtered apart from surface color: the
+    // image is divided by the albedo before and multiplied back after, so
+    // texture and edges between materials stay sharp.
+    int iterations = 5;
+    double color_sigma = 4;    // color difference kept, in standard errors
+    double albedo_sigma = 0.1; // albedo difference across which taps fade
+    double normal_sigma = 0.3; // distance between unit normals, likewise
+
+    std::vector<color> filter(thread_pool &pool, int width, int height,
+                              const std::vector<color> &image,
+                              const std::vector<color> &albedo,
+                              const std::vector<vec3> &normal,
+                              const std::vector<double> &variance) const {
+        // variance is that of each pixel's mean luminance
+        size_t n = size_t(width) * height;
+        std::vector<float> planes[2][4], guides[6];
+
+        for (auto &buffers : planes)
+            for (auto &plane : buffers)
+                plane.resize(n);
+
+        for (auto &plane : guides)
+            plane.resize(n);
+
+        // Splitting into planes and demodulating, a row per task
+        pool.run(height, [&](int y, int) {
+            for (size_t p = size_t(y) * width; p < size_t(y + 1) * width;
+                 p++) {
+                color a = albedo[p] + color(albedo_floor, albedo_floor,
+                                            albedo_floor);
+                double a_y = luminance(a);
+                double v = std::isfinite(variance[p]) ? variance[p] : 1e20;
+
+                for (int k = 0; k < 3; k++) {
+                    planes[0][k][p] = to_plane(image[p][k] / a[k]);
+                    guides[k][p] = to_plane(albedo[p][k]);
+                    guides[3 + k][p] = to_plane(normal[p][k]);
+                }
+
+                planes[0][3][p] =
+                    float(std::clamp(v / (a_y * a_y), 1e-12, 1e20));
+            }
+        });
+
+        // A sample variance from a few dozen samples is itself noisy, so
+        // the first pass sees it blurred over 3x3 pixels
+        std::vector<float> &variance_in = planes[0][3];
+        std::vector<float> &blurred = planes[1][3];
+
+        pool.run(height, [&](int y, int) {
+            for (int x = 0; x < width; x++) {
+                float sum = 0, weights = 0;
+
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx, qy = y + dy;
+
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                            continue;
+
+                        float w = (dx == 0 ? 2 : 1) * (dy == 0 ? 2 : 1);
+                        sum += w * variance_in[size_t(qy) * width + qx];
+                        weights += w;
+                    }
+                }
+
+                blurred[size_t(y) * width + x] = sum / weights;
+            }
+        });
+
+        std::swap(variance_in, blurred);
+
+        simd_level level = active_simd_level();
+        atrous_pass pass = {width, height, 1,
+                            float(color_sigma * color_sigma),
+                            float(1 / (albedo_sigma * albedo_sigma)),
+                            float(1 / (normal_sigma * normal_sigma))};
+        int current = 0;
+
+        for (int i = 0; i < iterations; i++, pass.step *= 2) {
+            auto &from = planes[current], &to = planes[1 - current];
+            denoise_planes in = {
+                {from[0].data(), from[1].data(), from[2].data()},
+                from[3].data(),
+                {guides[0].data(), guides[1].data(), guides[2].data()},
+                {guides[3].data(), guides[4].data(), guides[5].data()}};
+            denoise_output out = {{to[0].data(), to[1].data(), to[2].data()},
+                                  to[3].data()};
+
+            pool.run(height,
+                     [&](int y, int) { atrous_row(level, in, pass, y, out); });
+            current = 1 - current;
+        }
+
+        std::vector<color> result(n);
+
+        for (size_t p = 0; p < n; p++) {
+            color a = albedo[p] + color(albedo_floor, albedo_floor,
+                                        albedo_floor);
+
+            result[p] = color(planes[current][0][p] * a[0],
+                              planes[current][1][p] * a[1],
+                              planes[current][2][p] * a[2]);
+        }
+
+        return result;
+    };
+
+  private:
+    // Keeps black surfaces from dividing by zero
+    static constexpr double albedo_floor = 1e-3;
+
+    static float to_plane(double x) {
+        // Values too small for a normal float become zero, as denormals
+        // would slow every pass down many times over
+        return std::fabs(x) < std::numeric_limits<float>::min() ? 0 : float(x);
+    };
+
+    static double luminance(const color &c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    };
+};
+
+#endif // !DENOISER_H
@@ -0,0 +1,650 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Tile rendering spread over processes, on one host or several. A
+// coordinator listens on a TCP port and hands out lists of tiles to the
+// workers that connect, each a renderer built from the same scene and
+// settings. Workers send every tile back as it is done, and a worker that
+// disconnects or goes quiet for too long has its unfinished tiles handed
+// to the others. Samples depend only on pixel and index, so the frame is
+// the same as one rendered in a single process.
+//
+// Every message is a message_header followed by size bytes of payload, in
+// the byte order of the hosts, which must match, as must the build: the
+// fingerprint covers the precision.
+
+enum message_kind : uint32_t {
+    hello_message = 1, // worker_hello
+    tiles_message,     // uint32_t tile indices to render
+    tile_message,      // tile_result_header, then tile_pixel records
+    done_message,      // no payload, the frame is complete
+};
+
+struct message_header {
+    uint32_t kind; // one of message_kind
+    uint32_t size; // bytes of payload that follow
+};
+
+struct worker_hello {
+    char magic[8]; // "RTWTILES"
+    uint32_t version;
+    uint32_t threads;     // render threads, for sizing its tile lists
+    uint64_t fingerprint; // of scene and settings, see frame_fingerprint
+};
+
+struct tile_result_header {
+    uint32_t tile;
+    uint32_t pixels; // records that follow, in row major order
+    double seconds;  // the worker's time for the tile
+    render_stats counters;
+};
+
+struct tile_pixel {
+    double value[3];
+    double albedo[3], normal[3], variance; // zero without features
+    int32_t samples;
+    int32_t reserved;
+};
+
+constexpr uint32_t tile_protocol_version = 1;
+
+inline uint64_t frame_fingerprint(const camera &cam, const hittable &world,
+                                  const material_table &materials) {
+    // The camera's sample fingerprint, which covers the scene through
+    // cam.scene_hash, extended by everything else that changes what a tile
+    // renders to, so a worker started with another scene or settings is
+    // turned away instead of corrupting the frame
+    uint64_t hash = cam.sample_fingerprint(world, materials);
+
+    auto add = [&](const auto &value) {
+        hash = hash_bytes(hash, &value, sizeof(value));
+    };
+
+    add(cam.samples_per_pixel);
+    add(cam.tile_size);
+    add(cam.adaptive_sampling);
+    add(cam.min_samples);
+    add(cam.noise_threshold);
+    add(cam.denoise || cam.keep_features);
+
+    return hash;
+}
+
+inline bool send_all(int fd, const void *data, size_t size) {
+    // Without a signal if the other end has gone
+    const char *p = static_cast<const char *>(data);
+
+    while (size > 0) {
+        ssize_t sent = ::send(fd, p, size, MSG_NOSIGNAL);
+
+        if (sent <= 0)
+            return false;
+
+        p += sent;
+        size -= size_t(sent);
+    }
+
+    return true;
+}
+
+inline bool receive_all(int fd, void *data, size_t size) {
+    char *p = static_cast<char *>(data);
+
+    while (size > 0) {
+        ssize_t got = ::recv(fd, p, size, 0);
+
+        if (got <= 0)
+            return false;
+
+        p += got;
+        size -= size_t(got);
+    }
+
+    return true;
+}
+
+inline bool send_message(int fd, message_kind kind, const void *payload,
+                         size_t size) {
+    message_header header = {kind, uint32_t(size)};
+
+    return send_all(fd, &header, sizeof(header)) &&
+           (size == 0 || send_all(fd, payload, size));
+}
+
+inline bool receive_message(int fd, message_header &header,
+                            std::vector<char> &payload) {
+    // Blocks until a whole message has arrived
+    if (!receive_all(fd, &header, sizeof(header)))
+        return false;
+
+    payload.resize(header.size);
+
+    return header.size == 0 || receive_all(fd, payload.data(), header.size);
+}
+
+inline int connect_to(const std::string &host, int port, double timeout,
+                      std::string &error) {
+    // A connected socket, retrying for up to timeout seconds so workers
+    // may start before their coordinator; -1 on failure
+    addrinfo hints = {}, *found = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    std::string service = std::to_string(port);
+    int status = getaddrinfo(host.c_str(), service.c_str(), &hints, &found);
+
+    if (status != 0) {
+        error = host + ": " + gai_strerror(status);
+        return -1;
+    }
+
+    auto give_up = std::chrono::steady_clock::now() +
+                   std::chrono::duration<double>(timeout);
+    int fd = -1;
+
+    while (fd < 0) {
+        for (addrinfo *a = found; a && fd < 0; a = a->ai_next) {
+            fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+            if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        if (fd >= 0 || std::chrono::steady_clock::now() >= give_up)
+            break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    freeaddrinfo(found);
+
+    if (fd < 0) {
+        error = "cannot connect to " + host + ":" + service;
+        return -1;
+    }
+
+    // Tile lists are small and wanted at once
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+class render_worker {
+  public:
+    // Renders tiles for a coordinator until it says the frame is done
+    double connect_timeout = 10; // seconds to keep trying to reach it
+
+    bool serve(const std::string &host, int port, camera &cam,
+               const hittable &world, const material_table &materials,
+               std::string &error) {
+        int fd = connect_to(host, port, connect_timeout, error);
+
+        if (fd < 0)
+            return false;
+
+        worker_hello hello = {};
+        std::memcpy(hello.magic, "RTWTILES", 8);
+        hello.version = tile_protocol_version;
+        hello.threads = cam.thread_count > 0
+                            ? uint32_t(cam.thread_count)
+                            : std::max(1u, std::thread::hardware_concurrency());
+        hello.fingerprint = frame_fingerprint(cam, world, materials);
+
+        bool ok = send_message(fd, hello_message, &hello, sizeof(hello));
+        auto framebuffer = cam.begin_frame();
+        message_header header;
+        std::vector<char> payload;
+        std::vector<int> tiles;
+        std::vector<char> result;
+
+        while (ok && (ok = receive_message(fd, header, payload))) {
+            if (header.kind == done_message)
+                break;
+
+            if (header.kind != tiles_message)
+                continue;
+
+            tiles.resize(payload.size() / sizeof(uint32_t));
+
+            for (size_t i = 0; ok && i < tiles.size(); i++) {
+                uint32_t tile;
+                std::memcpy(&tile, payload.data() + i * sizeof(tile),
+                            sizeof(tile));
+                tiles[i] = int(tile);
+                ok = tile < uint32_t(cam.tile_count());
+            }
+
+            if (!ok)
+                break;
+
+            cam.render_tiles(world, materials, tiles, framebuffer);
+
+            for (int tile : tiles) {
+                pack_tile(cam, framebuffer, tile, result);
+                ok = ok && send_message(fd, tile_message, result.data(),
+                                        result.size());
+            }
+        }
+
+        ::close(fd);
+
+        if (!ok)
+            error = "the coordinator at " + host + ":" +
+                    std::to_string(port) + " closed the connection";
+
+        return ok;
+    };
+
+  private:
+    static void pack_tile(const camera &cam,
+                          const std::vector<color> &framebuffer, int tile,
+                          std::vector<char> &result) {
+        int x0, y0, x1, y1;
+        cam.tile_bounds(tile, x0, y0, x1, y1);
+
+        tile_result_header header = {};
+        header.tile = uint32_t(tile);
+        header.pixels = uint32_t((x1 - x0) * (y1 - y0));
+        header.seconds = cam.tile_timings[tile].seconds;
+        header.counters = cam.tile_timings[tile].counters;
+
+        result.resize(sizeof(header) + header.pixels * sizeof(tile_pixel));
+        std::memcpy(result.data(), &header, sizeof(header));
+
+        char *out = result.data() + sizeof(header);
+        bool features = !cam.albedo_buffer.empty();
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                size_t index = size_t(y) * cam.image_width + x;
+                tile_pixel pixel = {};
+
+                for (int k = 0; k < 3; k++) {
+                    pixel.value[k] = framebuffer[index][k];
+
+                    if (features) {
+                        pixel.albedo[k] = cam.albedo_buffer[index][k];
+                        pixel.normal[k] = cam.normal_buffer[index][k];
+                    }
+                }
+
+                if (features)
+                    pixel.variance = cam.variance_buffer[index];
+
+                pixel.samples = cam.samples_spent[index];
+                std::memcpy(out, &pixel, sizeof(pixel));
+                out += sizeof(pixel);
+            }
+        }
+    };
+};
+
+class render_coordinator {
+  public:
+    // Hands out the tiles of one frame at a time to whichever workers are
+    // connected, each given about two tiles per render thread at once and
+    // fewer as the frame runs out, so fast workers take more of it.
+    // Workers may join at any point of a frame.
+    double worker_timeout = 0; // seconds of silence before a worker is
+                               // dropped, 0 waits on it forever
+    bool show_progress = true;
+
+    // Of the last frame
+    int workers_lost = 0;
+    int tiles_requeued = 0;
+
+    render_coordinator() {}
+
+    ~render_coordinator() {
+        if (listener >= 0)
+            ::close(listener);
+    };
+
+    render_coordinator(const render_coordinator &) = delete;
+    render_coordinator &operator=(const render_coordinator &) = delete;
+
+    bool listen(int port, std::string &error) {
+        // On every interface, or a free port for 0; see bound_port
+        listener = ::socket(AF_INET, SOCK_STREAM, 0);
+
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(uint16_t(port));
+        socklen_t length = sizeof(address);
+
+        if (listener < 0 ||
+            ::bind(listener, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) != 0 ||
+            ::listen(listener, 64) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr *>(&address),
+                        &length) != 0) {
+            error = "cannot listen on port " + std::to_string(port) + ": " +
+                    std::strerror(errno);
+            return false;
+        }
+
+        bound_port = ntohs(address.sin_port);
+
+        return true;
+    };
+
+    int port() const { return bound_port; };
+
+    bool render(camera &cam, const hittable &world,
+                const material_table &materials,
+                std::vector<color> &framebuffer, std::string &error) {
+        // Fills framebuffer and the camera's per pixel buffers, stats and
+        // tile timings as render_pixels would. world is only fingerprinted.
+        if (listener < 0) {
+            error = "not listening";
+            return false;
+        }
+
+        framebuffer = cam.begin_frame();
+        fingerprint = frame_fingerprint(cam, world, materials);
+        workers_lost = tiles_requeued = 0;
+        pending.clear();
+
+        for (int tile = 0; tile < cam.tile_count(); tile++)
+            pending.push_back(tile);
+
+        int tiles_left = cam.tile_count();
+        auto frame_start = std::chrono::steady_clock::now();
+        bool waiting_shown = false;
+        std::vector<pollfd> polled;
+
+        while (tiles_left > 0) {
+            if (show_progress && !waiting_shown && workers.empty()) {
+                std::clog << "\nWaiting for workers on port " << bound_port
+                          << std::flush;
+                waiting_shown = true;
+            }
+
+            polled.assign(1, {listener, POLLIN, 0});
+
+            for (const connection &w : workers)
+                polled.push_back({w.fd, POLLIN, 0});
+
+            int wait_ms = worker_timeout > 0 ? 100 : -1;
+
+            if (::poll(polled.data(), polled.size(), wait_ms) < 0 &&
+                errno != EINTR) {
+                error = std::string("poll: ") + std::strerror(errno);
+                return false;
+            }
+
+            if (polled[0].revents & POLLIN)
+                accept_worker();
+
+            auto now = std::chrono::steady_clock::now();
+
+            // Newly accepted workers have no entry in polled yet
+            for (size_t i = 0; i + 1 < polled.size(); i++) {
+                connection &w = workers[i];
+
+                if (polled[i + 1].revents && !read_from(w, cam, framebuffer,
+                                                        tiles_left, now))
+                    drop(w, "disconnected");
+                else if (worker_timeout > 0 && !w.tiles.empty() &&
+                         std::chrono::duration<double>(now - w.last_heard)
+                                 .count() > worker_timeout)
+                    drop(w, "timed out");
+            }
+
+            // Dropped workers are gone for good
+            std::erase_if(workers,
+                          [](const connection &w) { return w.fd < 0; });
+
+            for (connection &w : workers)
+                if (w.threads > 0 && w.tiles.empty() && !hand_out(w))
+                    drop(w, "disconnected");
+
+            if (show_progress)
+                std::clog << "\rTiles remaining: " << tiles_left << ", "
+                          << workers.size() << " workers " << std::flush;
+        }
+
+        for (connection &w : workers) {
+            send_message(w.fd, done_message, nullptr, 0);
+            ::close(w.fd);
+        }
+
+        workers.clear();
+
+        std::chrono::duration<double> seconds =
+            std::chrono::steady_clock::now() - frame_start;
+        cam.render_seconds = seconds.count();
+
+        if (show_progress)
+            std::clog << "\nWorkers lost: " << workers_lost
+                      << ", tiles requeued: " << tiles_requeued
+                      << "\nDone.\n";
+
+        return true;
+    };
+
+  private:
+    struct connection {
+        int fd;
+        int id;          // in order of connecting, for tile_stats::worker
+        int threads = 0; // 0 until its hello is accepted
+        std::vector<int> tiles; // handed out, not yet returned
+        std::vector<char> buffer; // bytes of a message still arriving
+        std::chrono::steady_clock::time_point last_heard;
+    };
+
+    int listener = -1;
+    int bound_port = 0;
+    int next_id = 0;
+    uint64_t fingerprint = 0;
+    std::deque<int> pending;
+    std::vector<connection> workers;
+
+    void accept_worker() {
+        int fd = ::accept(listener, nullptr, nullptr);
+
+        if (fd < 0)
+            return;
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        connection w;
+        w.fd = fd;
+        w.id = next_id++;
+        w.last_heard = std::chrono::steady_clock::now();
+        workers.push_back(std::move(w));
+    };
+
+    bool hand_out(connection &w) {
+        // Up to two tiles per thread, or an even share of what is left
+        if (pending.empty())
+            return true;
+
+        size_t share = (pending.size() + workers.size() - 1) / workers.size();
+        size_t count = std::min<size_t>(2 * size_t(w.threads), share);
+        std::vector<uint32_t> list;
+
+        for (size_t i = 0; i < std::max<size_t>(count, 1); i++) {
+            w.tiles.push_back(pending.front());
+            list.push_back(uint32_t(pending.front()));
+            pending.pop_front();
+        }
+
+        w.last_heard = std::chrono::steady_clock::now();
+
+        return send_message(w.fd, tiles_message, list.data(),
+                            list.size() * sizeof(uint32_t));
+    };
+
+    void drop(connection &w, const char *why) {
+        // Its unfinished tiles go first to the next worker asking
+        if (w.fd < 0)
+            return;
+
+        if (w.threads > 0) {
+            workers_lost++;
+
+            if (show_progress)
+                std::clog << "\nWorker " << w.id << ' ' << why << ", "
+                          << w.tiles.size() << " tiles requeued\n";
+        }
+
+        tiles_requeued += int(w.tiles.size());
+        pending.insert(pending.begin(), w.tiles.begin(), w.tiles.end());
+        w.tiles.clear();
+        ::close(w.fd);
+        w.fd = -1;
+    };
+
+    bool read_from(connection &w, camera &cam, std::vector<color> &framebuffer,
+                   int &tiles_left,
+                   std::chrono::steady_clock::time_point now) {
+        // Whatever has arrived, handling each message once it is whole.
+        // False when the worker is gone or broke the protocol.
+        char chunk[1 << 16];
+        ssize_t got = ::recv(w.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+        if (got <= 0)
+            return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+        w.buffer.insert(w.buffer.end(), chunk, chunk + got);
+        w.last_heard = now;
+
+        size_t used = 0;
+        bool ok = true;
+
+        while (ok && w.buffer.size() - used >= sizeof(message_header)) {
+            message_header header;
+            std::memcpy(&header, w.buffer.data() + used, sizeof(header));
+
+            if (w.buffer.size() - used - sizeof(header) < header.size)
+                break;
+
+            const char *payload = w.buffer.data() + used + sizeof(header);
+            used += sizeof(header) + header.size;
+
+            if (header.kind == hello_message)
+                ok = accept_hello(w, payload, header.size);
+            else if (header.kind == tile_message && w.threads > 0)
+                ok = store_tile(w, cam, framebuffer, payload, header.size,
+                                tiles_left);
+            else
+                ok = false;
+        }
+
+        w.buffer.erase(w.buffer.begin(), w.buffer.begin() + used);
+
+        return ok;
+    };
+
+    bool accept_hello(connection &w, const char *payload, size_t size) {
+        worker_hello hello;
+
+        if (size != sizeof(hello))
+            return false;
+
+        std::memcpy(&hello, payload, sizeof(hello));
+
+        if (std::memcmp(hello.magic, "RTWTILES", 8) != 0 ||
+            hello.version != tile_protocol_version ||
+            hello.fingerprint != fingerprint) {
+            std::cerr << "\nWorker " << w.id
+                      << " turned away: its scene or settings differ\n";
+            return false;
+        }
+
+        w.threads = std::max<int>(1, int(hello.threads));
+
+        return true;
+    };
+
+    bool store_tile(connection &w, camera &cam,
+                    std::vector<color> &framebuffer, const char *payload,
+                    size_t size, int &tiles_left) {
+        tile_result_header header;
+
+        if (size < sizeof(header))
+            return false;
+
+        std::memcpy(&header, payload, sizeof(header));
+
+        int tile = int(header.tile);
+        auto handed = std::find(w.tiles.begin(), w.tiles.end(), tile);
+        int x0, y0, x1, y1;
+
+        if (handed == w.tiles.end())
+            return false;
+
+        cam.tile_bounds(tile, x0, y0, x1, y1);
+
+        if (header.pixels != uint32_t((x1 - x0) * (y1 - y0)) ||
+            size != sizeof(header) + header.pixels * sizeof(tile_pixel))
+            return false;
+
+        const char *in = payload + sizeof(header);
+        bool features = !cam.albedo_buffer.empty();
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                size_t index = size_t(y) * cam.image_width + x;
+                tile_pixel pixel;
+                std::memcpy(&pixel, in, sizeof(pixel));
+                in += sizeof(pixel);
+
+                framebuffer[index] =
+                    color(pixel.value[0], pixel.value[1], pixel.value[2]);
+                cam.samples_spent[index] = pixel.samples;
+
+                if (features) {
+                    cam.albedo_buffer[index] = color(
+                        pixel.albedo[0], pixel.albedo[1], pixel.albedo[2]);
+                    cam.normal_buffer[index] = vec3(
+                        pixel.normal[0], pixel.normal[1], pixel.normal[2]);
+                    cam.variance_buffer[index] = pixel.variance;
+                }
+            }
+        }
+
+        cam.tile_timings[tile] = {x0, y0, x1, y1, w.id, header.seconds,
+                                  header.counters};
+        cam.stats.merge(header.counters);
+        w.tiles.erase(handed);
+        tiles_left--;
+
+        return true;
+    };
+};
+
+#endif // !DISTRIBUTED_H
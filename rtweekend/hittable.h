@@ -1,14 +1,17 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
-class material;
+#include "aabb.h"
+#include "ray_packet.h"
+
+#include <cstdint>
 
 class hit_record {
   public:
     point3 p;
     vec3 normal;
-    std::shared_ptr<material> mat;
-    double t;
+    uint32_t mat; // index into the scene's material_table
+    real t;
     bool front_face;
 
     void set_face_normal(const ray &r, const vec3 &outward_normal) {
@@ -19,11 +22,73 @@ class hit_record {
     }
 };
 
+class hittable;
+
+struct primitive_hit {
+    // The closest hit found so far, without its surface: where along the ray
+    // and which primitive. object is the hittable that owns the primitive,
+    // prim tells apart the primitives of objects that hold several. For a
+    // hit on an instance, object and prim name the instance and inner holds
+    // the hit inside the instanced geometry.
+    real t;
+    const hittable *object = nullptr;
+    uint32_t prim = 0;
+    uint32_t inner_prim = 0;
+    const hittable *inner = nullptr;
+};
+
 class hittable {
   public:
     virtual ~hittable() = default;
 
-    virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
+    // Closest hit search in two phases. intersect finds the nearest hit
+    // inside ray_t and fills in hit only when it finds one, so containers
+    // pass the same hit to all their children with a narrowing interval.
+    // surface then evaluates the winner once, on hit.object.
+    virtual bool intersect(const ray &r, interval ray_t,
+                           primitive_hit &hit) const = 0;
+
+    virtual void surface(const ray &r, const primitive_hit &hit,
+                         hit_record &rec) const {
+        // Only primitives are ever the object of a hit, containers never
+        // need this
+    }
+
+    virtual aabb bounding_box() const = 0;
+
+    virtual bool occluded(const ray &r, interval ray_t) const {
+        // Any hit query for shadow rays: whether anything lies inside ray_t,
+        // not which hit is closest. Structures override it to stop at the
+        // first hit they find.
+        primitive_hit hit;
+
+        return intersect(r, ray_t, hit);
+    }
+
+    virtual void intersect_packet(ray_packet &packet,
+                                  primitive_hit *hits) const {
+        // Intersects every active lane, narrowing its t_max to the closest
+        // hit. Packet aware hittables override this to share traversal and
+        // test several lanes at once.
+        for (int k = 0; k < packet.count; k++) {
+            if (intersect(packet.get(k), packet.lane_interval(k), hits[k])) {
+                packet.t_max[k] = hits[k].t;
+                packet.hit[k] = true;
+            }
+        }
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const {
+        // Both phases in one go
+        primitive_hit closest;
+
+        if (!intersect(r, ray_t, closest))
+            return false;
+
+        closest.object->surface(r, closest, rec);
+
+        return true;
+    };
 };
 
 #endif // !HITTABLE_H
@@ -12,26 +12,48 @@ class hittable_list : public hittable {
     hittable_list() {}
     hittable_list(std::shared_ptr<hittable> object) { add(object); };
 
-    void clear() { objects.clear(); };
-
-    void add(std::shared_ptr<hittable> object) { objects.push_back(object); }
-
-    bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-        hit_record temp_rec;
+    void clear() {
+        objects.clear();
+        bbox = aabb();
+    };
+
+    void add(std::shared_ptr<hittable> object) {
+        objects.push_back(object);
+        bbox = aabb(bbox, object->bounding_box());
+    }
 
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
         bool hit_anything = false;
-        auto closest_so_far = ray_t.max;
 
         for (const auto &object : objects) {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+            if (object->intersect(r, ray_t, hit)) {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                ray_t.max = hit.t;
             }
         }
 
         return hit_anything;
     }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        for (const auto &object : objects)
+            if (object->occluded(r, ray_t))
+                return true;
+
+        return false;
+    }
+
+    void intersect_packet(ray_packet &packet,
+                          primitive_hit *hits) const override {
+        for (const auto &object : objects)
+            object->intersect_packet(packet, hits);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    aabb bbox;
 };
 
 #endif // !HITTABLE_LIST_H
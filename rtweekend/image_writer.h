@@ -0,0 +1,269 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "color.h"
+#include "color_kernels.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Writers for a row major framebuffer of linear colors. P6 and PNG store
+// gamma corrected 8 bit pixels, PFM keeps the linear values as 32 bit
+// floats for compositing.
+enum class image_format { ppm, png, pfm };
+
+inline bool image_format_from_path(const std::string &path,
+                                   image_format &format) {
+    // Picks the format from the file extension, false if it is unknown
+    auto ends_with = [&](const char *suffix) {
+        size_t n = std::strlen(suffix);
+
+        return path.size() >= n &&
+               path.compare(path.size() - n, n, suffix) == 0;
+    };
+
+    if (ends_with(".ppm"))
+        format = image_format::ppm;
+    else if (ends_with(".png"))
+        format = image_format::png;
+    else if (ends_with(".pfm"))
+        format = image_format::pfm;
+    else
+        return false;
+
+    return true;
+}
+
+inline std::vector<uint8_t> quantize_pixels(const std::vector<color> &pixels) {
+    // One pass over all components at once, three bytes per pixel. Padded
+    // colors quantize their zero fourth component too, which is squeezed
+    // out afterwards.
+    constexpr size_t stride = sizeof(color) / sizeof(real);
+    static_assert(sizeof(color) == stride * sizeof(real));
+
+    std::vector<uint8_t> bytes(stride * pixels.size());
+    quantize(active_simd_level(), pixels.data()->e, bytes.data(),
+             bytes.size());
+
+    if (stride != 3) {
+        for (size_t i = 0; i < pixels.size(); i++)
+            for (size_t c = 0; c < 3; c++)
+                bytes[3 * i + c] = bytes[stride * i + c];
+
+        bytes.resize(3 * pixels.size());
+    }
+
+    return bytes;
+}
+
+inline void write_ppm(std::ostream &out, int width, int height,
+                      const std::vector<color> &pixels) {
+    auto bytes = quantize_pixels(pixels);
+
+    out << "P6\n" << width << ' ' << height << "\n255\n";
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
+
+class png_encoder {
+  public:
+    // Minimal PNG: 8 bit RGB, no filtering and stored (uncompressed) deflate
+    // blocks, which keeps it fast and dependency free at the cost of size.
+    static void write(std::ostream &out, int width, int height,
+                      const uint8_t *rgb) {
+        static const uint8_t signature[8] = {0x89, 'P',  'N',  'G',
+                                             '\r', '\n', 0x1a, '\n'};
+        out.write(reinterpret_cast<const char *>(signature), 8);
+
+        std::vector<uint8_t> header;
+        put_u32(header, uint32_t(width));
+        put_u32(header, uint32_t(height));
+        header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit RGB
+        write_chunk(out, "IHDR", header);
+
+        // Every scanline is prefixed with its filter type, 0 for none
+        size_t row = size_t(width) * 3;
+        std::vector<uint8_t> raw;
+        raw.reserve((row + 1) * height);
+
+        for (int y = 0; y < height; y++) {
+            raw.push_back(0);
+            raw.insert(raw.end(), rgb + y * row, rgb + (y + 1) * row);
+        }
+
+        write_chunk(out, "IDAT", zlib_stored(raw));
+        write_chunk(out, "IEND", {});
+    };
+
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t n) {
+        static const auto table = crc_table();
+
+        crc = ~crc;
+
+        for (size_t i = 0; i < n; i++)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+        return ~crc;
+    };
+
+    static uint32_t adler32(const uint8_t *data, size_t n) {
+        // Sums are reduced every 5552 bytes, the most that fit in 32 bits
+        uint32_t a = 1, b = 0;
+
+        while (n > 0) {
+            size_t run = n < 5552 ? n : 5552;
+            n -= run;
+
+            for (size_t i = 0; i < run; i++) {
+                a += data[i];
+                b += a;
+            }
+
+            data += run;
+            a %= 65521;
+            b %= 65521;
+        }
+
+        return (b << 16) | a;
+    };
+
+  private:
+    static std::array<uint32_t, 256> crc_table() {
+        std::array<uint32_t, 256> table;
+
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+
+            table[n] = c;
+        }
+
+        return table;
+    };
+
+    static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+        // PNG and zlib integers are big endian
+        out.insert(out.end(), {uint8_t(v >> 24), uint8_t(v >> 16),
+                               uint8_t(v >> 8), uint8_t(v)});
+    };
+
+    static std::vector<uint8_t> zlib_stored(const std::vector<uint8_t> &raw) {
+        const size_t max_block = 65535;
+        std::vector<uint8_t> z = {0x78, 0x01};
+        z.reserve(raw.size() + raw.size() / max_block * 5 + 16);
+
+        size_t pos = 0;
+
+        do {
+            size_t len = std::min(max_block, raw.size() - pos);
+            bool last = pos + len == raw.size();
+
+            z.insert(z.end(), {uint8_t(last), uint8_t(len), uint8_t(len >> 8),
+                               uint8_t(~len), uint8_t(~len >> 8)});
+            z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+            pos += len;
+        } while (pos < raw.size());
+
+        put_u32(z, adler32(raw.data(), raw.size()));
+
+        return z;
+    };
+
+    static void write_chunk(std::ostream &out, const char *type,
+                            const std::vector<uint8_t> &data) {
+        std::vector<uint8_t> head;
+        put_u32(head, uint32_t(data.size()));
+        head.insert(head.end(), type, type + 4);
+
+        uint32_t crc = crc32(0, head.data() + 4, 4);
+        crc = crc32(crc, data.data(), data.size());
+
+        std::vector<uint8_t> tail;
+        put_u32(tail, crc);
+
+        out.write(reinterpret_cast<const char *>(head.data()), head.size());
+        out.write(reinterpret_cast<const char *>(data.data()), data.size());
+        out.write(reinterpret_cast<const char *>(tail.data()), tail.size());
+    };
+};
+
+inline void write_png(std::ostream &out, int width, int height,
+                      const std::vector<color> &pixels) {
+    auto bytes = quantize_pixels(pixels);
+
+    png_encoder::write(out, width, height, bytes.data());
+}
+
+inline void write_pfm(std::ostream &out, int width, int height,
+                      const std::vector<color> &pixels) {
+    // Linear floats, scanlines bottom to top. A negative scale marks little
+    // endian data.
+    bool little = std::endian::native == std::endian::little;
+
+    out << "PF\n"
+        << width << ' ' << height << '\n'
+        << (little ? "-1.0" : "1.0") << '\n';
+
+    std::vector<float> row(size_t(width) * 3);
+
+    for (int y = height - 1; y >= 0; y--) {
+        const color *src = pixels.data() + size_t(y) * width;
+
+        for (int x = 0; x < width; x++) {
+            row[3 * x + 0] = float(src[x].x());
+            row[3 * x + 1] = float(src[x].y());
+            row[3 * x + 2] = float(src[x].z());
+        }
+
+        out.write(reinterpret_cast<const char *>(row.data()),
+                  row.size() * sizeof(float));
+    }
+}
+
+inline std::vector<color> heatmap(const std::vector<double> &values,
+                                  double max_value) {
+    // Maps values in [0, max_value] from blue through green to red, as linear
+    // colors that come out with exactly those hues after gamma correction
+    std::vector<color> pixels;
+    pixels.reserve(values.size());
+
+    for (double value : values) {
+        double t = max_value > 0 ? std::clamp(value / max_value, 0.0, 1.0) : 0;
+        double s = 2 * t - 1;
+        color c(std::fmax(s, 0), 1 - std::fabs(s), std::fmax(-s, 0));
+
+        pixels.push_back(c * c);
+    }
+
+    return pixels;
+}
+
+inline std::vector<color> heatmap(const std::vector<int> &values,
+                                  int max_value) {
+    return heatmap(std::vector<double>(values.begin(), values.end()),
+                   std::max(max_value, 1));
+}
+
+inline void write_image(std::ostream &out, image_format format, int width,
+                        int height, const std::vector<color> &pixels) {
+    switch (format) {
+    case image_format::png:
+        write_png(out, width, height, pixels);
+        break;
+    case image_format::pfm:
+        write_pfm(out, width, height, pixels);
+        break;
+    default:
+        write_ppm(out, width, height, pixels);
+        break;
+    }
+}
+
+#endif // !IMAGE_WRITER_H
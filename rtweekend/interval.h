@@ -3,19 +3,25 @@
 
 class interval {
   public:
-    double min, max;
+    real min, max;
 
     interval() : min(+infinity), max(-infinity) {};
 
-    interval(double min, double max) : min(min), max(max) {};
+    interval(real min, real max) : min(min), max(max) {};
 
-    double size() const { return max - min; };
+    interval(const interval &a, const interval &b) {
+        // Create the interval tightly enclosing the two input intervals
+        min = a.min <= b.min ? a.min : b.min;
+        max = a.max >= b.max ? a.max : b.max;
+    };
 
-    bool contains(double x) const { return min <= x && x <= max; };
+    real size() const { return max - min; };
 
-    bool surrounds(double x) const { return min < x && x < max; };
+    bool contains(real x) const { return min <= x && x <= max; };
 
-    double clamp(double x) const {
+    bool surrounds(real x) const { return min < x && x < max; };
+
+    real clamp(real x) const {
         if (x < min)
             return min;
         if (x > max)
@@ -24,6 +30,12 @@ class interval {
         return x;
     }
 
+    interval expand(real delta) const {
+        auto padding = delta / 2;
+
+        return interval(min - padding, max + padding);
+    }
+
     static const interval empty, universe;
 };
 
@@ -0,0 +1,249 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+struct light_sample {
+    // A direction from a shading point towards a point on a light, how far
+    // away that point is, what it emits and the density of the sample per
+    // unit solid angle, the choice of light included
+    vec3 direction; // unit length
+    double distance;
+    double pdf;
+    color radiance;
+};
+
+class light_list {
+  public:
+    // The emissive spheres and triangles of a scene, picked in proportion
+    // to their power. A sphere is sampled uniformly over the cone it
+    // subtends, which wastes no samples on its far side, a triangle
+    // uniformly over its area.
+    light_list() {}
+
+    light_list(const hittable_list &world, const material_table &materials) {
+        // Only the top level of world is searched. Emitters nested deeper,
+        // in a bvh or an instance, still light what their hits reach.
+        for (const auto &object : world.objects) {
+            if (auto s = std::dynamic_pointer_cast<sphere>(object)) {
+                add_sphere(s->center(), s->radius(),
+                           materials.emitted(s->material_id()));
+            } else if (auto mesh =
+                           std::dynamic_pointer_cast<triangle_mesh>(object)) {
+                color emit = materials.emitted(mesh->material_id());
+                const auto &v = mesh->vertex_buffer();
+                const auto &index = mesh->index_buffer();
+
+                if (luminance(emit) <= 0)
+                    continue;
+
+                for (size_t i = 0; i + 2 < index.size(); i += 3)
+                    add_triangle(v[index[i]], v[index[i + 1]],
+                                 v[index[i + 2]], emit);
+            }
+        }
+    };
+
+    void add_sphere(const point3 &center, double radius, const color &emit) {
+        light l = {true, center, vec3(), vec3(), vec3(), radius, emit,
+                   4 * pi * radius * radius};
+
+        add(l);
+    };
+
+    void add_triangle(const point3 &v0, const point3 &v1, const point3 &v2,
+                      const color &emit) {
+        vec3 e1 = v1 - v0, e2 = v2 - v0;
+        vec3 n = cross(e1, e2);
+        light l = {false, v0, e1, e2, unit_vector(n), 0, emit,
+                   n.length() / 2};
+
+        add(l);
+    };
+
+    bool empty() const { return lights.empty(); };
+    size_t size() const { return lights.size(); };
+
+    bool sample(const point3 &p, double u_pick, const vec3 &u,
+                light_sample &s) const {
+        // A light chosen by u_pick, and a point on it by u in [0, 1)^2
+        if (lights.empty())
+            return false;
+
+        size_t i = std::upper_bound(cdf.begin(), cdf.end(),
+                                    u_pick * cdf.back()) -
+                   cdf.begin();
+        i = std::min(i, lights.size() - 1);
+
+        const light &l = lights[i];
+        double pick = pick_probability(i);
+
+        if (l.is_sphere) {
+            vec3 to_center = l.a - p;
+            double d2 = to_center.length_squared();
+            double r2 = l.radius * l.radius;
+
+            // Inside the light, nothing to aim at
+            if (d2 <= r2)
+                return false;
+
+            // 1 - cos of the cone's half angle, in a form that keeps its
+            // precision for far away lights
+            double sin2_max = r2 / d2;
+            double cone = sin2_max / (1 + std::sqrt(1 - sin2_max));
+            double one_minus_cos = u.x() * cone;
+            double cos_theta = 1 - one_minus_cos;
+            double sin_theta =
+                std::sqrt(std::fmax(0, one_minus_cos * (2 - one_minus_cos)));
+            double phi = 2 * pi * u.y();
+            double d = std::sqrt(d2);
+            vec3 w = to_center / d, t, b;
+            frame(w, t, b);
+
+            s.direction = cos_theta * w + sin_theta * (std::cos(phi) * t +
+                                                       std::sin(phi) * b);
+            s.distance =
+                d * cos_theta -
+                std::sqrt(std::fmax(0, r2 - d2 * sin_theta * sin_theta));
+            s.pdf = pick / (2 * pi * cone);
+        } else {
+            double su = std::sqrt(u.x());
+            point3 q = l.a + su * (1 - u.y()) * l.e1 + su * u.y() * l.e2;
+            vec3 to_light = q - p;
+            double dist2 = to_light.length_squared();
+
+            if (dist2 <= 0)
+                return false;
+
+            s.distance = std::sqrt(dist2);
+            s.direction = to_light / s.distance;
+
+            double cosine = std::fabs(dot(s.direction, l.normal));
+
+            if (cosine <= 0)
+                return false;
+
+            s.pdf = pick * dist2 / (cosine * l.area);
+        }
+
+        s.radiance = l.emit;
+
+        return s.pdf > 0 && std::isfinite(s.pdf);
+    };
+
+    double pdf(const point3 &p, const vec3 &direction, double distance) const {
+        // The density with which sample picks direction from p, when the hit
+        // that way is distance away: only lights with a point there could
+        // have given it
+        vec3 w = unit_vector(direction);
+        double density = 0;
+
+        for (size_t i = 0; i < lights.size(); i++) {
+            const light &l = lights[i];
+            double t = l.is_sphere ? sphere_distance(l, p, w)
+                                   : triangle_distance(l, p, w);
+
+            if (t <= 0 || std::fabs(t - distance) > 1e-4 * distance)
+                continue;
+
+            if (l.is_sphere) {
+                double d2 = (l.a - p).length_squared();
+                double sin2_max = l.radius * l.radius / d2;
+                double cone = sin2_max / (1 + std::sqrt(1 - sin2_max));
+
+                density += pick_probability(i) / (2 * pi * cone);
+            } else {
+                double cosine = std::fabs(dot(w, l.normal));
+
+                if (cosine > 0)
+                    density += pick_probability(i) * t * t /
+                               (cosine * l.area);
+            }
+        }
+
+        return density;
+    };
+
+  private:
+    struct light {
+        bool is_sphere;
+        point3 a; // center of a sphere, first vertex of a triangle
+        vec3 e1, e2, normal;
+        double radius;
+        color emit;
+        double area;
+    };
+
+    std::vector<light> lights;
+    std::vector<double> cdf; // running sum of power
+
+    static double luminance(const color &c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    };
+
+    void add(const light &l) {
+        // Lights that emit nothing would never be picked anyway
+        double power = luminance(l.emit) * l.area;
+
+        if (!(power > 0))
+            return;
+
+        lights.push_back(l);
+        cdf.push_back((cdf.empty() ? 0 : cdf.back()) + power);
+    };
+
+    double pick_probability(size_t i) const {
+        return (cdf[i] - (i ? cdf[i - 1] : 0)) / cdf.back();
+    };
+
+    static void frame(const vec3 &w, vec3 &t, vec3 &b) {
+        // Two unit vectors completing w to an orthonormal basis (Duff et al.
+        // 2017)
+        double sign = std::copysign(1.0, w.z());
+        double a = -1 / (sign + w.z());
+        double c = w.x() * w.y() * a;
+
+        t = vec3(1 + sign * w.x() * w.x() * a, sign * c, -sign * w.x());
+        b = vec3(c, sign + w.y() * w.y() * a, -w.y());
+    };
+
+    static double sphere_distance(const light &l, const point3 &p,
+                                  const vec3 &w) {
+        // Distance to the near side of a sphere along unit w, 0 for none
+        vec3 oc = l.a - p;
+        double b = dot(w, oc);
+        double disc = b * b - (oc.length_squared() - l.radius * l.radius);
+
+        return disc < 0 ? 0 : std::fmax(0, b - std::sqrt(disc));
+    };
+
+    static double triangle_distance(const light &l, const point3 &p,
+                                    const vec3 &w) {
+        // Moller-Trumbore along unit w, 0 for a miss
+        vec3 pv = cross(w, l.e2);
+        double det = dot(l.e1, pv);
+
+        if (std::fabs(det) < 1e-12)
+            return 0;
+
+        vec3 tv = p - l.a;
+        double u = dot(tv, pv) / det;
+        vec3 qv = cross(tv, l.e1);
+        double v = dot(w, qv) / det;
+
+        if (u < 0 || v < 0 || u + v > 1)
+            return 0;
+
+        return std::fmax(0, dot(l.e2, qv) / det);
+    };
+};
+
+#endif // !LIGHTS_H
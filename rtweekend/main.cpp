@@ -1,74 +1,375 @@
 #include "rtweekend.h"
 
 #include "camera.h"
+#include "compiled_scene.h"
+#include "distributed.h"
 #include "hittable_list.h"
-#include "material.h"
-#include "sphere.h"
+#include "scene_file.h"
+#include "scenes.h"
 
-int main() {
-    hittable_list world;
+#include <cstring>
+#include <fstream>
+
+static bool open_output(const char *path, image_format &format,
+                        std::ofstream &out) {
+    // The extension of path picks the format
+    if (!image_format_from_path(path, format)) {
+        std::cerr << "unknown image format: " << path << '\n';
+        return false;
+    }
+
+    out.open(path, std::ios::binary);
+
+    if (!out) {
+        std::cerr << "cannot open " << path << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    // usage: main [--adaptive] [--wavefront] [--roulette] [--heatmap file]
+    //            [--night | --mesh file [--instances n]]
+    //            [--scene file | --save-scene file] [--samples n]
+    //            [--denoise] [--albedo file] [--normals file]
+    //            [--stats file] [--tile-heatmap file] [--threads n]
+    //            [--coordinator port [--worker-timeout s] | --worker host:port
+    //            | --progressive file [--pass-samples n]] [output file]
+    // Writes P6 to stdout without an output file. The heatmap shows the
+    // samples spent per pixel, blue for none up to red for the full budget.
+    // A mesh, OBJ or binary PLY, replaces the spheres of the cover scene,
+    // with --instances as n copies spread over the ground. --save-scene
+    // writes the scene, camera and bvh to a binary scene file and exits;
+    // --scene maps one and renders it without building anything.
+    // --denoise filters the image guided by the albedo and normal of the
+    // first diffuse hits, and lowers the samples per pixel to 64 unless
+    // --samples sets them. --albedo and --normals write those features.
+    // --stats writes ray, intersection and path counters and the time of
+    // every tile as JSON, --tile-heatmap the time per pixel of each tile.
+    // --wavefront traces paths in bounce by bounce batches, to the same
+    // image. --roulette ends dim paths early at random, unbiased.
+    // --night renders the cover scene under a black sky, lit by small
+    // lamps. Emissive spheres and triangles at the top of a scene are
+    // sampled directly at every diffuse or rough hit.
+    // --coordinator hands the tiles out to workers connecting on port and
+    // writes the frame they send back. Workers take every other option the
+    // coordinator was given, and render until it has the frame. A worker
+    // silent for --worker-timeout seconds has its tiles handed on, as does
+    // one that disconnects. --threads sets the render threads.
+    // --progressive renders in passes of --pass-samples samples per pixel,
+    // saving the sums to file after each. Run again with the same options
+    // it resumes from there, and with more --samples it adds to them.
+    const char *output_path = nullptr;
+    const char *heatmap_path = nullptr;
+    const char *mesh_path = nullptr;
+    const char *scene_path = nullptr;
+    const char *save_scene_path = nullptr;
+    const char *albedo_path = nullptr;
+    const char *normals_path = nullptr;
+    const char *stats_path = nullptr;
+    const char *tile_heatmap_path = nullptr;
+    const char *worker_address = nullptr;
+    const char *progressive_path = nullptr;
+    int instances = 0;
+    int samples = 0;
+    int threads = 0;
+    int coordinator_port = -1;
+    int pass_samples = 0;
+    double worker_timeout = 0;
+    bool adaptive = false;
+    bool denoise = false;
+    bool wavefront = false;
+    bool roulette = false;
+    bool night = false;
 
-    auto ground_material = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(
-        std::make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2,
-                          b + 0.9 * random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                std::shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = std::make_shared<lambertian>(albedo);
-                    world.add(
-                        std::make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = std::make_shared<metal>(albedo, fuzz);
-                    world.add(
-                        std::make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = std::make_shared<dielectric>(1.5);
-                    world.add(
-                        std::make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--adaptive") == 0) {
+            adaptive = true;
+        } else if (std::strcmp(argv[i], "--wavefront") == 0) {
+            wavefront = true;
+        } else if (std::strcmp(argv[i], "--roulette") == 0) {
+            roulette = true;
+        } else if (std::strcmp(argv[i], "--night") == 0) {
+            night = true;
+        } else if (std::strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+            heatmap_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            mesh_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--save-scene") == 0 &&
+                   i + 1 < argc) {
+            save_scene_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--denoise") == 0) {
+            denoise = true;
+        } else if (std::strcmp(argv[i], "--albedo") == 0 && i + 1 < argc) {
+            albedo_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--normals") == 0 && i + 1 < argc) {
+            normals_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--tile-heatmap") == 0 &&
+                   i + 1 < argc) {
+            tile_heatmap_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--coordinator") == 0 &&
+                   i + 1 < argc) {
+            coordinator_port = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--worker-timeout") == 0 &&
+                   i + 1 < argc) {
+            worker_timeout = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            worker_address = argv[++i];
+        } else if (std::strcmp(argv[i], "--progressive") == 0 &&
+                   i + 1 < argc) {
+            progressive_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--pass-samples") == 0 &&
+                   i + 1 < argc) {
+            pass_samples = std::atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            output_path = argv[i];
+        } else {
+            std::cerr << "unknown option: " << argv[i] << '\n';
+            return 1;
         }
     }
 
-    auto material1 = std::make_shared<dielectric>(1.5);
-    world.add(std::make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    if (instances > 0 && !mesh_path) {
+        std::cerr << "--instances needs a --mesh\n";
+        return 1;
+    }
+
+    if (coordinator_port >= 0 && worker_address) {
+        std::cerr << "--coordinator and --worker are separate processes\n";
+        return 1;
+    }
+
+    if (progressive_path && (coordinator_port >= 0 || worker_address)) {
+        std::cerr << "--progressive renders in one process\n";
+        return 1;
+    }
 
-    auto material2 = std::make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(std::make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    const char *worker_port =
+        worker_address ? std::strrchr(worker_address, ':') : nullptr;
+
+    if (worker_address && !worker_port) {
+        std::cerr << "--worker needs host:port\n";
+        return 1;
+    }
+
+    if (night && (mesh_path || scene_path)) {
+        std::cerr << "--night takes neither --mesh nor --scene\n";
+        return 1;
+    }
 
-    auto material3 = std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(std::make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    if (scene_path && (mesh_path || save_scene_path)) {
+        std::cerr << "--scene takes neither --mesh nor --save-scene\n";
+        return 1;
+    }
 
+    material_table materials;
+    hittable_list world;
     camera cam;
+    auto lights = std::make_shared<light_list>();
+
+    // A progressive file, and workers to their coordinator, are tied to the
+    // scene by a hash of its content, which for a scene file means reading
+    // all of it
+    bool hash_scene =
+        progressive_path || coordinator_port >= 0 || worker_address;
+
+    if (scene_path) {
+        auto scene = std::make_shared<scene_file>();
+        std::string error;
+
+        if (!scene->open(scene_path, error)) {
+            std::cerr << scene_path << ": " << error << '\n';
+            return 1;
+        }
+
+        scene->load_materials(materials);
+        scene->load_camera(cam);
+        scene->load_lights(*lights, materials);
+        world.add(scene);
+
+        if (hash_scene)
+            cam.scene_hash = scene->content_hash();
+    } else if (mesh_path) {
+        mesh_data mesh;
+        std::string error;
+
+        if (!load_mesh(mesh_path, mesh, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+
+        // The meshes are built from the loaded mesh and the seeded rng
+        cam.scene_hash =
+            hash_bytes(mesh.content_hash(), &instances, sizeof(instances));
+
+        if (instances > 0)
+            world = instanced_mesh_scene(materials, std::move(mesh), instances);
+        else
+            world = mesh_scene(materials, std::move(mesh));
+    } else if (night) {
+        // The built in scenes are fixed by their seeds
+        world = night_spheres_scene(materials);
+        cam.scene_hash = hash_bytes(hash_seed, "night", 5);
+    } else {
+        world = random_spheres_scene(materials);
+        cam.scene_hash = hash_bytes(hash_seed, "cover", 5);
+    }
+
+    if (night)
+        night_spheres_camera(cam);
+    else if (!scene_path)
+        random_spheres_camera(cam);
+
+    if (save_scene_path) {
+        std::string error;
+
+        if (!write_scene_file(save_scene_path, world, materials, cam, error)) {
+            std::cerr << save_scene_path << ": " << error << '\n';
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (!scene_path) {
+        lights = std::make_shared<light_list>(world, materials);
+        world = hittable_list(std::make_shared<compiled_scene>(world));
+    }
+
+    if (!lights->empty())
+        cam.lights = lights;
+
+    cam.adaptive_sampling = adaptive;
+    cam.denoise = denoise;
+    cam.wavefront = wavefront;
+    cam.russian_roulette = roulette;
+    cam.keep_features = albedo_path || normals_path;
+    cam.thread_count = threads;
+
+    if (pass_samples > 0)
+        cam.pass_samples = pass_samples;
+
+    if (samples > 0)
+        cam.samples_per_pixel = samples;
+    else if (denoise)
+        cam.samples_per_pixel = 64;
+
+    if (worker_address) {
+        render_worker worker;
+        std::string error;
+        std::string host(worker_address, worker_port);
+        cam.show_progress = false;
+
+        if (!worker.serve(host, std::atoi(worker_port + 1), cam, world,
+                          materials, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+
+        return 0;
+    }
+
+    std::ofstream out, heatmap_out, albedo_out, normals_out, stats_out,
+        tile_heatmap_out;
+    image_format heatmap_format, albedo_format, normals_format,
+        tile_heatmap_format;
+
+    if (output_path && !open_output(output_path, cam.output_format, out))
+        return 1;
+
+    if (heatmap_path &&
+        !open_output(heatmap_path, heatmap_format, heatmap_out))
+        return 1;
+
+    if (albedo_path && !open_output(albedo_path, albedo_format, albedo_out))
+        return 1;
+
+    if (normals_path &&
+        !open_output(normals_path, normals_format, normals_out))
+        return 1;
+
+    if (tile_heatmap_path && !open_output(tile_heatmap_path,
+                                          tile_heatmap_format,
+                                          tile_heatmap_out))
+        return 1;
 
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 720;
-    cam.samples_per_pixel = 500;
-    cam.max_depth = 50;
+    if (stats_path) {
+        stats_out.open(stats_path);
 
-    cam.vfov = 30;
-    cam.look_from = point3(13, 2, 3);
-    cam.look_at = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
+        if (!stats_out) {
+            std::cerr << "cannot open " << stats_path << '\n';
+            return 1;
+        }
+    }
+
+    if (coordinator_port >= 0) {
+        render_coordinator coordinator;
+        std::vector<color> framebuffer;
+        std::string error;
+        coordinator.worker_timeout = worker_timeout;
+
+        if (!coordinator.listen(coordinator_port, error) ||
+            !coordinator.render(cam, world, materials, framebuffer, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+
+        cam.write_frame(std::move(framebuffer), output_path ? out : std::cout);
+    } else if (progressive_path) {
+        std::vector<color> framebuffer;
+        std::string error;
+
+        if (!cam.render_progressive(world, materials, progressive_path,
+                                    framebuffer, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+
+        cam.write_frame(std::move(framebuffer), output_path ? out : std::cout);
+    } else {
+        cam.render(world, materials, output_path ? out : std::cout);
+    }
+
+    int width = cam.image_width;
+    int height = int(cam.samples_spent.size()) / width;
+
+    if (heatmap_path)
+        write_image(heatmap_out, heatmap_format, width, height,
+                    heatmap(cam.samples_spent, cam.samples_per_pixel));
+
+    if (tile_heatmap_path)
+        write_image(tile_heatmap_out, tile_heatmap_format, width, height,
+                    cam.tile_heatmap());
+
+    if (stats_path)
+        cam.write_stats(stats_out);
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
+    if (albedo_path)
+        write_image(albedo_out, albedo_format, width, height,
+                    cam.albedo_buffer);
 
-    cam.render(world);
+    if (normals_path) {
+        // Squared, so the gamma corrected image shows 0.5 (n + 1)
+        std::vector<color> shown;
+
+        for (const vec3 &n : cam.normal_buffer) {
+            color c = 0.5 * (n + vec3(1, 1, 1));
+            shown.push_back(c * c);
+        }
+
+        write_image(normals_out, normals_format, width, height, shown);
+    }
 
     return 0;
 }
@@ -0,0 +1,110 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RTW_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class mapped_file {
+  public:
+    // A whole file as one read only block of memory. Memory mapped where the
+    // platform allows, so pages are read on first touch and parsing threads
+    // work straight on the page cache. Elsewhere the file is read into a
+    // buffer.
+    mapped_file() {};
+
+    explicit mapped_file(const std::string &path) { open(path); };
+
+    ~mapped_file() { close(); };
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool open(const std::string &path) {
+        close();
+
+#ifdef RTW_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        length = size_t(info.st_size);
+
+        if (length > 0) {
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+
+            // Parsers read front to back
+            madvise(p, length, MADV_SEQUENTIAL);
+            mapping = static_cast<const char *>(p);
+        }
+
+        ::close(fd);
+        is_open = true;
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+
+        if (!in)
+            return false;
+
+        buffer.resize(size_t(in.tellg()));
+        in.seekg(0);
+
+        if (!in.read(buffer.data(), std::streamsize(buffer.size())))
+            return false;
+
+        mapping = buffer.data();
+        length = buffer.size();
+        is_open = true;
+#endif
+
+        return true;
+    };
+
+    void close() {
+#ifdef RTW_MMAP
+        if (mapping != nullptr)
+            munmap(const_cast<char *>(mapping), length);
+#endif
+        buffer.clear();
+        mapping = nullptr;
+        length = 0;
+        is_open = false;
+    };
+
+    bool valid() const { return is_open; };
+
+    const char *data() const { return mapping; };
+
+    size_t size() const { return length; };
+
+  private:
+    const char *mapping = nullptr;
+    size_t length = 0;
+    bool is_open = false;
+    std::vector<char> buffer; // only used without mmap
+};
+
+#endif // !MAPPED_FILE_H
@@ -2,24 +2,30 @@
 #define MATERIAL_H
 
 #include "hittable.h"
-
-class material {
-  public:
-    virtual ~material() = default;
-
-    virtual bool scatter(const ray &r_in, const hit_record &rec,
-                         color &attenuation, ray &scattered) const {
-        return false;
-    }
-};
-
-class lambertian : public material {
+#include "render_stats.h"
+#include "sampler.h"
+
+#include <cstdint>
+#include <iterator>
+#include <variant>
+#include <vector>
+
+// Every material draws its random decisions from smp, which the camera has
+// already moved to this bounce's dimensions. Materials that scatter over a
+// range of directions also give the density of their scatter directions,
+// per unit solid angle, so the camera can weigh light samples against them.
+// Their attenuation is the same for every direction, so the BSDF times the
+// cosine for a direction is the attenuation times that density.
+
+class lambertian {
   public:
     lambertian(const color &albedo) : albedo(albedo) {};
 
+    const color &albedo_color() const { return albedo; };
+
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
-                 ray &scattered) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+                 ray &scattered, sampler &smp) const {
+        auto scatter_direction = rec.normal + sample_unit_vector(smp.get_2d());
 
         // Catch degenerate satter direciton
         if (scatter_direction.near_zero())
@@ -31,36 +37,72 @@ class lambertian : public material {
         return true;
     };
 
+    double pdf(const ray &r_in, const hit_record &rec,
+               const vec3 &direction) const {
+        // The normal plus a unit vector is cosine distributed
+        return std::fmax(0, dot(unit_vector(direction), rec.normal)) / pi;
+    };
+
   private:
     color albedo;
 };
 
-class metal : public material {
+class metal {
   public:
     metal(const color &albedo, double fuzz)
         : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {};
 
+    const color &albedo_color() const { return albedo; };
+    double fuzziness() const { return fuzz; };
+
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
-                 ray &scattered) const override {
+                 ray &scattered, sampler &smp) const {
         vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+        reflected = unit_vector(reflected) +
+                    (fuzz * sample_unit_vector(smp.get_2d()));
         scattered = ray(rec.p, reflected);
         attenuation = albedo;
 
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    double pdf(const ray &r_in, const hit_record &rec,
+               const vec3 &direction) const {
+        // Scatter directions point at a uniform point of the sphere of
+        // radius fuzz around the unit mirror direction. A direction crosses
+        // that sphere where t^2 - 2bt + 1 - fuzz^2 = 0, b being its cosine
+        // to the mirror direction, and adding up area density times t^2
+        // over the cosine at both crossings gives (b^2 + D) / (2 pi fuzz
+        // sqrt D), D = b^2 - 1 + fuzz^2. Directions below the surface are
+        // absorbed, so they carry none.
+        vec3 w = unit_vector(direction);
+
+        if (fuzz <= 0 || dot(w, rec.normal) <= 0)
+            return 0;
+
+        vec3 mirror = unit_vector(reflect(r_in.direction(), rec.normal));
+        double b = dot(w, mirror);
+        double d = b * b - 1 + fuzz * fuzz;
+
+        if (b <= 0 || d <= 0)
+            return 0;
+
+        return (b * b + d) / (2 * pi * fuzz * std::sqrt(d));
+    };
+
   private:
     color albedo;
     double fuzz;
 };
 
-class dielectric : public material {
+class dielectric {
   public:
     dielectric(double refraction_index) : refraction_index(refraction_index) {};
 
+    double index() const { return refraction_index; };
+
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
-                 ray &scattered) const override {
+                 ray &scattered, sampler &smp) const {
         attenuation = color(1.0, 1.0, 1.0);
         double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
@@ -71,7 +113,7 @@ class dielectric : public material {
         bool cannot_refract = ri * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+        if (cannot_refract || reflectance(cos_theta, ri) > smp.get_1d())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, ri);
@@ -93,4 +135,112 @@ class dielectric : public material {
     }
 };
 
+class diffuse_light {
+  public:
+    // Emits the same radiance from every point, both sides and in every
+    // direction, and scatters nothing
+    diffuse_light(const color &emit) : emit(emit) {};
+
+    const color &emission() const { return emit; };
+
+    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
+                 ray &scattered, sampler &smp) const {
+        return false;
+    };
+
+  private:
+    color emit;
+};
+
+using material = std::variant<lambertian, metal, dielectric, diffuse_light>;
+
+// By the index of each kind in material
+inline const char *const material_names[] = {"lambertian", "metal",
+                                             "dielectric", "diffuse_light"};
+
+// The counters and names are sized by hand, a new kind must grow them too
+static_assert(render_stats::material_kinds == std::variant_size_v<material>);
+static_assert(std::size(material_names) == std::variant_size_v<material>);
+
+class material_table {
+  public:
+    // The materials of a scene by value in one array. Objects refer to them
+    // by index, so a hit record carries no pointer to reference count, and
+    // scatter is a switch on the kind instead of a virtual call.
+    uint32_t add(const material &mat) {
+        materials.push_back(mat);
+
+        return uint32_t(materials.size() - 1);
+    };
+
+    const material &operator[](uint32_t id) const { return materials[id]; };
+
+    size_t size() const { return materials.size(); };
+
+    bool scatter(uint32_t id, const ray &r_in, const hit_record &rec,
+                 color &attenuation, ray &scattered, sampler &smp) const {
+        return std::visit(
+            [&](const auto &mat) {
+                return mat.scatter(r_in, rec, attenuation, scattered, smp);
+            },
+            materials[id]);
+    };
+
+    size_t kind(uint32_t id) const { return materials[id].index(); };
+
+    bool emissive(uint32_t id) const {
+        return std::holds_alternative<diffuse_light>(materials[id]);
+    };
+
+    color emitted(uint32_t id) const {
+        if (auto mat = std::get_if<diffuse_light>(&materials[id]))
+            return mat->emission();
+
+        return color(0, 0, 0);
+    };
+
+    bool samples_lights(uint32_t id) const {
+        // Whether light sampling can find directions the material might
+        // also scatter to. Mirrors, sharp metal and glass only scatter to
+        // single directions, which a light sample never hits.
+        if (std::holds_alternative<lambertian>(materials[id]))
+            return true;
+
+        auto mat = std::get_if<metal>(&materials[id]);
+
+        return mat && mat->fuzziness() > 0;
+    };
+
+    double pdf(uint32_t id, const ray &r_in, const hit_record &rec,
+               const vec3 &direction) const {
+        // Density of scatter directions, for materials that sample lights
+        if (auto mat = std::get_if<lambertian>(&materials[id]))
+            return mat->pdf(r_in, rec, direction);
+
+        if (auto mat = std::get_if<metal>(&materials[id]))
+            return mat->pdf(r_in, rec, direction);
+
+        return 0;
+    };
+
+    bool diffuse(uint32_t id) const {
+        // Whether the surface scatters light in every direction, rather than
+        // reflecting or refracting an image of what lies beyond it
+        return std::holds_alternative<lambertian>(materials[id]);
+    };
+
+    color albedo(uint32_t id) const {
+        if (auto mat = std::get_if<lambertian>(&materials[id]))
+            return mat->albedo_color();
+
+        if (auto mat = std::get_if<metal>(&materials[id]))
+            return mat->albedo_color();
+
+        return color(1, 1, 1);
+    };
+
+  private:
+    std::vector<material> materials;
+};
+
 #endif // !MATERIAL_H
@@ -0,0 +1,696 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Loaders for triangle meshes in Wavefront OBJ and binary PLY. Both map the
+// file into memory and parse it in chunks on a thread pool, no iostreams
+// involved. Polygons are split into triangle fans, everything but positions
+// and faces is skipped.
+
+struct mesh_data {
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices; // three per triangle, into vertices
+
+    size_t triangle_count() const { return indices.size() / 3; };
+
+    uint64_t content_hash() const {
+        uint64_t hash = hash_bytes(hash_seed, vertices.data(),
+                                   vertices.size() * sizeof(point3));
+
+        return hash_bytes(hash, indices.data(),
+                          indices.size() * sizeof(uint32_t));
+    };
+};
+
+class obj_chunk {
+  public:
+    // The vertices and faces of a run of whole lines. Faces refer to
+    // vertices by their index in the whole file. Negative OBJ indices count
+    // back from the latest vertex, so they are stored relative to the
+    // chunk's first vertex until the vertex counts of the chunks before are
+    // known.
+    std::vector<point3> vertices;
+    std::vector<int64_t> indices;
+    std::vector<size_t> relative; // positions in indices to offset
+    const char *error = nullptr;  // start of the first line that failed
+
+    void parse(const char *p, const char *end) {
+        while (p < end && error == nullptr) {
+            const char *line = p;
+            const char *eol = static_cast<const char *>(
+                std::memchr(p, '\n', size_t(end - p)));
+            eol = eol ? eol : end;
+
+            p = skip_blanks(p, eol);
+
+            if (eol - p > 1 && p[0] == 'v' && is_blank(p[1])) {
+                if (!parse_vertex(p + 2, eol))
+                    error = line;
+            } else if (eol - p > 1 && p[0] == 'f' && is_blank(p[1])) {
+                if (!parse_face(p + 2, eol))
+                    error = line;
+            }
+
+            p = eol + 1;
+        }
+    };
+
+  private:
+    std::vector<int64_t> polygon;
+    std::vector<bool> polygon_relative;
+
+    static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; };
+
+    static const char *skip_blanks(const char *p, const char *end) {
+        while (p < end && is_blank(*p))
+            p++;
+
+        return p;
+    };
+
+    bool parse_vertex(const char *p, const char *end) {
+        real e[3];
+
+        for (auto &value : e) {
+            p = skip_blanks(p, end);
+
+            if (p < end && *p == '+')
+                p++;
+
+            auto [next, status] = std::from_chars(p, end, value);
+
+            if (status != std::errc())
+                return false;
+
+            p = next;
+        }
+
+        vertices.push_back(point3(e[0], e[1], e[2]));
+
+        return true;
+    };
+
+    bool parse_face(const char *p, const char *end) {
+        // v, v/vt, v//vn or v/vt/vn per corner, only v is kept
+        polygon.clear();
+        polygon_relative.clear();
+
+        while ((p = skip_blanks(p, end)) < end) {
+            int64_t index;
+            auto [next, status] = std::from_chars(p, end, index);
+
+            if (status != std::errc() || index == 0)
+                return false;
+
+            polygon.push_back(index > 0 ? index - 1
+                                        : int64_t(vertices.size()) + index);
+            polygon_relative.push_back(index < 0);
+            p = next;
+
+            while (p < end && !is_blank(*p))
+                p++;
+        }
+
+        if (polygon.size() < 3)
+            return false;
+
+        for (size_t i = 1; i + 1 < polygon.size(); i++) {
+            for (size_t corner : {size_t(0), i, i + 1}) {
+                if (polygon_relative[corner])
+                    relative.push_back(indices.size());
+
+                indices.push_back(polygon[corner]);
+            }
+        }
+
+        return true;
+    };
+};
+
+inline bool load_obj(const std::string &path, mesh_data &mesh,
+                     std::string &error, int thread_count = 0) {
+    mapped_file file(path);
+
+    if (!file.valid()) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const char *begin = file.data();
+    const char *end = begin + file.size();
+
+    // Chunks of about 4 MB, split at line ends
+    thread_pool pool(thread_count);
+    size_t chunk_count = std::clamp<size_t>(file.size() >> 22, 1,
+                                            size_t(64) * pool.size());
+    std::vector<const char *> starts(chunk_count + 1, end);
+    starts[0] = begin;
+
+    for (size_t i = 1; i < chunk_count; i++) {
+        const char *p = begin + file.size() * i / chunk_count;
+        p = std::max(p, starts[i - 1]);
+
+        const char *eol =
+            static_cast<const char *>(std::memchr(p, '\n', size_t(end - p)));
+        starts[i] = eol ? eol + 1 : end;
+    }
+
+    std::vector<obj_chunk> chunks(chunk_count);
+
+    pool.run(int(chunk_count), [&](int i, int) {
+        chunks[i].parse(starts[i], starts[i + 1]);
+    });
+
+    size_t vertex_count = 0, index_count = 0;
+
+    for (const auto &chunk : chunks) {
+        if (chunk.error != nullptr) {
+            size_t line = 1 + std::count(begin, chunk.error, '\n');
+            error = path + ":" + std::to_string(line) + ": malformed line";
+            return false;
+        }
+
+        vertex_count += chunk.vertices.size();
+        index_count += chunk.indices.size();
+    }
+
+    if (vertex_count > UINT32_MAX) {
+        error = path + ": too many vertices";
+        return false;
+    }
+
+    mesh.vertices.resize(vertex_count);
+    mesh.indices.resize(index_count);
+
+    // Every chunk lands at the offsets of the chunks before it
+    std::vector<size_t> first_vertex(chunk_count), first_index(chunk_count);
+
+    for (size_t i = 1; i < chunk_count; i++) {
+        first_vertex[i] = first_vertex[i - 1] + chunks[i - 1].vertices.size();
+        first_index[i] = first_index[i - 1] + chunks[i - 1].indices.size();
+    }
+
+    std::atomic<bool> in_range = true;
+
+    pool.run(int(chunk_count), [&](int i, int) {
+        obj_chunk &chunk = chunks[i];
+
+        for (size_t position : chunk.relative)
+            chunk.indices[position] += int64_t(first_vertex[i]);
+
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(),
+                  mesh.vertices.begin() + first_vertex[i]);
+
+        uint32_t *out = mesh.indices.data() + first_index[i];
+
+        for (int64_t index : chunk.indices) {
+            if (index < 0 || uint64_t(index) >= vertex_count)
+                in_range = false;
+
+            *out++ = uint32_t(index);
+        }
+    });
+
+    if (!in_range) {
+        error = path + ": face refers to a missing vertex";
+        return false;
+    }
+
+    return true;
+}
+
+class ply_reader {
+  public:
+    // Binary PLY, either byte order. The vertex element must have x, y and
+    // z, the face element a list of vertex indices; other properties and
+    // elements of fixed size are skipped.
+    bool load(const std::string &path, mesh_data &mesh, std::string &error,
+              int thread_count) {
+        mapped_file file(path);
+
+        if (!file.valid()) {
+            error = "cannot open " + path;
+            return false;
+        }
+
+        const char *p = file.data();
+        const char *end = p + file.size();
+
+        if (!parse_header(p, end, error)) {
+            error = path + ": " + error;
+            return false;
+        }
+
+        thread_pool pool(thread_count);
+        bool have_vertices = false, have_faces = false;
+
+        for (const auto &elem : elements) {
+            if (elem.name == "vertex") {
+                if (!read_vertices(pool, elem, p, end, mesh))
+                    return fail(path, "truncated vertex data", error);
+
+                have_vertices = true;
+            } else if (elem.name == "face") {
+                if (!read_faces(pool, elem, p, end, mesh))
+                    return fail(path, "bad face data", error);
+
+                have_faces = true;
+            } else if (elem.has_list()) {
+                // Nothing past an element of unknown size is reachable
+                if (have_vertices && have_faces)
+                    break;
+
+                return fail(path, "cannot skip element " + elem.name, error);
+            } else {
+                if (!elem.fits(p, end))
+                    return fail(path, "truncated " + elem.name, error);
+
+                p += elem.count * elem.stride;
+            }
+        }
+
+        if (!have_vertices || !have_faces)
+            return fail(path, "no vertex or face element", error);
+
+        for (uint32_t index : mesh.indices)
+            if (index >= mesh.vertices.size())
+                return fail(path, "face refers to a missing vertex", error);
+
+        return true;
+    };
+
+  private:
+    enum class scalar { none, i8, u8, i16, u16, i32, u32, f32, f64 };
+
+    struct property {
+        std::string name;
+        scalar type = scalar::none;
+        scalar count_type = scalar::none; // set for lists only
+        size_t offset = 0; // from the start of the element record
+    };
+
+    struct element {
+        std::string name;
+        size_t count = 0;
+        size_t stride = 0; // record size, if no property is a list
+        std::vector<property> properties;
+
+        bool has_list() const {
+            for (const auto &prop : properties)
+                if (prop.count_type != scalar::none)
+                    return true;
+
+            return false;
+        };
+
+        const property *find(const char *name) const {
+            for (const auto &prop : properties)
+                if (prop.name == name)
+                    return &prop;
+
+            return nullptr;
+        };
+
+        bool fits(const char *p, const char *end) const {
+            // Whether count records of stride bytes lie between p and end,
+            // without multiplying a count from the file
+            return stride == 0 || count <= size_t(end - p) / stride;
+        };
+    };
+
+    std::vector<element> elements;
+    bool swap_bytes = false;
+
+    static bool fail(const std::string &path, const std::string &what,
+                     std::string &error) {
+        error = path + ": " + what;
+        return false;
+    };
+
+    static scalar scalar_from_name(const std::string &name) {
+        static const struct {
+            const char *name;
+            scalar type;
+        } names[] = {
+            {"char", scalar::i8},     {"int8", scalar::i8},
+            {"uchar", scalar::u8},    {"uint8", scalar::u8},
+            {"short", scalar::i16},   {"int16", scalar::i16},
+            {"ushort", scalar::u16},  {"uint16", scalar::u16},
+            {"int", scalar::i32},     {"int32", scalar::i32},
+            {"uint", scalar::u32},    {"uint32", scalar::u32},
+            {"float", scalar::f32},   {"float32", scalar::f32},
+            {"double", scalar::f64},  {"float64", scalar::f64},
+        };
+
+        for (const auto &entry : names)
+            if (name == entry.name)
+                return entry.type;
+
+        return scalar::none;
+    };
+
+    static size_t scalar_size(scalar type) {
+        switch (type) {
+        case scalar::i8:
+        case scalar::u8:
+            return 1;
+        case scalar::i16:
+        case scalar::u16:
+            return 2;
+        case scalar::i32:
+        case scalar::u32:
+        case scalar::f32:
+            return 4;
+        case scalar::f64:
+            return 8;
+        default:
+            return 0;
+        }
+    };
+
+    template <typename T> T load_as(const char *p) const {
+        T value;
+        std::memcpy(&value, p, sizeof(T));
+
+        if (swap_bytes && sizeof(T) > 1) {
+            auto bytes = std::bit_cast<std::array<char, sizeof(T)>>(value);
+            std::reverse(bytes.begin(), bytes.end());
+            value = std::bit_cast<T>(bytes);
+        }
+
+        return value;
+    };
+
+    double read_scalar(const char *p, scalar type) const {
+        switch (type) {
+        case scalar::i8:
+            return load_as<int8_t>(p);
+        case scalar::u8:
+            return load_as<uint8_t>(p);
+        case scalar::i16:
+            return load_as<int16_t>(p);
+        case scalar::u16:
+            return load_as<uint16_t>(p);
+        case scalar::i32:
+            return load_as<int32_t>(p);
+        case scalar::u32:
+            return load_as<uint32_t>(p);
+        case scalar::f32:
+            return load_as<float>(p);
+        case scalar::f64:
+            return load_as<double>(p);
+        default:
+            return 0;
+        }
+    };
+
+    int64_t read_index(const char *p, scalar type) const {
+        // Integer types only, so indices above 2^53 stay exact
+        switch (type) {
+        case scalar::i8:
+            return load_as<int8_t>(p);
+        case scalar::u8:
+            return load_as<uint8_t>(p);
+        case scalar::i16:
+            return load_as<int16_t>(p);
+        case scalar::u16:
+            return load_as<uint16_t>(p);
+        case scalar::i32:
+            return load_as<int32_t>(p);
+        case scalar::u32:
+            return load_as<uint32_t>(p);
+        default:
+            return -1;
+        }
+    };
+
+    bool parse_header(const char *&p, const char *end, std::string &error) {
+        // Moves p to the first byte of data
+        auto next_line = [&](std::vector<std::string> &words) {
+            const char *eol = static_cast<const char *>(
+                std::memchr(p, '\n', size_t(end - p)));
+
+            if (eol == nullptr)
+                return false;
+
+            words.clear();
+            std::string word;
+
+            for (const char *c = p; c < eol; c++) {
+                if (*c == ' ' || *c == '\t' || *c == '\r') {
+                    if (!word.empty())
+                        words.push_back(std::move(word));
+                    word.clear();
+                } else {
+                    word += *c;
+                }
+            }
+
+            if (!word.empty())
+                words.push_back(std::move(word));
+
+            p = eol + 1;
+
+            return true;
+        };
+
+        std::vector<std::string> words;
+
+        if (!next_line(words) || words.size() != 1 || words[0] != "ply") {
+            error = "not a PLY file";
+            return false;
+        }
+
+        while (next_line(words)) {
+            if (words.empty() || words[0] == "comment" ||
+                words[0] == "obj_info")
+                continue;
+
+            if (words[0] == "end_header") {
+                // read_faces takes the first property as the index list
+                for (const auto &elem : elements) {
+                    if (elem.name == "face" &&
+                        (elem.properties.empty() ||
+                         elem.properties[0].count_type == scalar::none)) {
+                        error = "face element does not start with a list";
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+            if (words[0] == "format" && words.size() >= 2) {
+                bool little = words[1] == "binary_little_endian";
+
+                if (!little && words[1] != "binary_big_endian") {
+                    error = words[1] + " PLY is not supported, only binary";
+                    return false;
+                }
+
+                swap_bytes = little != (std::endian::native ==
+                                        std::endian::little);
+            } else if (words[0] == "element" && words.size() == 3) {
+                const std::string &count = words[2];
+                element elem{words[1], 0, 0, {}};
+
+                if (std::from_chars(count.data(), count.data() + count.size(),
+                                    elem.count)
+                        .ec != std::errc()) {
+                    error = "bad element count " + count;
+                    return false;
+                }
+
+                elements.push_back(elem);
+            } else if (words[0] == "property" && !elements.empty()) {
+                element &elem = elements.back();
+                property prop;
+
+                if (words.size() == 5 && words[1] == "list") {
+                    prop.count_type = scalar_from_name(words[2]);
+                    prop.type = scalar_from_name(words[3]);
+                    prop.name = words[4];
+
+                    if (prop.count_type == scalar::none ||
+                        prop.count_type == scalar::f32 ||
+                        prop.count_type == scalar::f64) {
+                        error = "bad list count type " + words[2];
+                        return false;
+                    }
+                } else if (words.size() == 3) {
+                    prop.type = scalar_from_name(words[1]);
+                    prop.name = words[2];
+                }
+
+                if (prop.type == scalar::none) {
+                    error = "bad property line";
+                    return false;
+                }
+
+                prop.offset = elem.stride;
+                elem.stride += scalar_size(prop.type);
+                elem.properties.push_back(prop);
+            } else {
+                error = "unexpected header line " + words[0];
+                return false;
+            }
+        }
+
+        error = "no end_header";
+        return false;
+    };
+
+    bool read_vertices(thread_pool &pool, const element &elem, const char *&p,
+                       const char *end, mesh_data &mesh) const {
+        const property *x = elem.find("x");
+        const property *y = elem.find("y");
+        const property *z = elem.find("z");
+
+        if (!x || !y || !z || elem.has_list() || !elem.fits(p, end))
+            return false;
+
+        mesh.vertices.resize(elem.count);
+        const char *data = p;
+
+        // Fixed size records, every chunk knows where its part starts
+        int chunk_count = std::max(1, int(elem.count >> 16));
+
+        pool.run(chunk_count, [&](int chunk, int) {
+            size_t first = elem.count * chunk / chunk_count;
+            size_t last = elem.count * (chunk + 1) / chunk_count;
+
+            for (size_t i = first; i < last; i++) {
+                const char *record = data + i * elem.stride;
+                mesh.vertices[i] =
+                    point3(real(read_scalar(record + x->offset, x->type)),
+                           real(read_scalar(record + y->offset, y->type)),
+                           real(read_scalar(record + z->offset, z->type)));
+            }
+        });
+
+        p += elem.count * elem.stride;
+
+        return true;
+    };
+
+    bool read_faces(thread_pool &pool, const element &elem, const char *&p,
+                    const char *end, mesh_data &mesh) const {
+        // The index list must come first, any fixed size properties after it
+        const property &list = elem.properties[0];
+
+        if (list.count_type == scalar::none || list.type == scalar::f32 ||
+            list.type == scalar::f64)
+            return false;
+
+        for (size_t i = 1; i < elem.properties.size(); i++)
+            if (elem.properties[i].count_type != scalar::none)
+                return false;
+
+        size_t count_size = scalar_size(list.count_type);
+        size_t index_size = scalar_size(list.type);
+        size_t tail = elem.stride - index_size; // the other properties
+
+        // All triangles, the common case, gives fixed size records that are
+        // decoded in parallel. Anything else takes the sequential path.
+        size_t record = count_size + 3 * index_size + tail;
+        std::atomic<bool> all_triangles =
+            elem.count <= size_t(end - p) / record;
+
+        if (all_triangles) {
+            mesh.indices.resize(3 * elem.count);
+            const char *data = p;
+            int chunk_count = std::max(1, int(elem.count >> 16));
+
+            pool.run(chunk_count, [&](int chunk, int) {
+                size_t first = elem.count * chunk / chunk_count;
+                size_t last = elem.count * (chunk + 1) / chunk_count;
+
+                for (size_t i = first; i < last && all_triangles; i++) {
+                    const char *face = data + i * record;
+
+                    if (read_index(face, list.count_type) != 3) {
+                        all_triangles = false;
+                        break;
+                    }
+
+                    for (int k = 0; k < 3; k++)
+                        mesh.indices[3 * i + k] = uint32_t(read_index(
+                            face + count_size + k * index_size, list.type));
+                }
+            });
+
+            if (all_triangles) {
+                p += elem.count * record;
+                return true;
+            }
+        }
+
+        mesh.indices.clear();
+
+        for (size_t i = 0; i < elem.count; i++) {
+            if (size_t(end - p) < count_size)
+                return false;
+
+            int64_t n = read_index(p, list.count_type);
+            p += count_size;
+
+            if (n < 3 || size_t(end - p) < n * index_size + tail)
+                return false;
+
+            int64_t v0 = read_index(p, list.type);
+
+            for (int64_t k = 1; k + 1 < n; k++) {
+                mesh.indices.insert(
+                    mesh.indices.end(),
+                    {uint32_t(v0), uint32_t(read_index(p + k * index_size,
+                                                       list.type)),
+                     uint32_t(read_index(p + (k + 1) * index_size,
+                                         list.type))});
+            }
+
+            p += n * index_size + tail;
+        }
+
+        return true;
+    };
+};
+
+inline bool load_ply(const std::string &path, mesh_data &mesh,
+                     std::string &error, int thread_count = 0) {
+    return ply_reader().load(path, mesh, error, thread_count);
+}
+
+inline bool load_mesh(const std::string &path, mesh_data &mesh,
+                      std::string &error, int thread_count = 0) {
+    // Picks the loader from the file extension
+    auto ends_with = [&](const char *suffix) {
+        size_t n = std::strlen(suffix);
+
+        return path.size() >= n &&
+               path.compare(path.size() - n, n, suffix) == 0;
+    };
+
+    if (ends_with(".obj"))
+        return load_obj(path, mesh, error, thread_count);
+    if (ends_with(".ply"))
+        return load_ply(path, mesh, error, thread_count);
+
+    error = "unknown mesh format: " + path;
+
+    return false;
+}
+
+#endif // !MESH_LOADER_H
@@ -0,0 +1,22 @@
+#ifndef PATH_STATE_H
+#define PATH_STATE_H
+
+#include "color.h"
+#include "ray.h"
+
+struct path_state {
+    // One camera path in flight: the ray to trace next, the fraction of the
+    // light found along it that reaches the camera, how many times the path
+    // has scattered so far and the light it has gathered. scatter_pdf is
+    // the density r's direction was drawn with, 0 for the camera ray and
+    // after mirrors and glass.
+    ray r;
+    color throughput = color(1, 1, 1);
+    int bounce = 0;
+    color radiance = color(0, 0, 0);
+    double scatter_pdf = 0;
+
+    path_state(const ray &r) : r(r) {};
+};
+
+#endif // !PATH_STATE_H
@@ -0,0 +1,66 @@
+#ifndef PIXEL_ESTIMATE_H
+#define PIXEL_ESTIMATE_H
+
+#include "color.h"
+
+#include <cmath>
+
+struct pixel_estimate {
+    // Running sums over the samples of one pixel, enough for the mean color
+    // and the variance of its luminance
+    color sum = color(0, 0, 0);
+    double luminance_sum = 0;
+    double luminance_squares = 0;
+    int samples = 0;
+
+    // Albedo and normal of each sample's first diffuse hit, for denoising
+    color albedo_sum = color(0, 0, 0);
+    vec3 normal_sum = vec3(0, 0, 0);
+
+    void add(const color &sample) {
+        double y = 0.2126 * sample.x() + 0.7152 * sample.y() +
+                   0.0722 * sample.z();
+
+        sum += sample;
+        luminance_sum += y;
+        luminance_squares += y * y;
+        samples++;
+    };
+
+    void add_features(const color &albedo, const vec3 &normal) {
+        albedo_sum += albedo;
+        normal_sum += normal;
+    };
+
+    color mean() const { return (1.0 / samples) * sum; };
+
+    color mean_albedo() const { return (1.0 / samples) * albedo_sum; };
+
+    vec3 mean_normal() const { return (1.0 / samples) * normal_sum; };
+
+    double mean_variance() const {
+        // Variance of the mean luminance, from the sample variance
+        if (samples < 2)
+            return infinity;
+
+        double n = samples;
+        double mean_y = luminance_sum / n;
+        double variance =
+            std::fmax(0, (luminance_squares - n * mean_y * mean_y) / (n - 1));
+
+        return variance / n;
+    };
+
+    double display_error() const {
+        // Standard error of the mean luminance carried through the gamma 2
+        // output curve, d sqrt(y) = dy / (2 sqrt(y)), so the estimate is in
+        // the units of the written image. Dark pixels get a floor, or their
+        // tiny means would make any noise look huge.
+        double standard_error = std::sqrt(mean_variance());
+        double mean_y = luminance_sum / samples;
+
+        return standard_error / (2 * std::sqrt(std::fmax(mean_y, 1e-3)));
+    };
+};
+
+#endif // !PIXEL_ESTIMATE_H
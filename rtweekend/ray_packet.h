@@ -0,0 +1,62 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "interval.h"
+#include "ray.h"
+
+// A small batch of rays stored component by component, so intersection
+// kernels can load the same component of several rays with one SIMD load.
+// Lanes past count are inactive: their t_max is -infinity, which makes
+// every interval test on them fail.
+struct ray_packet {
+    static constexpr int size = 8;
+
+    alignas(32) real ox[size], oy[size], oz[size];
+    alignas(32) real dx[size], dy[size], dz[size];
+    alignas(32) real inv_dx[size], inv_dy[size], inv_dz[size];
+    alignas(32) real t_max[size]; // closest hit so far, per lane
+    real t_min = 0;
+    bool hit[size];
+    int count = 0;
+
+    ray_packet(real t_min = 0) : t_min(t_min) {
+        for (int k = 0; k < size; k++) {
+            ox[k] = oy[k] = oz[k] = 0;
+            dx[k] = dy[k] = dz[k] = 1;
+            inv_dx[k] = inv_dy[k] = inv_dz[k] = 1;
+            t_max[k] = -infinity;
+            hit[k] = false;
+        }
+    };
+
+    void add(const ray &r, real ray_t_max = infinity) {
+        int k = count++;
+        const point3 &o = r.origin();
+        const vec3 &d = r.direction();
+
+        ox[k] = o.x(), oy[k] = o.y(), oz[k] = o.z();
+        dx[k] = d.x(), dy[k] = d.y(), dz[k] = d.z();
+        inv_dx[k] = 1 / d.x(), inv_dy[k] = 1 / d.y(), inv_dz[k] = 1 / d.z();
+        t_max[k] = ray_t_max;
+        hit[k] = false;
+    };
+
+    ray get(int k) const {
+        return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]));
+    };
+
+    interval lane_interval(int k) const { return interval(t_min, t_max[k]); };
+
+    real max_t() const {
+        // Furthest closest-hit over the lanes, anything behind it is hidden
+        // from the whole packet
+        real t = -infinity;
+
+        for (int k = 0; k < size; k++)
+            t = t_max[k] > t ? t_max[k] : t;
+
+        return t;
+    };
+};
+
+#endif // !RAY_PACKET_H
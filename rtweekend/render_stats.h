@@ -0,0 +1,172 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct render_stats {
+    // Counters of a render, or of one thread's share of it. Traversals and
+    // the camera count into the calling thread's own copy, and the camera
+    // sums its workers' copies tile by tile, so counting takes no atomics
+    // and shares no cache lines. A copy is plain data, which keeps the
+    // thread local access a single offset from the thread pointer.
+    static constexpr int material_kinds = 4; // as in material.h
+    static constexpr int path_buckets = 65; // 0 to 63 bounces, then more
+
+    uint64_t camera_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t shadow_rays = 0;
+    uint64_t box_tests = 0;       // ray against bounding box, per ray
+    uint64_t primitive_tests = 0; // leaf entries tried, per ray
+    uint64_t hits[material_kinds] = {}; // surface hits by material kind
+    uint64_t escaped = 0;               // paths that left the scene
+    uint64_t absorbed = 0;              // paths a material stopped
+    uint64_t depth_limited = 0;         // paths cut off at max_depth
+    uint64_t roulette_ended = 0;        // paths russian roulette stopped
+    uint64_t path_lengths[path_buckets] = {}; // paths by bounces
+
+    void end_path(int bounces) {
+        path_lengths[std::min(bounces, path_buckets - 1)]++;
+    };
+
+    uint64_t rays() const {
+        return camera_rays + secondary_rays + shadow_rays;
+    };
+
+    double mean_path_length() const {
+        // In bounces, counting the last bucket as its lower bound
+        uint64_t paths = 0, bounces = 0;
+
+        for (int i = 0; i < path_buckets; i++) {
+            paths += path_lengths[i];
+            bounces += i * path_lengths[i];
+        }
+
+        return paths ? double(bounces) / paths : 0;
+    };
+
+    void merge(const render_stats &other) {
+        camera_rays += other.camera_rays;
+        secondary_rays += other.secondary_rays;
+        shadow_rays += other.shadow_rays;
+        box_tests += other.box_tests;
+        primitive_tests += other.primitive_tests;
+        escaped += other.escaped;
+        absorbed += other.absorbed;
+        depth_limited += other.depth_limited;
+        roulette_ended += other.roulette_ended;
+
+        for (int i = 0; i < material_kinds; i++)
+            hits[i] += other.hits[i];
+
+        for (int i = 0; i < path_buckets; i++)
+            path_lengths[i] += other.path_lengths[i];
+    };
+};
+
+inline render_stats &thread_render_stats() {
+    thread_local render_stats stats;
+
+    return stats;
+}
+
+inline void count_traversal(uint64_t box_tests, uint64_t primitive_tests) {
+    // Called once per traversal with its totals, so the loops themselves
+    // only bump locals
+    render_stats &stats = thread_render_stats();
+
+    stats.box_tests += box_tests;
+    stats.primitive_tests += primitive_tests;
+}
+
+struct tile_stats {
+    int x0, y0, x1, y1;
+    int worker;
+    double seconds;
+    render_stats counters;
+};
+
+inline void write_stats_json(std::ostream &out, const render_stats &stats,
+                             const std::vector<tile_stats> &tiles, int width,
+                             int height, double seconds,
+                             const char *const material_names[]) {
+    // Totals, then one entry per tile in render order
+    auto number = [](double value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.6g", value);
+
+        return std::string(text);
+    };
+
+    auto counters = [&](const render_stats &s, const char *separator) {
+        out << "\"camera_rays\": " << s.camera_rays << separator
+            << "\"secondary_rays\": " << s.secondary_rays << separator
+            << "\"shadow_rays\": " << s.shadow_rays << separator
+            << "\"box_tests\": " << s.box_tests << separator
+            << "\"primitive_tests\": " << s.primitive_tests;
+    };
+
+    out << "{\n  \"width\": " << width << ",\n  \"height\": " << height
+        << ",\n  \"seconds\": " << number(seconds) << ",\n  ";
+    counters(stats, ",\n  ");
+    out << ",\n  \"hits\": {";
+
+    for (int i = 0; i < render_stats::material_kinds; i++)
+        out << (i ? ", " : "") << '"' << material_names[i]
+            << "\": " << stats.hits[i];
+
+    out << "},\n  \"escaped\": " << stats.escaped
+        << ",\n  \"absorbed\": " << stats.absorbed
+        << ",\n  \"depth_limited\": " << stats.depth_limited
+        << ",\n  \"roulette_ended\": " << stats.roulette_ended
+        << ",\n  \"mean_path_length\": " << number(stats.mean_path_length())
+        << ",\n  \"path_lengths\": [";
+
+    // Up to the longest path seen, the last bucket holding any longer
+    int last = render_stats::path_buckets - 1;
+
+    while (last > 0 && stats.path_lengths[last] == 0)
+        last--;
+
+    for (int i = 0; i <= last; i++)
+        out << (i ? ", " : "") << stats.path_lengths[i];
+
+    out << "],\n  \"tiles\": [";
+
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const tile_stats &tile = tiles[i];
+
+        out << (i ? "," : "") << "\n    {\"x\": " << tile.x0
+            << ", \"y\": " << tile.y0 << ", \"width\": " << tile.x1 - tile.x0
+            << ", \"height\": " << tile.y1 - tile.y0
+            << ", \"worker\": " << tile.worker
+            << ", \"seconds\": " << number(tile.seconds) << ",\n     ";
+        counters(tile.counters, ", ");
+        out << '}';
+    }
+
+    out << "\n  ]\n}\n";
+}
+
+inline std::vector<double> tile_cost(const std::vector<tile_stats> &tiles,
+                                     int width, int height) {
+    // Every pixel gets the time per pixel of its tile, for heatmap
+    std::vector<double> cost(size_t(width) * height, 0);
+
+    for (const tile_stats &tile : tiles) {
+        double per_pixel =
+            tile.seconds / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+
+        for (int y = tile.y0; y < tile.y1; y++)
+            std::fill_n(cost.begin() + size_t(y) * width + tile.x0,
+                        tile.x1 - tile.x0, per_pixel);
+    }
+
+    return cost;
+}
+
+#endif // !RENDER_STATS_H
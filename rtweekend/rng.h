@@ -0,0 +1,98 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+inline constexpr uint64_t mix_bits(uint64_t z) {
+    // splitmix64 finalizer, turns nearby integers into unrelated ones
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+class rng {
+  public:
+    // xoshiro256+ (Blackman & Vigna), the variant meant for generating
+    // floating point numbers. The upper 53 bits go straight into the
+    // mantissa of a double in [0, 1).
+    constexpr rng() { seed(0); };
+
+    constexpr rng(uint64_t stream, uint64_t index = 0) {
+        seed(stream, index);
+    };
+
+    constexpr void seed(uint64_t stream, uint64_t index = 0) {
+        // Expand (stream, index) through splitmix64 so nearby pixels and
+        // sample numbers start from unrelated states
+        uint64_t x = stream * 0x9e3779b97f4a7c15ull ^ mix_bits(index);
+
+        for (auto &word : s)
+            word = splitmix64(x);
+    };
+
+    uint64_t next_u64() {
+        uint64_t result = s[0] + s[3];
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    };
+
+    double next_double() { return to_double(next_u64()); };
+
+    void next_doubles(double *out, int n) {
+        // Batch version of next_double, keeps the state in registers for
+        // the whole run instead of going through memory for every value
+        uint64_t s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+
+        for (int i = 0; i < n; i++) {
+            out[i] = to_double(s0 + s3);
+
+            uint64_t t = s1 << 17;
+            s2 ^= s0;
+            s3 ^= s1;
+            s1 ^= s2;
+            s0 ^= s3;
+            s2 ^= t;
+            s3 = rotl(s3, 45);
+        }
+
+        s[0] = s0, s[1] = s1, s[2] = s2, s[3] = s3;
+    };
+
+  private:
+    uint64_t s[4] = {};
+
+    static constexpr uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    };
+
+    static double to_double(uint64_t x) { return (x >> 11) * 0x1.0p-53; }
+
+    static constexpr uint64_t splitmix64(uint64_t &x) {
+        x += 0x9e3779b97f4a7c15ull;
+
+        return mix_bits(x);
+    };
+};
+
+inline rng &thread_rng() {
+    // Each thread draws from its own generator, nothing is shared between
+    // render threads. Constant initialized, so access needs no guard check.
+    constinit thread_local rng generator;
+
+    return generator;
+}
+
+inline void seed_thread_rng(uint64_t stream, uint64_t index = 0) {
+    thread_rng().seed(stream, index);
+}
+
+#endif // !RNG_H
@@ -2,17 +2,29 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
 
+#include "rng.h"
+
 // C++ std usings
 using std::make_shared;
 using std::shared_ptr;
 
+// Scalar type of the geometry and colors, chosen at build time. Samplers,
+// random numbers and the camera setup stay in double either way.
+#ifdef RTW_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
-const double infinity = std::numeric_limits<double>::infinity();
+const real infinity = std::numeric_limits<real>::infinity();
 const double pi = 3.1415926535897932385;
 
 // Utlity functions
@@ -21,8 +33,13 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    // Returns a random real in (0, 1)
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0, 1) from the calling thread's generator
+    return thread_rng().next_double();
+}
+
+inline void random_doubles(double *out, int n) {
+    // Fills out with n random reals in [0, 1)
+    thread_rng().next_doubles(out, n);
 }
 
 inline double random_double(double min, double max) {
@@ -30,6 +47,19 @@ inline double random_double(double min, double max) {
     return min + (max - min) * random_double();
 }
 
+// FNV-1a, for fingerprints of scenes and settings: start from hash_seed and
+// feed each run of bytes to hash_bytes
+constexpr uint64_t hash_seed = 0xcbf29ce484222325ull;
+
+inline uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+    return hash;
+}
+
 // Common Headers
 #include "color.h"
 #include "interval.h"
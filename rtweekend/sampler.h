@@ -0,0 +1,363 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+
+// A sampler hands out the random numbers of one pixel sample, dimension by
+// dimension: 2 for the pixel jitter, 2 for the lens and then a fixed block
+// per bounce: 2 for the scatter, 1 for russian roulette and 3 for a light
+// sample. Keeping every sample of a pixel on the same dimensions is what
+// lets the low discrepancy samplers stratify each decision across samples.
+class sampler {
+  public:
+    static constexpr int camera_dimensions = 4;
+    static constexpr int bounce_dimensions = 6;
+
+    virtual ~sampler() = default;
+
+    void set_samples_per_pixel(int spp) { samples_per_pixel = spp; };
+
+    virtual void start_pixel_sample(int i, int j, int sample_index) = 0;
+
+    // Jump to a dimension, e.g. the first one of a bounce. What follows only
+    // depends on pixel, sample and dimension, so a sample can be restarted
+    // and resumed at any dimension.
+    virtual void set_dimension(int d) = 0;
+
+    virtual double get_1d() = 0;
+
+    // Returns a point in [0, 1)^2 in the x and y components
+    virtual vec3 get_2d() = 0;
+
+    // Render threads each work on their own copy
+    virtual std::unique_ptr<sampler> clone() const = 0;
+
+  protected:
+    int samples_per_pixel = 1;
+};
+
+inline uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+    // Kensler's hash based permutation, returns the element at i of a random
+    // permutation of [0, l) selected by p without storing it
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+
+    return (i + p) % l;
+}
+
+inline uint64_t pixel_hash(int i, int j, int dimension, uint64_t seed) {
+    return mix_bits(mix_bits((uint64_t(uint32_t(j)) << 32) | uint32_t(i)) ^
+                    mix_bits(uint64_t(dimension) + seed));
+}
+
+inline double to_unit_double(uint32_t v) {
+    // Maps 32 bits into [0, 1) keeping the top bits of v most significant
+    return v * 0x1p-32;
+}
+
+inline double hashed_jitter(uint64_t hash, int sample_index) {
+    return to_unit_double(uint32_t(mix_bits(hash ^ uint64_t(sample_index))));
+}
+
+class independent_sampler : public sampler {
+  public:
+    // Plain uniform random numbers, the baseline everything is measured
+    // against
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        pixel = (uint64_t(uint32_t(j)) << 32) | uint32_t(i);
+        index = sample_index;
+        gen.seed(pixel, index);
+    };
+
+    void set_dimension(int d) override {
+        gen.seed(pixel ^ mix_bits(d), index);
+    };
+
+    double get_1d() override { return gen.next_double(); };
+
+    vec3 get_2d() override {
+        double u[2];
+        gen.next_doubles(u, 2);
+
+        return vec3(u[0], u[1], 0);
+    };
+
+    std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<independent_sampler>(*this);
+    };
+
+  private:
+    uint64_t pixel = 0;
+    int index = 0;
+    rng gen;
+};
+
+class stratified_sampler : public sampler {
+  public:
+    // Jittered stratification of every dimension (pair) on its own. Samples
+    // walk the strata in a different random order per pixel and dimension,
+    // so the dimensions do not line up with each other.
+    stratified_sampler(uint64_t seed = 0) : seed(seed) {};
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        px = i;
+        py = j;
+        index = sample_index;
+        dimension = 0;
+    };
+
+    void set_dimension(int d) override { dimension = d; };
+
+    double get_1d() override {
+        uint64_t hash = pixel_hash(px, py, dimension++, seed);
+        uint32_t strata = uint32_t(samples_per_pixel);
+        uint32_t stratum =
+            permutation_element(uint32_t(index) % strata, strata, hash);
+
+        return (stratum + hashed_jitter(hash, index)) / strata;
+    };
+
+    vec3 get_2d() override {
+        uint64_t hash = pixel_hash(px, py, dimension, seed);
+        dimension += 2;
+
+        // The closest to square grid with at least one stratum per sample
+        int nx = int(std::sqrt(double(samples_per_pixel)));
+        int ny = (samples_per_pixel + nx - 1) / nx;
+        uint32_t strata = uint32_t(nx * ny);
+        uint32_t stratum =
+            permutation_element(uint32_t(index) % strata, strata, hash);
+
+        auto ju = hashed_jitter(hash, index);
+        auto jv = hashed_jitter(~hash, index);
+
+        return vec3((stratum % nx + ju) / nx, (stratum / nx + jv) / ny, 0);
+    };
+
+    std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<stratified_sampler>(*this);
+    };
+
+  private:
+    uint64_t seed;
+    int px = 0, py = 0;
+    int index = 0;
+    int dimension = 0;
+};
+
+class halton_sampler : public sampler {
+  public:
+    // Halton sequence with one prime base per dimension, Owen scrambled
+    // with a different seed per pixel. Dimensions past the table of bases
+    // fall back to independent random numbers; the low discrepancy of high
+    // Halton dimensions only shows at very high sample counts anyway.
+    static constexpr int max_dimensions = 64;
+
+    halton_sampler(uint64_t seed = 0) : seed(seed) {};
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        px = i;
+        py = j;
+        index = sample_index;
+        dimension = 0;
+    };
+
+    void set_dimension(int d) override { dimension = d; };
+
+    double get_1d() override {
+        int d = dimension++;
+        uint64_t hash = pixel_hash(px, py, d, seed);
+
+        if (d >= max_dimensions)
+            return hashed_jitter(hash, index);
+
+        return scrambled_radical_inverse(primes()[d], uint64_t(index), hash);
+    };
+
+    vec3 get_2d() override {
+        auto u = get_1d();
+        auto v = get_1d();
+
+        return vec3(u, v, 0);
+    };
+
+    std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<halton_sampler>(*this);
+    };
+
+  private:
+    uint64_t seed;
+    int px = 0, py = 0;
+    int index = 0;
+    int dimension = 0;
+
+    static const int *primes() {
+        static const auto table = [] {
+            std::array<int, max_dimensions> p{};
+            int n = 0;
+
+            for (int candidate = 2; n < max_dimensions; candidate++) {
+                bool prime = true;
+
+                for (int k = 0; k < n && p[k] * p[k] <= candidate; k++)
+                    if (candidate % p[k] == 0)
+                        prime = false;
+
+                if (prime)
+                    p[n++] = candidate;
+            }
+
+            return p;
+        }();
+
+        return table.data();
+    };
+
+    static double scrambled_radical_inverse(int base, uint64_t a,
+                                            uint64_t hash) {
+        // Mirrors the base-b digits of a around the radix point, permuting
+        // every digit with a permutation chosen by the digits above it.
+        // Runs past the last nonzero digit so the trailing zeros get
+        // scrambled too.
+        const double inv_base = 1.0 / base;
+        double inv_base_m = 1;
+        uint64_t reversed = 0;
+
+        while (1 - (base - 1) * inv_base_m < 1) {
+            uint64_t next = a / base;
+            uint32_t digit = uint32_t(a - next * base);
+            uint32_t digit_hash = uint32_t(mix_bits(hash ^ reversed));
+
+            digit = permutation_element(digit, base, digit_hash);
+            reversed = reversed * base + digit;
+            inv_base_m *= inv_base;
+            a = next;
+        }
+
+        return std::min(inv_base_m * reversed, 1 - 0x1p-53);
+    };
+};
+
+class sobol_sampler : public sampler {
+  public:
+    // The first two Sobol dimensions, reused for every pair of dimensions
+    // ("padded" Sobol). Each pair visits the points in its own random order
+    // and gets its own Owen scramble, which decorrelates the pairs while
+    // keeping the excellent 2D stratification of (0, 2)-sequences.
+    sobol_sampler(uint64_t seed = 0) : seed(seed) {};
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        px = i;
+        py = j;
+        index = sample_index;
+        dimension = 0;
+    };
+
+    void set_dimension(int d) override { dimension = d; };
+
+    double get_1d() override {
+        uint64_t hash = pixel_hash(px, py, dimension++, seed);
+        uint32_t point = shuffled_index(hash);
+
+        return to_unit_double(owen_scramble(reverse_bits(point), hash >> 32));
+    };
+
+    vec3 get_2d() override {
+        uint64_t hash = pixel_hash(px, py, dimension, seed);
+        dimension += 2;
+
+        uint32_t point = shuffled_index(hash);
+        uint32_t x = reverse_bits(point);
+        uint32_t y = sobol_second_dimension(point);
+
+        return vec3(to_unit_double(owen_scramble(x, uint32_t(hash >> 32))),
+                    to_unit_double(owen_scramble(y, uint32_t(hash))), 0);
+    };
+
+    std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<sobol_sampler>(*this);
+    };
+
+  private:
+    uint64_t seed;
+    int px = 0, py = 0;
+    int index = 0;
+    int dimension = 0;
+
+    uint32_t shuffled_index(uint64_t hash) const {
+        // A nested uniform scramble of the sample index (Burley 2020). Bit k
+        // only flips depending on the bits above it, so the first 2^m
+        // samples map to one aligned block of 2^m Sobol points, which is a
+        // (0, m, 2)-net. Every power of two prefix stays stratified whatever
+        // the sample count, which is what adaptive sampling relies on.
+        return owen_scramble(uint32_t(index), uint32_t(mix_bits(hash)));
+    };
+
+    static uint32_t reverse_bits(uint32_t v) {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+        v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+
+        return (v >> 16) | (v << 16);
+    };
+
+    static uint32_t sobol_second_dimension(uint32_t index) {
+        // Generator matrix of primitive polynomial x + 1, built column by
+        // column as v_k = v_(k-1) ^ (v_(k-1) >> 1)
+        uint32_t result = 0;
+        uint32_t v = 1u << 31;
+
+        for (; index != 0; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+
+        return result;
+    };
+
+    static uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+        // Laine-Karras style hash, each bit flip depends only on the bits
+        // above it, which is what a nested uniform scramble requires
+        v = reverse_bits(v);
+        v ^= v * 0x3d20adea;
+        v += seed;
+        v *= (seed >> 16) | 1;
+        v ^= v * 0x05526c56;
+        v ^= v * 0x53a22864;
+
+        return reverse_bits(v);
+    };
+};
+
+#endif // !SAMPLER_H
@@ -0,0 +1,605 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "triangle_mesh.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// A binary scene cache: a header, a table of sections and then one array per
+// section, each starting on a 64 byte boundary. The arrays hold plain
+// records, ready built bvh nodes included, and refer to each other by index
+// only, so a mapped file is traced in place without parsing or fixing up
+// pointers. Records are stored in the layout of the build that wrote them,
+// and the header lets a reader with another layout refuse the file.
+
+struct scene_file_header {
+    char magic[8];          // "RTWSCENE"
+    uint32_t version;       // scene_file_version
+    uint32_t endian;        // 0x01020304 in the writer's byte order
+    uint32_t real_size;     // sizeof(real)
+    uint32_t vec3_size;     // sizeof(vec3), 16 or 32 when padded
+    uint32_t section_count; // entries in the table that follows
+    uint32_t reserved;
+    uint64_t file_size;
+};
+
+struct scene_file_section {
+    uint32_t kind;        // one of scene_section
+    uint32_t record_size; // bytes per record
+    uint64_t count;       // records
+    uint64_t offset;      // from the start of the file, a multiple of 64
+};
+
+enum scene_section : uint32_t {
+    camera_section = 1,
+    materials_section,
+    spheres_section,
+    vertices_section,
+    triangles_section,
+    nodes_section,
+    primitives_section,
+};
+
+struct scene_camera {
+    // The camera setup, without the render settings. The sampler is kept
+    // as its kind and rebuilt with the default seed.
+    double aspect_ratio, vfov, defocus_angle, focus_dist;
+    double look_from[3], look_at[3], vup[3];
+    int32_t image_width, samples_per_pixel, max_depth, sampler;
+    int32_t sky, reserved; // sky is 0 for a black background
+};
+
+struct scene_material {
+    uint32_t kind; // 0 lambertian, 1 metal, 2 dielectric, 3 diffuse light
+    uint32_t reserved;
+    double albedo[3]; // the emission of a light
+    double fuzz;
+    double refraction_index;
+};
+
+struct scene_sphere {
+    point3 center;
+    real radius;
+    uint32_t mat;
+};
+
+struct scene_triangle {
+    uint32_t v[3]; // into the vertices section
+    uint32_t mat;
+};
+
+// Leaves of the bvh address the primitives section, which refers to a
+// triangle by its index with the top bit set, or to a sphere by its index
+constexpr uint32_t scene_triangle_bit = 0x80000000u;
+constexpr uint32_t scene_file_version = 2;
+
+class scene_file_writer {
+  public:
+    // Flattens a scene of spheres and triangle meshes, with its materials
+    // and camera, and builds the bvh the reader will trace
+    bool write(const std::string &path, const hittable_list &world,
+               const material_table &materials, const camera &cam,
+               std::string &error) {
+        if (!gather(world, error))
+            return false;
+
+        std::vector<scene_material> records;
+
+        for (uint32_t id = 0; id < materials.size(); id++)
+            records.push_back(material_record(materials[id]));
+
+        scene_camera setup = camera_record(cam);
+        std::vector<bvh_node> nodes;
+        std::vector<uint32_t> primitives = build(nodes);
+
+        std::vector<section_data> sections = {
+            {camera_section, sizeof(setup), 1, &setup},
+            {materials_section, sizeof(scene_material), records.size(),
+             records.data()},
+            {spheres_section, sizeof(scene_sphere), spheres.size(),
+             spheres.data()},
+            {vertices_section, sizeof(point3), vertices.size(),
+             vertices.data()},
+            {triangles_section, sizeof(scene_triangle), triangles.size(),
+             triangles.data()},
+            {nodes_section, sizeof(bvh_node), nodes.size(), nodes.data()},
+            {primitives_section, sizeof(uint32_t), primitives.size(),
+             primitives.data()},
+        };
+
+        return write_sections(path, sections, error);
+    };
+
+  private:
+    std::vector<scene_sphere> spheres;
+    std::vector<point3> vertices;
+    std::vector<scene_triangle> triangles;
+
+    struct section_data {
+        uint32_t kind;
+        uint32_t record_size;
+        uint64_t count;
+        const void *data;
+    };
+
+    bool gather(const hittable_list &world, std::string &error) {
+        for (const auto &object : world.objects) {
+            if (auto s = dynamic_cast<const sphere *>(object.get())) {
+                spheres.push_back(
+                    {s->center(), s->radius(), s->material_id()});
+            } else if (auto m =
+                           dynamic_cast<const triangle_mesh *>(object.get())) {
+                auto base = uint32_t(vertices.size());
+                const auto &idx = m->index_buffer();
+
+                vertices.insert(vertices.end(), m->vertex_buffer().begin(),
+                                m->vertex_buffer().end());
+
+                for (size_t i = 0; i + 2 < idx.size(); i += 3)
+                    triangles.push_back({{base + idx[i], base + idx[i + 1],
+                                          base + idx[i + 2]},
+                                         m->material_id()});
+            } else {
+                error = "scene files hold spheres and triangle meshes only";
+                return false;
+            }
+        }
+
+        if (triangles.size() >= scene_triangle_bit) {
+            error = "too many triangles for a scene file";
+            return false;
+        }
+
+        return true;
+    };
+
+    std::vector<uint32_t> build(std::vector<bvh_node> &nodes) const {
+        std::vector<aabb> boxes;
+        std::vector<uint32_t> refs;
+
+        for (uint32_t i = 0; i < spheres.size(); i++) {
+            auto rvec = vec3(spheres[i].radius, spheres[i].radius,
+                             spheres[i].radius);
+            boxes.push_back(aabb(spheres[i].center - rvec,
+                                 spheres[i].center + rvec));
+            refs.push_back(i);
+        }
+
+        for (uint32_t i = 0; i < triangles.size(); i++) {
+            const uint32_t *v = triangles[i].v;
+            boxes.push_back(aabb(aabb(vertices[v[0]], vertices[v[1]]),
+                                 aabb(vertices[v[2]], vertices[v[2]])));
+            refs.push_back(i | scene_triangle_bit);
+        }
+
+        std::vector<int> order;
+        bvh_builder(boxes).build(nodes, order);
+
+        std::vector<uint32_t> primitives;
+        primitives.reserve(order.size());
+
+        for (int index : order)
+            primitives.push_back(refs[index]);
+
+        return primitives;
+    };
+
+    static scene_material material_record(const material &mat) {
+        scene_material record = {};
+        color albedo(1, 1, 1);
+
+        if (auto m = std::get_if<lambertian>(&mat)) {
+            record.kind = 0;
+            albedo = m->albedo_color();
+        } else if (auto m = std::get_if<metal>(&mat)) {
+            record.kind = 1;
+            albedo = m->albedo_color();
+            record.fuzz = m->fuzziness();
+        } else if (auto m = std::get_if<dielectric>(&mat)) {
+            record.kind = 2;
+            record.refraction_index = m->index();
+        } else if (auto m = std::get_if<diffuse_light>(&mat)) {
+            record.kind = 3;
+            albedo = m->emission();
+        }
+
+        for (int i = 0; i < 3; i++)
+            record.albedo[i] = albedo[i];
+
+        return record;
+    };
+
+    static scene_camera camera_record(const camera &cam) {
+        scene_camera setup = {};
+        setup.aspect_ratio = cam.aspect_ratio;
+        setup.vfov = cam.vfov;
+        setup.defocus_angle = cam.defocus_angle;
+        setup.focus_dist = cam.focus_dist;
+
+        for (int i = 0; i < 3; i++) {
+            setup.look_from[i] = cam.look_from[i];
+            setup.look_at[i] = cam.look_at[i];
+            setup.vup[i] = cam.vup[i];
+        }
+
+        setup.image_width = cam.image_width;
+        setup.samples_per_pixel = cam.samples_per_pixel;
+        setup.max_depth = cam.max_depth;
+        setup.sky = cam.sky;
+
+        const sampler *smp = cam.pixel_sampler.get();
+
+        if (dynamic_cast<const sobol_sampler *>(smp))
+            setup.sampler = 3;
+        else if (dynamic_cast<const halton_sampler *>(smp))
+            setup.sampler = 2;
+        else if (dynamic_cast<const stratified_sampler *>(smp))
+            setup.sampler = 1;
+
+        return setup;
+    };
+
+    static bool write_sections(const std::string &path,
+                               const std::vector<section_data> &sections,
+                               std::string &error) {
+        auto align = [](uint64_t offset) { return (offset + 63) & ~63ull; };
+
+        std::vector<scene_file_section> table;
+        uint64_t offset = align(sizeof(scene_file_header) +
+                                sections.size() * sizeof(scene_file_section));
+
+        for (const auto &s : sections) {
+            table.push_back({s.kind, s.record_size, s.count, offset});
+            offset = align(offset + s.count * s.record_size);
+        }
+
+        scene_file_header header = {};
+        std::memcpy(header.magic, "RTWSCENE", 8);
+        header.version = scene_file_version;
+        header.endian = 0x01020304;
+        header.real_size = sizeof(real);
+        header.vec3_size = sizeof(vec3);
+        header.section_count = uint32_t(table.size());
+        header.file_size = offset;
+
+        std::ofstream out(path, std::ios::binary);
+
+        if (!out) {
+            error = "cannot open " + path;
+            return false;
+        }
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(table.data()),
+                  std::streamsize(table.size() * sizeof(scene_file_section)));
+
+        const char zeros[64] = {};
+        uint64_t written =
+            sizeof(header) + table.size() * sizeof(scene_file_section);
+
+        for (size_t i = 0; i < sections.size(); i++) {
+            out.write(zeros, std::streamsize(table[i].offset - written));
+            uint64_t bytes = sections[i].count * sections[i].record_size;
+            out.write(static_cast<const char *>(sections[i].data),
+                      std::streamsize(bytes));
+            written = table[i].offset + bytes;
+        }
+
+        out.write(zeros, std::streamsize(offset - written));
+
+        if (!out) {
+            error = "cannot write " + path;
+            return false;
+        }
+
+        return true;
+    };
+};
+
+inline bool write_scene_file(const std::string &path,
+                             const hittable_list &world,
+                             const material_table &materials,
+                             const camera &cam, std::string &error) {
+    return scene_file_writer().write(path, world, materials, cam, error);
+}
+
+class scene_file : public hittable {
+  public:
+    // A mapped scene file, traced in place. Opening checks the header and
+    // that every section lies inside the file, nothing more: pages of the
+    // arrays are only read when rays first reach them. The contents are
+    // trusted as written by write_scene_file.
+    bool open(const std::string &path, std::string &error) {
+        if (!file.open(path)) {
+            error = "cannot open " + path;
+            return false;
+        }
+
+        const char *base = file.data();
+        scene_file_header header;
+
+        if (file.size() < sizeof(header)) {
+            error = "not a scene file";
+            return false;
+        }
+
+        std::memcpy(&header, base, sizeof(header));
+
+        if (std::memcmp(header.magic, "RTWSCENE", 8) != 0) {
+            error = "not a scene file";
+            return false;
+        }
+
+        if (header.version != scene_file_version) {
+            error = "scene file version " + std::to_string(header.version) +
+                    ", expected " + std::to_string(scene_file_version);
+            return false;
+        }
+
+        if (header.endian != 0x01020304 || header.real_size != sizeof(real) ||
+            header.vec3_size != sizeof(vec3)) {
+            error = "scene file written by a build with another layout";
+            return false;
+        }
+
+        uint64_t table_end = sizeof(header) + uint64_t(header.section_count) *
+                                                  sizeof(scene_file_section);
+
+        if (header.file_size != file.size() || table_end > file.size()) {
+            error = "truncated scene file";
+            return false;
+        }
+
+        for (uint32_t i = 0; i < header.section_count; i++) {
+            scene_file_section s;
+            std::memcpy(&s, base + sizeof(header) + i * sizeof(s), sizeof(s));
+
+            uint64_t room = file.size() - std::min(s.offset, file.size());
+
+            if (s.offset % 64 != 0 || s.offset > file.size() ||
+                s.count > room / std::max(s.record_size, 1u)) {
+                error = "corrupt scene file section table";
+                return false;
+            }
+
+            if (!bind(s, base + s.offset)) {
+                error = "scene file record size mismatch";
+                return false;
+            }
+        }
+
+        if (setup == nullptr || nodes == nullptr ||
+            (primitive_count > 0 && node_count == 0)) {
+            error = "scene file is missing sections";
+            return false;
+        }
+
+        return true;
+    };
+
+    void load_materials(material_table &materials) const {
+        // The only per record work at startup, a few bytes per material
+        for (size_t i = 0; i < material_count; i++) {
+            const scene_material &m = material_records[i];
+            color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+
+            if (m.kind == 1)
+                materials.add(metal(albedo, m.fuzz));
+            else if (m.kind == 2)
+                materials.add(dielectric(m.refraction_index));
+            else if (m.kind == 3)
+                materials.add(diffuse_light(albedo));
+            else
+                materials.add(lambertian(albedo));
+        }
+    };
+
+    void load_camera(camera &cam) const {
+        cam.aspect_ratio = setup->aspect_ratio;
+        cam.vfov = setup->vfov;
+        cam.defocus_angle = setup->defocus_angle;
+        cam.focus_dist = setup->focus_dist;
+        cam.look_from = point3(setup->look_from[0], setup->look_from[1],
+                               setup->look_from[2]);
+        cam.look_at =
+            point3(setup->look_at[0], setup->look_at[1], setup->look_at[2]);
+        cam.vup = vec3(setup->vup[0], setup->vup[1], setup->vup[2]);
+        cam.image_width = setup->image_width;
+        cam.samples_per_pixel = setup->samples_per_pixel;
+        cam.max_depth = setup->max_depth;
+        cam.sky = setup->sky != 0;
+
+        if (setup->sampler == 3)
+            cam.pixel_sampler = std::make_shared<sobol_sampler>();
+        else if (setup->sampler == 2)
+            cam.pixel_sampler = std::make_shared<halton_sampler>();
+        else if (setup->sampler == 1)
+            cam.pixel_sampler = std::make_shared<stratified_sampler>();
+        else
+            cam.pixel_sampler = nullptr;
+    };
+
+    void load_lights(light_list &lights,
+                     const material_table &materials) const {
+        // The spheres and triangles with an emissive material
+        for (size_t i = 0; i < sphere_count; i++)
+            if (materials.emissive(spheres[i].mat))
+                lights.add_sphere(spheres[i].center, spheres[i].radius,
+                                  materials.emitted(spheres[i].mat));
+
+        for (size_t i = 0; i < triangle_count; i++) {
+            const scene_triangle &tri = triangles[i];
+
+            if (materials.emissive(tri.mat))
+                lights.add_triangle(vertices[tri.v[0]], vertices[tri.v[1]],
+                                    vertices[tri.v[2]],
+                                    materials.emitted(tri.mat));
+        }
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        if (primitive_count == 0)
+            return false;
+
+        watertight_ray wr(r);
+
+        auto leaf = [&](int first, int count, interval &ray_t) {
+            bool hit_anything = false;
+
+            for (int i = first; i < first + count; i++) {
+                uint32_t ref = primitives[i];
+                real t;
+
+                if (ref & scene_triangle_bit) {
+                    const uint32_t *v = triangles[ref & ~scene_triangle_bit].v;
+
+                    if (!hit_triangle(wr, vertices[v[0]], vertices[v[1]],
+                                      vertices[v[2]], ray_t, t))
+                        continue;
+                } else {
+                    const scene_sphere &s = spheres[ref];
+
+                    if (!intersect_sphere(s.center, s.radius, r, ray_t, t))
+                        continue;
+                }
+
+                hit = {t, this, ref};
+                hit_anything = true;
+                ray_t.max = t;
+            }
+
+            return hit_anything;
+        };
+
+        return traverse_closest(nodes, r, ray_t, leaf);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        if (primitive_count == 0)
+            return false;
+
+        watertight_ray wr(r);
+
+        auto leaf = [&](int first, int count, interval ray_t) {
+            for (int i = first; i < first + count; i++) {
+                uint32_t ref = primitives[i];
+                real t;
+
+                if (ref & scene_triangle_bit) {
+                    const uint32_t *v = triangles[ref & ~scene_triangle_bit].v;
+
+                    if (hit_triangle(wr, vertices[v[0]], vertices[v[1]],
+                                     vertices[v[2]], ray_t, t))
+                        return true;
+                } else {
+                    const scene_sphere &s = spheres[ref];
+
+                    if (intersect_sphere(s.center, s.radius, r, ray_t, t))
+                        return true;
+                }
+            }
+
+            return false;
+        };
+
+        return traverse_any(nodes, r, ray_t, leaf);
+    }
+
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        rec.t = hit.t;
+        rec.p = r.at(rec.t);
+
+        if (hit.prim & scene_triangle_bit) {
+            const scene_triangle &tri =
+                triangles[hit.prim & ~scene_triangle_bit];
+            const point3 &v0 = vertices[tri.v[0]];
+            vec3 normal =
+                cross(vertices[tri.v[1]] - v0, vertices[tri.v[2]] - v0);
+
+            rec.set_face_normal(r, unit_vector(normal));
+            rec.mat = tri.mat;
+        } else {
+            const scene_sphere &s = spheres[hit.prim];
+
+            rec.set_face_normal(r, (rec.p - s.center) / s.radius);
+            rec.mat = s.mat;
+        }
+    }
+
+    aabb bounding_box() const override {
+        return node_count > 0 ? nodes[0].bbox : aabb();
+    }
+
+    size_t primitive_total() const { return primitive_count; };
+
+    size_t file_size() const { return file.size(); };
+
+    // Of every byte of the file, so reading it all in
+    uint64_t content_hash() const {
+        return hash_bytes(hash_seed, file.data(), file.size());
+    };
+
+  private:
+    mapped_file file;
+    const scene_camera *setup = nullptr;
+    const scene_material *material_records = nullptr;
+    const scene_sphere *spheres = nullptr;
+    const point3 *vertices = nullptr;
+    const scene_triangle *triangles = nullptr;
+    const bvh_node *nodes = nullptr;
+    const uint32_t *primitives = nullptr;
+    size_t material_count = 0, node_count = 0, primitive_count = 0;
+    size_t sphere_count = 0, triangle_count = 0;
+
+    bool bind(const scene_file_section &s, const char *data) {
+        // Points the array of a section at its place in the mapping
+        auto as = [&](auto &array, size_t record_size) {
+            using pointer = std::remove_reference_t<decltype(array)>;
+            array = reinterpret_cast<pointer>(data);
+
+            return s.record_size == record_size;
+        };
+
+        switch (s.kind) {
+        case camera_section:
+            return as(setup, sizeof(scene_camera)) && s.count == 1;
+        case materials_section:
+            material_count = s.count;
+            return as(material_records, sizeof(scene_material));
+        case spheres_section:
+            sphere_count = s.count;
+            return as(spheres, sizeof(scene_sphere));
+        case vertices_section:
+            return as(vertices, sizeof(point3));
+        case triangles_section:
+            triangle_count = s.count;
+            return as(triangles, sizeof(scene_triangle));
+        case nodes_section:
+            node_count = s.count;
+            return as(nodes, sizeof(bvh_node));
+        case primitives_section:
+            primitive_count = s.count;
+            return as(primitives, sizeof(uint32_t));
+        default:
+            return true; // sections from newer writers are skipped
+        }
+    };
+};
+
+#endif // !SCENE_FILE_H
@@ -0,0 +1,229 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh_loader.h"
+#include "sphere.h"
+#include "tlas.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+
+inline hittable_list random_spheres_scene(material_table &materials) {
+    // The book cover scene: a field of small random spheres around three
+    // large ones, with their materials added to materials. Always builds the
+    // same scene, whatever was drawn from the calling thread's generator
+    // before.
+    seed_thread_rng(0);
+
+    hittable_list world;
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(
+        std::make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2,
+                          b + 0.9 * random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                uint32_t sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = materials.add(lambertian(albedo));
+                    world.add(
+                        std::make_shared<sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = materials.add(metal(albedo, fuzz));
+                    world.add(
+                        std::make_shared<sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = materials.add(dielectric(1.5));
+                    world.add(
+                        std::make_shared<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.add(dielectric(1.5));
+    world.add(std::make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = materials.add(lambertian(color(0.4, 0.2, 0.1)));
+    world.add(std::make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = materials.add(metal(color(0.7, 0.6, 0.5), 0.0));
+    world.add(std::make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+inline hittable_list night_spheres_scene(material_table &materials) {
+    // The cover scene without a sky, lit by a few small warm lamps floating
+    // above it. Meant for a camera with sky off.
+    hittable_list world = random_spheres_scene(materials);
+    const point3 big[] = {point3(0, 1, 0), point3(-4, 1, 0), point3(4, 1, 0)};
+
+    seed_thread_rng(1);
+
+    for (int lamps = 0; lamps < 8;) {
+        point3 center(random_double(-8, 8), random_double(0.6, 2),
+                      random_double(-4, 4));
+        bool clear = true;
+
+        for (const point3 &c : big)
+            clear = clear && (center - c).length() > 1.4;
+
+        if (!clear)
+            continue;
+
+        auto glow = color(1, 0.6, 0.3) * random_double(30, 50);
+        world.add(std::make_shared<sphere>(center, 0.15,
+                                           materials.add(diffuse_light(glow))));
+        lamps++;
+    }
+
+    return world;
+}
+
+inline transform fit_mesh(const mesh_data &mesh, real size) {
+    // Scales the mesh to fit a box size across and stands it on the origin
+    if (mesh.vertices.empty())
+        return transform();
+
+    point3 lo = mesh.vertices[0], hi = lo;
+
+    for (const point3 &v : mesh.vertices) {
+        lo = point3(std::fmin(lo.x(), v.x()), std::fmin(lo.y(), v.y()),
+                    std::fmin(lo.z(), v.z()));
+        hi = point3(std::fmax(hi.x(), v.x()), std::fmax(hi.y(), v.y()),
+                    std::fmax(hi.z(), v.z()));
+    }
+
+    vec3 extent = hi - lo;
+    real largest = std::fmax(extent.x(), std::fmax(extent.y(), extent.z()));
+    point3 base((lo.x() + hi.x()) / 2, lo.y(), (lo.z() + hi.z()) / 2);
+
+    return transform::scale(largest > 0 ? size / largest : 1) *
+           transform::translate(-base);
+}
+
+inline hittable_list mesh_scene(material_table &materials, mesh_data mesh) {
+    // A loaded mesh two units across, standing on the ground of the cover
+    // scene, so the cover camera frames it
+    hittable_list world;
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(
+        std::make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    transform fit = fit_mesh(mesh, 2);
+
+    for (point3 &v : mesh.vertices)
+        v = fit.point(v);
+
+    auto mesh_material = materials.add(lambertian(color(0.4, 0.2, 0.1)));
+    world.add(std::make_shared<triangle_mesh>(std::move(mesh.vertices),
+                                              std::move(mesh.indices),
+                                              mesh_material));
+
+    return world;
+}
+
+inline hittable_list instanced_mesh_scene(material_table &materials,
+                                          mesh_data mesh, int count) {
+    // count copies of one mesh on a square grid over the ground of the cover
+    // scene, each turned and sized at random. Materials come from a palette
+    // drawn like the cover's, so neither the mesh nor the materials grow
+    // with the count.
+    seed_thread_rng(0);
+
+    hittable_list world;
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(
+        std::make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    if (count <= 0 || mesh.indices.empty())
+        return world;
+
+    std::vector<uint32_t> palette;
+
+    for (int i = 0; i < 32; i++) {
+        auto choose_mat = random_double();
+
+        if (choose_mat < 0.8) {
+            auto albedo = color::random() * color::random();
+            palette.push_back(materials.add(lambertian(albedo)));
+        } else if (choose_mat < 0.95) {
+            auto albedo = color::random(0.5, 1);
+            auto fuzz = random_double(0, 0.5);
+            palette.push_back(materials.add(metal(albedo, fuzz)));
+        } else {
+            palette.push_back(materials.add(dielectric(1.5)));
+        }
+    }
+
+    transform fit = fit_mesh(mesh, 1);
+    std::vector<std::shared_ptr<hittable>> geometry = {
+        std::make_shared<triangle_mesh>(std::move(mesh.vertices),
+                                        std::move(mesh.indices),
+                                        palette[0])};
+
+    int side = int(std::ceil(std::sqrt(double(count))));
+    double spacing = 22.0 / side;
+    std::vector<instance> instances;
+    instances.reserve(size_t(count));
+
+    for (int i = 0; i < count; i++) {
+        double x = -11 + spacing * (i % side + 0.25 + 0.5 * random_double());
+        double z = -11 + spacing * (i / side + 0.25 + 0.5 * random_double());
+        double size = spacing * random_double(0.4, 0.7);
+        double angle = 360 * random_double();
+        uint32_t material = palette[size_t(32 * random_double())];
+
+        transform place = transform::translate(vec3(x, 0, z)) *
+                          transform::rotate(vec3(0, 1, 0), angle) *
+                          transform::scale(size) * fit;
+
+        instances.push_back(instance(0, place, material));
+    }
+
+    world.add(
+        std::make_shared<tlas>(std::move(geometry), std::move(instances)));
+
+    return world;
+}
+
+inline void random_spheres_camera(camera &cam) {
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 720;
+    cam.samples_per_pixel = 500;
+    cam.max_depth = 50;
+
+    cam.vfov = 30;
+    cam.look_from = point3(13, 2, 3);
+    cam.look_at = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    cam.pixel_sampler = std::make_shared<sobol_sampler>();
+}
+
+inline void night_spheres_camera(camera &cam) {
+    random_spheres_camera(cam);
+    cam.sky = false;
+}
+
+#endif // !SCENES_H
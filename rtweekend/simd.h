@@ -0,0 +1,59 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RTW_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction sets the intersection kernels are built for. The build only
+// assumes the baseline of the target, wider kernels are compiled with
+// function level target attributes and picked at runtime.
+enum class simd_level { scalar, sse2, avx2 };
+
+inline const char *simd_level_name(simd_level level) {
+    switch (level) {
+    case simd_level::avx2:
+        return "avx2";
+    case simd_level::sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+inline simd_level detect_simd_level() {
+    // RTW_SIMD=scalar|sse2|avx2 caps the level, for comparing kernels
+    simd_level best = simd_level::scalar;
+
+#ifdef RTW_X86
+    best = simd_level::sse2;
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        best = simd_level::avx2;
+#endif
+
+    const char *requested = std::getenv("RTW_SIMD");
+
+    if (requested != nullptr) {
+        if (std::strcmp(requested, "scalar") == 0)
+            return simd_level::scalar;
+        if (std::strcmp(requested, "sse2") == 0 && best != simd_level::scalar)
+            return simd_level::sse2;
+    }
+
+    return best;
+}
+
+inline simd_level &active_simd_level() {
+    // Detected once, assignable so benchmarks can compare the kernels
+    static simd_level level = detect_simd_level();
+
+    return level;
+}
+
+#endif // !SIMD_H
@@ -3,51 +3,102 @@
 
 #include "hittable.h"
 #include "interval.h"
+#include "sphere_kernels.h"
 
+#include <bit>
 #include <cmath>
 
+inline bool intersect_sphere(const point3 &cen, real rad, const ray &r,
+                             interval ray_t, real &root) {
+    // The nearer root of the ray and the sphere, if it lies inside ray_t
+    vec3 oc = cen - r.origin();
+
+    auto a = r.direction().length_squared();
+    auto h = dot(r.direction(), oc);
+    auto c = oc.length_squared() - rad * rad;
+
+    auto discriminant = h * h - a * c;
+
+    if (discriminant < 0) {
+        return false;
+    }
+
+    auto sqrtd = std::sqrt(discriminant);
+
+    // Only the near root is reported: a ray whose near root is outside
+    // ray_t misses, even when the far one, where it leaves, lies inside
+    root = (h - sqrtd) / a;
+
+    return ray_t.surrounds(root);
+}
+
 class sphere : public hittable {
   public:
-    sphere(const point3 &center, double radius, std::shared_ptr<material> mat)
-        : center(center), radius(std::fmax(0, radius)), mat(mat) {};
+    sphere(const point3 &center, real radius, uint32_t mat)
+        : cen(center), rad(std::fmax(0, radius)), mat(mat) {
+        auto rvec = vec3(rad, rad, rad);
+        bbox = aabb(center - rvec, center + rvec);
+    };
 
-    bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-        vec3 oc = center - r.origin();
+    void move_to(const point3 &center) {
+        // Containers over the sphere need a refit afterwards
+        cen = center;
+        auto rvec = vec3(rad, rad, rad);
+        bbox = aabb(center - rvec, center + rvec);
+    };
 
-        auto a = r.direction().length_squared();
-        auto h = dot(r.direction(), oc);
-        auto c = oc.length_squared() - radius * radius;
+    const point3 &center() const { return cen; };
+    real radius() const { return rad; };
+    uint32_t material_id() const { return mat; };
 
-        auto discriminant = h * h - a * c;
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        real root;
 
-        if (discriminant < 0) {
+        if (!intersect_sphere(cen, rad, r, ray_t, root))
             return false;
-        }
 
-        auto sqrtd = std::sqrt(discriminant);
+        hit = {root, this, 0};
 
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (h - sqrtd) / a;
+        return true;
+    }
 
-        if (!ray_t.surrounds(root)) {
-            root = (h + sqrtd) / a;
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        set_hit_record(r, hit.t, rec);
+    }
 
-            return false;
+    void intersect_packet(ray_packet &packet,
+                          primitive_hit *hits) const override {
+        real roots[ray_packet::size];
+        int mask = hit_sphere_packet(active_simd_level(), packet, cen,
+                                     rad * rad, roots);
+
+        for (; mask != 0; mask &= mask - 1) {
+            int k = std::countr_zero(unsigned(mask));
+
+            hits[k] = {roots[k], this, 0};
+            packet.t_max[k] = roots[k];
+            packet.hit[k] = true;
         }
+    }
+
+    aabb bounding_box() const override { return bbox; }
 
+    void set_hit_record(const ray &r, real root, hit_record &rec) const {
+        // Fills in the surface at a root found by intersect or the kernels
         rec.t = root;
         rec.p = r.at(rec.t);
-        vec3 outward_normal = (rec.p - center) / radius;
+        vec3 outward_normal = (rec.p - cen) / rad;
         rec.set_face_normal(r, outward_normal);
         rec.mat = mat;
-
-        return true;
     }
 
   private:
-    point3 center;
-    double radius;
-    std::shared_ptr<material> mat;
+    point3 cen;
+    real rad;
+    uint32_t mat;
+    aabb bbox;
 };
 
 #endif // !SPHERE_H
@@ -0,0 +1,78 @@
+#ifndef SPHERE_GROUP_H
+#define SPHERE_GROUP_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_kernels.h"
+
+#include <vector>
+
+class sphere_group : public hittable {
+  public:
+    // The spheres of a list packed four to a block, so a ray is tested
+    // against a whole block with one SIMD kernel call instead of one virtual
+    // call per sphere. Objects that are not spheres are kept in a plain list.
+    sphere_group(const hittable_list &list) {
+        for (const auto &object : list.objects) {
+            auto s = std::dynamic_pointer_cast<sphere>(object);
+
+            if (!s) {
+                others.add(object);
+                continue;
+            }
+
+            int lane = int(spheres.size() % sphere_block::lanes);
+
+            if (lane == 0)
+                blocks.emplace_back();
+
+            blocks.back().set(lane, s->center(), s->radius());
+            spheres.push_back(s);
+        }
+
+        bbox = list.bounding_box();
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        simd_level level = active_simd_level();
+        int closest = -1;
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            real t;
+            int lane = hit_sphere_block(level, blocks[b], r, ray_t, t);
+
+            if (lane >= 0) {
+                closest = int(b) * sphere_block::lanes + lane;
+                ray_t.max = t;
+            }
+        }
+
+        // Anything else only counts if it is in front of the closest sphere
+        if (others.intersect(r, ray_t, hit))
+            return true;
+
+        if (closest < 0)
+            return false;
+
+        hit = {ray_t.max, this, uint32_t(closest)};
+
+        return true;
+    }
+
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        spheres[hit.prim]->set_hit_record(r, hit.t, rec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    std::vector<sphere_block> blocks;
+    std::vector<std::shared_ptr<sphere>> spheres;
+    hittable_list others;
+    aabb bbox;
+};
+
+#endif // !SPHERE_GROUP_H
@@ -0,0 +1,447 @@
+#ifndef SPHERE_KERNELS_H
+#define SPHERE_KERNELS_H
+
+#include "interval.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "simd.h"
+
+#include <bit>
+#include <cmath>
+
+// Ray-sphere intersection kernels in scalar, SSE2 and AVX2 flavours. They
+// evaluate exactly the expressions of sphere::hit in the same order and
+// without fused multiply-adds, so every flavour finds the same roots as the
+// scalar code, bit for bit.
+
+struct alignas(64) sphere_block {
+    // Four spheres, one per lane, exactly two cache lines in double and one
+    // in float. Unused lanes have a radius squared of -infinity, which turns
+    // the discriminant negative.
+    static constexpr int lanes = 4;
+
+    real cx[lanes], cy[lanes], cz[lanes], r2[lanes];
+
+    sphere_block() {
+        for (int k = 0; k < lanes; k++) {
+            cx[k] = cy[k] = cz[k] = 0;
+            r2[k] = -infinity;
+        }
+    };
+
+    void set(int lane, const point3 &center, real radius) {
+        cx[lane] = center.x();
+        cy[lane] = center.y();
+        cz[lane] = center.z();
+        r2[lane] = radius * radius;
+    };
+};
+
+inline bool sphere_root(const point3 &center, real r2, const point3 &orig,
+                        const vec3 &dir, interval ray_t, real &root) {
+    // The near root of the ray-sphere quadratic, if it lies inside ray_t
+    vec3 oc = center - orig;
+
+    auto a = dir.length_squared();
+    auto h = dot(dir, oc);
+    auto c = oc.length_squared() - r2;
+
+    auto discriminant = h * h - a * c;
+
+    if (discriminant < 0)
+        return false;
+
+    root = (h - std::sqrt(discriminant)) / a;
+
+    return ray_t.surrounds(root);
+}
+
+// One ray against one block of four spheres. Returns the lane of the
+// closest sphere whose near root lies inside ray_t and stores the root in
+// t_hit, or -1 when none does. Ties go to the lowest lane, like a
+// front-to-back scan over the same spheres would.
+
+inline int hit_sphere_block_scalar(const sphere_block &b, const ray &r,
+                                   interval ray_t, real &t_hit) {
+    int closest = -1;
+
+    for (int k = 0; k < sphere_block::lanes; k++) {
+        real root;
+
+        if (sphere_root(point3(b.cx[k], b.cy[k], b.cz[k]), b.r2[k], r.origin(),
+                        r.direction(), ray_t, root)) {
+            closest = k;
+            ray_t.max = root;
+        }
+    }
+
+    t_hit = ray_t.max;
+
+    return closest;
+}
+
+#if defined(RTW_X86) && !defined(RTW_FLOAT)
+inline int hit_sphere_block_sse2(const sphere_block &b, const ray &r,
+                                 interval ray_t, real &t_hit) {
+    const point3 &o = r.origin();
+    const vec3 &d = r.direction();
+
+    const __m128d a = _mm_set1_pd(d.length_squared());
+    const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()),
+                  oz = _mm_set1_pd(o.z());
+    const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()),
+                  dz = _mm_set1_pd(d.z());
+    const __m128d t_min = _mm_set1_pd(ray_t.min);
+    const __m128d t_max = _mm_set1_pd(ray_t.max);
+    const __m128d inf = _mm_set1_pd(infinity);
+
+    __m128d roots[2];
+    int valid = 0;
+
+    for (int half = 0; half < 2; half++) {
+        int k = 2 * half;
+
+        __m128d ocx = _mm_sub_pd(_mm_load_pd(b.cx + k), ox);
+        __m128d ocy = _mm_sub_pd(_mm_load_pd(b.cy + k), oy);
+        __m128d ocz = _mm_sub_pd(_mm_load_pd(b.cz + k), oz);
+
+        __m128d h = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)),
+            _mm_mul_pd(dz, ocz));
+        __m128d c = _mm_sub_pd(
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)),
+                       _mm_mul_pd(ocz, ocz)),
+            _mm_load_pd(b.r2 + k));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+
+        // A negative discriminant gives a NaN root, which fails both tests
+        __m128d root = _mm_div_pd(_mm_sub_pd(h, _mm_sqrt_pd(disc)), a);
+        __m128d ok =
+            _mm_and_pd(_mm_cmpgt_pd(root, t_min), _mm_cmplt_pd(root, t_max));
+
+        roots[half] = _mm_or_pd(_mm_and_pd(ok, root), _mm_andnot_pd(ok, inf));
+        valid |= _mm_movemask_pd(ok) << k;
+    }
+
+    if (valid == 0)
+        return -1;
+
+    __m128d m = _mm_min_pd(roots[0], roots[1]);
+    m = _mm_min_pd(m, _mm_shuffle_pd(m, m, 1));
+
+    int closest = _mm_movemask_pd(_mm_cmpeq_pd(roots[0], m)) |
+                  (_mm_movemask_pd(_mm_cmpeq_pd(roots[1], m)) << 2);
+    closest &= valid;
+
+    t_hit = _mm_cvtsd_f64(m);
+
+    return std::countr_zero(unsigned(closest));
+}
+
+__attribute__((target("avx2"))) inline int
+hit_sphere_block_avx2(const sphere_block &b, const ray &r, interval ray_t,
+                      real &t_hit) {
+    const point3 &o = r.origin();
+    const vec3 &d = r.direction();
+
+    const __m256d a = _mm256_set1_pd(d.length_squared());
+    const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()),
+                  dz = _mm256_set1_pd(d.z());
+
+    __m256d ocx = _mm256_sub_pd(_mm256_load_pd(b.cx), _mm256_set1_pd(o.x()));
+    __m256d ocy = _mm256_sub_pd(_mm256_load_pd(b.cy), _mm256_set1_pd(o.y()));
+    __m256d ocz = _mm256_sub_pd(_mm256_load_pd(b.cz), _mm256_set1_pd(o.z()));
+
+    __m256d h = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)),
+        _mm256_mul_pd(dz, ocz));
+    __m256d c = _mm256_sub_pd(
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)),
+            _mm256_mul_pd(ocz, ocz)),
+        _mm256_load_pd(b.r2));
+    __m256d disc = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+
+    __m256d root =
+        _mm256_div_pd(_mm256_sub_pd(h, _mm256_sqrt_pd(disc)), a);
+    __m256d ok = _mm256_and_pd(
+        _mm256_cmp_pd(root, _mm256_set1_pd(ray_t.min), _CMP_GT_OQ),
+        _mm256_cmp_pd(root, _mm256_set1_pd(ray_t.max), _CMP_LT_OQ));
+
+    int valid = _mm256_movemask_pd(ok);
+
+    if (valid == 0)
+        return -1;
+
+    __m256d roots = _mm256_blendv_pd(_mm256_set1_pd(infinity), root, ok);
+    __m256d m = _mm256_min_pd(roots, _mm256_permute4x64_pd(roots, 0x4e));
+    m = _mm256_min_pd(m, _mm256_permute_pd(m, 0x5));
+
+    int closest =
+        _mm256_movemask_pd(_mm256_cmp_pd(roots, m, _CMP_EQ_OQ)) & valid;
+
+    t_hit = _mm256_cvtsd_f64(m);
+
+    return std::countr_zero(unsigned(closest));
+}
+#endif
+
+#if defined(RTW_X86) && defined(RTW_FLOAT)
+// In float a block is a single 128 bit vector per component, so one SSE
+// kernel serves both levels
+inline int hit_sphere_block_sse2(const sphere_block &b, const ray &r,
+                                 interval ray_t, real &t_hit) {
+    const point3 &o = r.origin();
+    const vec3 &d = r.direction();
+
+    const __m128 a = _mm_set1_ps(d.length_squared());
+    const __m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()),
+                 dz = _mm_set1_ps(d.z());
+
+    __m128 ocx = _mm_sub_ps(_mm_load_ps(b.cx), _mm_set1_ps(o.x()));
+    __m128 ocy = _mm_sub_ps(_mm_load_ps(b.cy), _mm_set1_ps(o.y()));
+    __m128 ocz = _mm_sub_ps(_mm_load_ps(b.cz), _mm_set1_ps(o.z()));
+
+    __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)),
+                          _mm_mul_ps(dz, ocz));
+    __m128 c = _mm_sub_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                   _mm_mul_ps(ocz, ocz)),
+        _mm_load_ps(b.r2));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+
+    __m128 root = _mm_div_ps(_mm_sub_ps(h, _mm_sqrt_ps(disc)), a);
+    __m128 ok = _mm_and_ps(_mm_cmpgt_ps(root, _mm_set1_ps(ray_t.min)),
+                           _mm_cmplt_ps(root, _mm_set1_ps(ray_t.max)));
+
+    int valid = _mm_movemask_ps(ok);
+
+    if (valid == 0)
+        return -1;
+
+    __m128 roots = _mm_or_ps(_mm_and_ps(ok, root),
+                             _mm_andnot_ps(ok, _mm_set1_ps(infinity)));
+    __m128 m = _mm_min_ps(roots, _mm_shuffle_ps(roots, roots, 0x4e));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, 0xb1));
+
+    int closest = _mm_movemask_ps(_mm_cmpeq_ps(roots, m)) & valid;
+
+    t_hit = _mm_cvtss_f32(m);
+
+    return std::countr_zero(unsigned(closest));
+}
+
+inline int hit_sphere_block_avx2(const sphere_block &b, const ray &r,
+                                 interval ray_t, real &t_hit) {
+    return hit_sphere_block_sse2(b, r, ray_t, t_hit);
+}
+#endif
+
+inline int hit_sphere_block(simd_level level, const sphere_block &b,
+                            const ray &r, interval ray_t, real &t_hit) {
+#ifdef RTW_X86
+    if (level == simd_level::avx2)
+        return hit_sphere_block_avx2(b, r, ray_t, t_hit);
+    if (level == simd_level::sse2)
+        return hit_sphere_block_sse2(b, r, ray_t, t_hit);
+#endif
+
+    return hit_sphere_block_scalar(b, r, ray_t, t_hit);
+}
+
+// Every active lane of a ray packet against one sphere. Returns a bit mask
+// of the lanes whose near root lies inside their interval, with the roots
+// stored in roots[lane]. The packet itself is left untouched.
+
+inline int hit_sphere_packet_scalar(const ray_packet &p, const point3 &center,
+                                    real r2, real *roots) {
+    int mask = 0;
+
+    for (int k = 0; k < p.count; k++) {
+        point3 orig(p.ox[k], p.oy[k], p.oz[k]);
+        vec3 dir(p.dx[k], p.dy[k], p.dz[k]);
+
+        if (sphere_root(center, r2, orig, dir, p.lane_interval(k), roots[k]))
+            mask |= 1 << k;
+    }
+
+    return mask;
+}
+
+#if defined(RTW_X86) && !defined(RTW_FLOAT)
+inline int hit_sphere_packet_sse2(const ray_packet &p, const point3 &center,
+                                  real r2, real *roots) {
+    const __m128d cx = _mm_set1_pd(center.x()), cy = _mm_set1_pd(center.y()),
+                  cz = _mm_set1_pd(center.z());
+    const __m128d vr2 = _mm_set1_pd(r2);
+    const __m128d t_min = _mm_set1_pd(p.t_min);
+
+    int mask = 0;
+
+    for (int k = 0; k < p.count; k += 2) {
+        __m128d dx = _mm_load_pd(p.dx + k), dy = _mm_load_pd(p.dy + k),
+                dz = _mm_load_pd(p.dz + k);
+        __m128d ocx = _mm_sub_pd(cx, _mm_load_pd(p.ox + k));
+        __m128d ocy = _mm_sub_pd(cy, _mm_load_pd(p.oy + k));
+        __m128d ocz = _mm_sub_pd(cz, _mm_load_pd(p.oz + k));
+
+        __m128d a =
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+                       _mm_mul_pd(dz, dz));
+        __m128d h =
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)),
+                       _mm_mul_pd(dz, ocz));
+        __m128d c = _mm_sub_pd(
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)),
+                       _mm_mul_pd(ocz, ocz)),
+            vr2);
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+
+        __m128d root = _mm_div_pd(_mm_sub_pd(h, _mm_sqrt_pd(disc)), a);
+        __m128d ok = _mm_and_pd(_mm_cmpgt_pd(root, t_min),
+                                _mm_cmplt_pd(root, _mm_load_pd(p.t_max + k)));
+
+        _mm_storeu_pd(roots + k, root);
+        mask |= _mm_movemask_pd(ok) << k;
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2"))) inline int
+hit_sphere_packet_avx2(const ray_packet &p, const point3 &center, real r2,
+                       real *roots) {
+    const __m256d cx = _mm256_set1_pd(center.x()),
+                  cy = _mm256_set1_pd(center.y()),
+                  cz = _mm256_set1_pd(center.z());
+    const __m256d vr2 = _mm256_set1_pd(r2);
+    const __m256d t_min = _mm256_set1_pd(p.t_min);
+
+    int mask = 0;
+
+    for (int k = 0; k < p.count; k += 4) {
+        __m256d dx = _mm256_load_pd(p.dx + k), dy = _mm256_load_pd(p.dy + k),
+                dz = _mm256_load_pd(p.dz + k);
+        __m256d ocx = _mm256_sub_pd(cx, _mm256_load_pd(p.ox + k));
+        __m256d ocy = _mm256_sub_pd(cy, _mm256_load_pd(p.oy + k));
+        __m256d ocz = _mm256_sub_pd(cz, _mm256_load_pd(p.oz + k));
+
+        __m256d a = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+            _mm256_mul_pd(dz, dz));
+        __m256d h = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)),
+            _mm256_mul_pd(dz, ocz));
+        __m256d c = _mm256_sub_pd(
+            _mm256_add_pd(
+                _mm256_add_pd(_mm256_mul_pd(ocx, ocx),
+                              _mm256_mul_pd(ocy, ocy)),
+                _mm256_mul_pd(ocz, ocz)),
+            vr2);
+        __m256d disc = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+
+        __m256d root =
+            _mm256_div_pd(_mm256_sub_pd(h, _mm256_sqrt_pd(disc)), a);
+        __m256d ok = _mm256_and_pd(
+            _mm256_cmp_pd(root, t_min, _CMP_GT_OQ),
+            _mm256_cmp_pd(root, _mm256_load_pd(p.t_max + k), _CMP_LT_OQ));
+
+        _mm256_storeu_pd(roots + k, root);
+        mask |= _mm256_movemask_pd(ok) << k;
+    }
+
+    return mask;
+}
+#endif
+
+#if defined(RTW_X86) && defined(RTW_FLOAT)
+inline int hit_sphere_packet_sse2(const ray_packet &p, const point3 &center,
+                                  real r2, real *roots) {
+    const __m128 cx = _mm_set1_ps(center.x()), cy = _mm_set1_ps(center.y()),
+                 cz = _mm_set1_ps(center.z());
+    const __m128 vr2 = _mm_set1_ps(r2);
+    const __m128 t_min = _mm_set1_ps(p.t_min);
+
+    int mask = 0;
+
+    for (int k = 0; k < p.count; k += 4) {
+        __m128 dx = _mm_load_ps(p.dx + k), dy = _mm_load_ps(p.dy + k),
+               dz = _mm_load_ps(p.dz + k);
+        __m128 ocx = _mm_sub_ps(cx, _mm_load_ps(p.ox + k));
+        __m128 ocy = _mm_sub_ps(cy, _mm_load_ps(p.oy + k));
+        __m128 ocz = _mm_sub_ps(cz, _mm_load_ps(p.oz + k));
+
+        __m128 a =
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                       _mm_mul_ps(dz, dz));
+        __m128 h =
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)),
+                       _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                       _mm_mul_ps(ocz, ocz)),
+            vr2);
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+
+        __m128 root = _mm_div_ps(_mm_sub_ps(h, _mm_sqrt_ps(disc)), a);
+        __m128 ok = _mm_and_ps(_mm_cmpgt_ps(root, t_min),
+                               _mm_cmplt_ps(root, _mm_load_ps(p.t_max + k)));
+
+        _mm_storeu_ps(roots + k, root);
+        mask |= _mm_movemask_ps(ok) << k;
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2"))) inline int
+hit_sphere_packet_avx2(const ray_packet &p, const point3 &center, real r2,
+                       real *roots) {
+    // The whole packet in one 256 bit vector per component
+    const __m256 cx = _mm256_set1_ps(center.x()),
+                 cy = _mm256_set1_ps(center.y()),
+                 cz = _mm256_set1_ps(center.z());
+
+    __m256 dx = _mm256_load_ps(p.dx), dy = _mm256_load_ps(p.dy),
+           dz = _mm256_load_ps(p.dz);
+    __m256 ocx = _mm256_sub_ps(cx, _mm256_load_ps(p.ox));
+    __m256 ocy = _mm256_sub_ps(cy, _mm256_load_ps(p.oy));
+    __m256 ocz = _mm256_sub_ps(cz, _mm256_load_ps(p.oz));
+
+    __m256 a = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+        _mm256_mul_ps(dz, dz));
+    __m256 h = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)),
+        _mm256_mul_ps(dz, ocz));
+    __m256 c = _mm256_sub_ps(
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+            _mm256_mul_ps(ocz, ocz)),
+        _mm256_set1_ps(r2));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(a, c));
+
+    __m256 root = _mm256_div_ps(_mm256_sub_ps(h, _mm256_sqrt_ps(disc)), a);
+    __m256 ok = _mm256_and_ps(
+        _mm256_cmp_ps(root, _mm256_set1_ps(p.t_min), _CMP_GT_OQ),
+        _mm256_cmp_ps(root, _mm256_load_ps(p.t_max), _CMP_LT_OQ));
+
+    _mm256_storeu_ps(roots, root);
+
+    return _mm256_movemask_ps(ok);
+}
+#endif
+
+inline int hit_sphere_packet(simd_level level, const ray_packet &p,
+                             const point3 &center, real r2, real *roots) {
+#ifdef RTW_X86
+    if (level == simd_level::avx2)
+        return hit_sphere_packet_avx2(p, center, r2, roots);
+    if (level == simd_level::sse2)
+        return hit_sphere_packet_sse2(p, center, r2, roots);
+#endif
+
+    return hit_sphere_packet_scalar(p, center, r2, roots);
+}
+
+#endif // !SPHERE_KERNELS_H
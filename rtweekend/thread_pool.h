@@ -0,0 +1,157 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+  public:
+    // A fixed set of workers, each with its own task queue. Workers take
+    // tasks from the front of their own queue and steal from the back of the
+    // others once it runs dry, so a worker stuck on expensive tasks gets
+    // its remaining work picked up by idle ones.
+    explicit thread_pool(int thread_count = 0) {
+        if (thread_count <= 0)
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+        queues = std::vector<work_queue>(thread_count);
+
+        for (int i = 0; i < thread_count; i++)
+            workers.emplace_back([this, i] { worker_loop(i); });
+    };
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            stopping = true;
+        }
+
+        wake.notify_all();
+
+        for (auto &worker : workers)
+            worker.join();
+    };
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    int size() const { return int(queues.size()); };
+
+    void run(int task_count,
+             const std::function<void(int task, int worker)> &task) {
+        // Calls task(i, worker) for every i in [0, task_count) and blocks
+        // until all of them have finished
+        if (task_count <= 0)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            job = &task;
+            pending = task_count;
+        }
+
+        // Deal contiguous blocks so neighbouring tasks start on one worker
+        int worker_count = size();
+
+        for (int w = 0; w < worker_count; w++) {
+            std::lock_guard<std::mutex> lock(queues[w].mutex);
+
+            int begin = int(int64_t(task_count) * w / worker_count);
+            int end = int(int64_t(task_count) * (w + 1) / worker_count);
+
+            for (int i = begin; i < end; i++)
+                queues[w].tasks.push_back(i);
+        }
+
+        std::unique_lock<std::mutex> lock(state_mutex);
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    };
+
+  private:
+    struct work_queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<work_queue> queues;
+
+    std::mutex state_mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)> *job = nullptr;
+    std::atomic<int> pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    void worker_loop(int worker) {
+        uint64_t seen = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(state_mutex);
+                wake.wait(lock,
+                          [&] { return stopping || generation != seen; });
+
+                if (stopping)
+                    return;
+
+                seen = generation;
+            }
+
+            int task;
+
+            while (pop(worker, task) || steal(worker, task)) {
+                (*job)(task, worker);
+
+                if (pending.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    done.notify_all();
+                }
+            }
+        }
+    };
+
+    bool pop(int worker, int &task) {
+        std::lock_guard<std::mutex> lock(queues[worker].mutex);
+
+        if (queues[worker].tasks.empty())
+            return false;
+
+        task = queues[worker].tasks.front();
+        queues[worker].tasks.pop_front();
+
+        return true;
+    };
+
+    bool steal(int thief, int &task) {
+        int worker_count = size();
+
+        for (int offset = 1; offset < worker_count; offset++) {
+            auto &victim = queues[(thief + offset) % worker_count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+
+            if (victim.tasks.empty())
+                continue;
+
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+
+            return true;
+        }
+
+        return false;
+    };
+};
+
+#endif // !THREAD_POOL_H
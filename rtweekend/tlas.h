@@ -0,0 +1,147 @@
+#ifndef TLAS_H
+#define TLAS_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct instance {
+    // A placement of shared geometry. Only the world to object transform is
+    // kept: rays go into object space with it, and its transpose brings
+    // normals back out.
+    static constexpr uint32_t geometry_material = UINT32_MAX;
+
+    transform world_to_object;
+    uint32_t geometry; // index into the tlas geometry
+    uint32_t material; // overrides the geometry's, unless geometry_material
+
+    instance(uint32_t geometry, const transform &object_to_world,
+             uint32_t material = geometry_material)
+        : world_to_object(object_to_world.inverse()), geometry(geometry),
+          material(material) {};
+};
+
+class tlas : public hittable {
+  public:
+    // The top level of a two level hierarchy: a bvh over instances, each
+    // referring to one of a few bottom level structures, usually a
+    // triangle_mesh or a bvh. Memory grows with the unique geometry plus a
+    // small fixed cost per instance.
+    tlas(std::vector<std::shared_ptr<hittable>> geometry_list,
+         std::vector<instance> instance_list)
+        : geometry(std::move(geometry_list)) {
+        std::vector<aabb> boxes;
+        boxes.reserve(instance_list.size());
+
+        for (const auto &inst : instance_list) {
+            aabb local = geometry[inst.geometry]->bounding_box();
+
+            boxes.push_back(inst.world_to_object.inverse().box(local));
+        }
+
+        std::vector<int> order;
+        bvh_builder(boxes).build(nodes, order);
+
+        instances.reserve(order.size());
+
+        for (int index : order)
+            instances.push_back(instance_list[index]);
+
+        nodes.shrink_to_fit();
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        if (instances.empty())
+            return false;
+
+        auto leaf = [&](int first, int count, interval &ray_t) {
+            bool hit_anything = false;
+
+            for (int i = first; i < first + count; i++) {
+                const instance &inst = instances[i];
+                primitive_hit inner;
+
+                // Object space rays keep the same t, so ray_t carries over
+                if (geometry[inst.geometry]->intersect(local_ray(inst, r),
+                                                       ray_t, inner)) {
+                    hit = {inner.t, this, uint32_t(i), inner.prim,
+                           inner.object};
+                    hit_anything = true;
+                    ray_t.max = inner.t;
+                }
+            }
+
+            return hit_anything;
+        };
+
+        return traverse_closest(nodes.data(), r, ray_t, leaf);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        if (instances.empty())
+            return false;
+
+        auto leaf = [&](int first, int count, interval ray_t) {
+            for (int i = first; i < first + count; i++) {
+                const instance &inst = instances[i];
+
+                if (geometry[inst.geometry]->occluded(local_ray(inst, r),
+                                                      ray_t))
+                    return true;
+            }
+
+            return false;
+        };
+
+        return traverse_any(nodes.data(), r, ray_t, leaf);
+    }
+
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        const instance &inst = instances[hit.prim];
+        primitive_hit inner = {hit.t, hit.inner, hit.inner_prim};
+
+        hit.inner->surface(local_ray(inst, r), inner, rec);
+
+        // Orientation survives the transform: the dot product of the ray
+        // and the normal is the same in both spaces
+        vec3 outward = rec.front_face ? rec.normal : -rec.normal;
+
+        rec.t = hit.t;
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(
+            r, unit_vector(inst.world_to_object.transposed_vector(outward)));
+
+        if (inst.material != instance::geometry_material)
+            rec.mat = inst.material;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    size_t instance_count() const { return instances.size(); };
+
+    size_t memory_bytes() const {
+        // Instances and the top level tree, not the geometry they share
+        return instances.capacity() * sizeof(instance) +
+               nodes.capacity() * sizeof(bvh_node);
+    };
+
+  private:
+    std::vector<std::shared_ptr<hittable>> geometry;
+    std::vector<instance> instances;
+    std::vector<bvh_node> nodes;
+
+    static ray local_ray(const instance &inst, const ray &r) {
+        return ray(inst.world_to_object.point(r.origin()),
+                   inst.world_to_object.vector(r.direction()));
+    };
+};
+
+#endif // !TLAS_H
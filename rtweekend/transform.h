@@ -0,0 +1,156 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+#include "rtweekend.h"
+
+#include <cmath>
+
+class transform {
+  public:
+    // An affine map, p -> L p + c, stored as the rows of the 3x4 matrix
+    // [L | c]. Compose with *, where (a * b) applies b first.
+    real m[3][4];
+
+    transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {};
+
+    static transform translate(const vec3 &offset) {
+        transform result;
+
+        for (int i = 0; i < 3; i++)
+            result.m[i][3] = offset[i];
+
+        return result;
+    };
+
+    static transform scale(real factor) {
+        transform result;
+
+        for (int i = 0; i < 3; i++)
+            result.m[i][i] = factor;
+
+        return result;
+    };
+
+    static transform rotate(const vec3 &axis, double degrees) {
+        // Counterclockwise around axis, looking down it towards the origin
+        vec3 u = unit_vector(axis);
+        double theta = degrees_to_radians(degrees);
+        double c = std::cos(theta), s = std::sin(theta), t = 1 - c;
+        double x = u.x(), y = u.y(), z = u.z();
+
+        transform result;
+        result.m[0][0] = real(t * x * x + c);
+        result.m[0][1] = real(t * x * y - s * z);
+        result.m[0][2] = real(t * x * z + s * y);
+        result.m[1][0] = real(t * x * y + s * z);
+        result.m[1][1] = real(t * y * y + c);
+        result.m[1][2] = real(t * y * z - s * x);
+        result.m[2][0] = real(t * x * z - s * y);
+        result.m[2][1] = real(t * y * z + s * x);
+        result.m[2][2] = real(t * z * z + c);
+
+        return result;
+    };
+
+    point3 point(const point3 &p) const {
+        return point3(row(0, p) + m[0][3], row(1, p) + m[1][3],
+                      row(2, p) + m[2][3]);
+    };
+
+    vec3 vector(const vec3 &v) const {
+        return vec3(row(0, v), row(1, v), row(2, v));
+    };
+
+    vec3 transposed_vector(const vec3 &v) const {
+        // L transposed times v. A normal in the space this transform maps to
+        // maps back to the space it maps from this way.
+        return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                    m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                    m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+    };
+
+    transform inverse() const {
+        // The inverse of L from its cofactors, in double whatever real is.
+        // L must not be singular.
+        double a[3][3];
+
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a[i][j] = m[i][j];
+
+        double cof[3][3];
+
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+                int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+
+                cof[i][j] = a[i1][j1] * a[i2][j2] - a[i1][j2] * a[i2][j1];
+            }
+        }
+
+        double det = a[0][0] * cof[0][0] + a[0][1] * cof[0][1] +
+                     a[0][2] * cof[0][2];
+
+        transform result;
+
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                result.m[i][j] = real(cof[j][i] / det);
+
+        for (int i = 0; i < 3; i++) {
+            double c = 0;
+
+            for (int j = 0; j < 3; j++)
+                c -= cof[j][i] / det * m[j][3];
+
+            result.m[i][3] = real(c);
+        }
+
+        return result;
+    };
+
+    aabb box(const aabb &b) const {
+        // The bounds of the transformed box, from its eight corners
+        point3 lo(infinity, infinity, infinity);
+        point3 hi(-infinity, -infinity, -infinity);
+
+        for (int corner = 0; corner < 8; corner++) {
+            point3 p = point(point3(corner & 1 ? b.x.max : b.x.min,
+                                    corner & 2 ? b.y.max : b.y.min,
+                                    corner & 4 ? b.z.max : b.z.min));
+
+            for (int i = 0; i < 3; i++) {
+                lo[i] = std::fmin(lo[i], p[i]);
+                hi[i] = std::fmax(hi[i], p[i]);
+            }
+        }
+
+        return aabb(lo, hi);
+    };
+
+  private:
+    real row(int i, const vec3 &v) const {
+        return m[i][0] * v[0] + m[i][1] * v[1] + m[i][2] * v[2];
+    };
+};
+
+inline transform operator*(const transform &a, const transform &b) {
+    transform result;
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            real sum = j == 3 ? a.m[i][3] : 0;
+
+            for (int k = 0; k < 3; k++)
+                sum += a.m[i][k] * b.m[k][j];
+
+            result.m[i][j] = sum;
+        }
+    }
+
+    return result;
+}
+
+#endif // !TRANSFORM_H
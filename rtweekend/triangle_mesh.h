@@ -0,0 +1,204 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "bvh.h"
+#include "hittable.h"
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct watertight_ray {
+    // A ray sheared so it points down +z (Woop, Benthin and Wald 2013).
+    // Triangles are tested in that 2D projection, where edges shared by two
+    // triangles give exactly opposite edge functions, so no ray slips
+    // through between neighbours.
+    point3 orig;
+    int kx, ky, kz;
+    real sx, sy, sz;
+
+    watertight_ray(const ray &r) : orig(r.origin()) {
+        const vec3 &d = r.direction();
+
+        kz = std::fabs(d.x()) > std::fabs(d.y())
+                 ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                 : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+
+        // Keep the winding of the projection
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    };
+};
+
+inline bool hit_triangle(const watertight_ray &wr, const point3 &v0,
+                         const point3 &v1, const point3 &v2, interval ray_t,
+                         real &t) {
+    // Two sided: hits from either side count
+    vec3 a = v0 - wr.orig;
+    vec3 b = v1 - wr.orig;
+    vec3 c = v2 - wr.orig;
+
+    real ax = a[wr.kx] - wr.sx * a[wr.kz], ay = a[wr.ky] - wr.sy * a[wr.kz];
+    real bx = b[wr.kx] - wr.sx * b[wr.kz], by = b[wr.ky] - wr.sy * b[wr.kz];
+    real cx = c[wr.kx] - wr.sx * c[wr.kz], cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    real u = cx * by - cy * bx;
+    real v = ax * cy - ay * cx;
+    real w = bx * ay - by * ax;
+
+    // An edge function of exactly zero in float is redone in double, which
+    // settles which side of the edge the ray passes
+    if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+        u = real(double(cx) * by - double(cy) * bx);
+        v = real(double(ax) * cy - double(ay) * cx);
+        w = real(double(bx) * ay - double(by) * ax);
+    }
+
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    real det = u + v + w;
+
+    if (det == 0)
+        return false;
+
+    real az = wr.sz * a[wr.kz];
+    real bz = wr.sz * b[wr.kz];
+    real cz = wr.sz * c[wr.kz];
+
+    t = (u * az + v * bz + w * cz) / det;
+
+    return ray_t.surrounds(t);
+}
+
+class triangle_mesh : public hittable {
+  public:
+    // Triangles over a shared vertex buffer, three indices per triangle,
+    // all with one material. They sit behind their own bvh and are
+    // reordered so leaves address contiguous runs of triangles.
+    triangle_mesh(std::vector<point3> vertex_buffer,
+                  std::vector<uint32_t> index_buffer, uint32_t mat)
+        : vertices(std::move(vertex_buffer)),
+          indices(std::move(index_buffer)), mat(mat) {
+        size_t count = indices.size() / 3;
+        indices.resize(3 * count);
+
+        std::vector<aabb> boxes;
+        boxes.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            const point3 &v0 = vertices[indices[3 * i]];
+            const point3 &v1 = vertices[indices[3 * i + 1]];
+            const point3 &v2 = vertices[indices[3 * i + 2]];
+
+            boxes.push_back(aabb(aabb(v0, v1), aabb(v2, v2)));
+        }
+
+        std::vector<int> order;
+        bvh_builder(boxes).build(nodes, order);
+
+        std::vector<uint32_t> sorted(indices.size());
+
+        for (size_t i = 0; i < count; i++)
+            for (int k = 0; k < 3; k++)
+                sorted[3 * i + k] = indices[3 * size_t(order[i]) + k];
+
+        indices = std::move(sorted);
+        nodes.shrink_to_fit();
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        if (indices.empty())
+            return false;
+
+        watertight_ray wr(r);
+
+        auto leaf = [&](int first, int count, interval &ray_t) {
+            bool hit_anything = false;
+
+            for (int i = first; i < first + count; i++) {
+                const uint32_t *tri = &indices[3 * size_t(i)];
+                real t;
+
+                if (hit_triangle(wr, vertices[tri[0]], vertices[tri[1]],
+                                 vertices[tri[2]], ray_t, t)) {
+                    hit = {t, this, uint32_t(i)};
+                    hit_anything = true;
+                    ray_t.max = t;
+                }
+            }
+
+            return hit_anything;
+        };
+
+        return traverse_closest(nodes.data(), r, ray_t, leaf);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override {
+        if (indices.empty())
+            return false;
+
+        watertight_ray wr(r);
+
+        auto leaf = [&](int first, int count, interval ray_t) {
+            for (int i = first; i < first + count; i++) {
+                const uint32_t *tri = &indices[3 * size_t(i)];
+                real t;
+
+                if (hit_triangle(wr, vertices[tri[0]], vertices[tri[1]],
+                                 vertices[tri[2]], ray_t, t))
+                    return true;
+            }
+
+            return false;
+        };
+
+        return traverse_any(nodes.data(), r, ray_t, leaf);
+    }
+
+    void surface(const ray &r, const primitive_hit &hit,
+                 hit_record &rec) const override {
+        // Flat shaded, with the geometric normal of the triangle
+        const uint32_t *tri = &indices[3 * size_t(hit.prim)];
+        const point3 &v0 = vertices[tri[0]];
+
+        rec.t = hit.t;
+        rec.p = r.at(rec.t);
+        vec3 normal = cross(vertices[tri[1]] - v0, vertices[tri[2]] - v0);
+        rec.set_face_normal(r, unit_vector(normal));
+        rec.mat = mat;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    size_t triangle_count() const { return indices.size() / 3; };
+
+    const std::vector<point3> &vertex_buffer() const { return vertices; };
+    const std::vector<uint32_t> &index_buffer() const { return indices; };
+    uint32_t material_id() const { return mat; };
+
+    size_t memory_bytes() const {
+        // Vertex, index and bvh buffers
+        return vertices.capacity() * sizeof(point3) +
+               indices.capacity() * sizeof(uint32_t) +
+               nodes.capacity() * sizeof(bvh_node);
+    };
+
+  private:
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<bvh_node> nodes;
+    uint32_t mat;
+};
+
+#endif // !TRIANGLE_MESH_H
@@ -5,18 +5,27 @@
 
 class vec3 {
   public:
-    double e[3];
+#ifdef RTW_PADDED_VEC3
+    // Padded to four components on a 16 byte boundary, so a vector is one
+    // aligned SIMD load. The fourth component is always zero.
+    alignas(16) real e[4];
+
+    vec3() : e{0, 0, 0, 0} {};
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2, 0} {};
+#else
+    real e[3];
 
     vec3() : e{0, 0, 0} {};
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {};
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {};
+#endif
 
-    double x() const { return this->e[0]; };
-    double y() const { return this->e[1]; };
-    double z() const { return this->e[2]; };
+    real x() const { return this->e[0]; };
+    real y() const { return this->e[1]; };
+    real z() const { return this->e[2]; };
 
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); };
-    double operator[](int i) const { return e[i]; };
-    double &operator[](int i) { return e[i]; };
+    real operator[](int i) const { return e[i]; };
+    real &operator[](int i) { return e[i]; };
 
     vec3 &operator+=(const vec3 &v) {
         e[0] += v.e[0];
@@ -26,7 +35,7 @@ class vec3 {
         return *this;
     }
 
-    vec3 &operator*=(double t) {
+    vec3 &operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
@@ -34,11 +43,11 @@ class vec3 {
         return *this;
     }
 
-    vec3 &operator/=(double t) { return *this *= 1 / t; }
+    vec3 &operator/=(real t) { return *this *= 1 / t; }
 
-    double length() const { return std::sqrt(length_squared()); }
+    real length() const { return std::sqrt(length_squared()); }
 
-    double length_squared() const {
+    real length_squared() const {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
@@ -80,19 +89,19 @@ inline vec3 operator-(const vec3 &u, const vec3 &v) {
     return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
+inline vec3 operator*(real t, const vec3 &v) {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &v, double t) { return t * v; };
+inline vec3 operator*(const vec3 &v, real t) { return t * v; };
 
 inline vec3 operator*(const vec3 &v, const vec3 &u) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 };
 
-inline vec3 operator/(const vec3 &v, double t) { return (1 / t) * v; }
+inline vec3 operator/(const vec3 &v, real t) { return (1 / t) * v; }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+inline real dot(const vec3 &u, const vec3 &v) {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
@@ -106,15 +115,31 @@ inline vec3 unit_vector(const vec3 &v) { return v / v.length(); }
 
 inline vec3 random_unit_vector() {
     while (true) {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
+        // Draw two candidates per batch, about half of them get rejected
+        double u[6];
+        random_doubles(u, 6);
+
+        for (int i = 0; i < 6; i += 3) {
+            auto p = vec3(2 * u[i] - 1, 2 * u[i + 1] - 1, 2 * u[i + 2] - 1);
+            auto lensq = p.length_squared();
 
-        if (1e-160 < lensq && lensq <= 1) {
-            return p / sqrt(lensq);
+            if (1e-160 < lensq && lensq <= 1) {
+                return p / sqrt(lensq);
+            }
         }
     }
 }
 
+inline vec3 sample_unit_vector(const vec3 &u) {
+    // Maps a point of [0, 1)^2 onto the unit sphere with equal area, so
+    // stratified inputs stay stratified on the sphere
+    auto z = 1 - 2 * u.x();
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u.y();
+
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
 inline vec3 random_on_hemisphere(const vec3 &normal) {
     vec3 on_unit_sphere = random_unit_vector();
 
@@ -129,7 +154,7 @@ inline vec3 reflect(const vec3 &v, const vec3 &n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
+inline vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat) {
     auto cos_theta = std::fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
     vec3 r_out_parallel =
@@ -140,11 +165,39 @@ inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
 
 inline vec3 random_in_unit_disk() {
     while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        // Draw two candidates per batch, about a fifth of them get rejected
+        double u[4];
+        random_doubles(u, 4);
+
+        for (int i = 0; i < 4; i += 2) {
+            auto p = vec3(2 * u[i] - 1, 2 * u[i + 1] - 1, 0);
+
+            if (p.length_squared() < 1)
+                return p;
+        }
+    }
+}
+
+inline vec3 sample_unit_disk(const vec3 &u) {
+    // Shirley-Chiu concentric mapping of [0, 1)^2 onto the unit disk, keeps
+    // neighbouring samples neighbours unlike rejection sampling
+    auto a = 2 * u.x() - 1;
+    auto b = 2 * u.y() - 1;
 
-        if (p.length_squared() < 1)
-            return p;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    real r, theta;
+
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
     }
+
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
 }
 
 #endif // !VEC3_H
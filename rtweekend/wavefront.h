@@ -0,0 +1,105 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "hittable.h"
+#include "material.h"
+#include "pixel_estimate.h"
+
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+struct sample_run {
+    // The next count samples of pixel (i, j), added to estimate
+    int i, j, count;
+    pixel_estimate *estimate;
+};
+
+struct wavefront_sample {
+    // Which sample of which pixel a path in a wavefront belongs to
+    int i, j, sample;
+    pixel_estimate *estimate;
+};
+
+class wavefront_batch {
+  public:
+    // The paths of one wavefront, traced a bounce at a time: every path is
+    // intersected, the hits are bucketed by material kind, each kind's
+    // scatter runs over its whole queue and the surviving paths are
+    // compacted for the next bounce. State lives in one array per field,
+    // indexed by path, and the queues hold path indices in path order.
+    static constexpr int material_kinds = int(std::variant_size_v<material>);
+
+    std::vector<wavefront_sample> samples;
+    std::vector<ray> rays;
+    std::vector<color> throughput;
+    std::vector<hit_record> hits;
+    std::vector<color> radiance;     // light gathered by each path
+    std::vector<double> scatter_pdf; // as in path_state
+
+    // The first diffuse hit of each path, or what it ended on before one
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+    std::vector<uint8_t> has_features;
+
+    std::vector<uint32_t> active;                 // paths still going
+    std::vector<uint32_t> queues[material_kinds]; // active hits by kind
+    std::vector<uint8_t> alive;                   // cleared as paths finish
+
+    void start(size_t count) {
+        // Sizes every array for count paths, keeping their capacity from
+        // batch to batch
+        samples.resize(count);
+        rays.resize(count);
+        throughput.assign(count, color(1, 1, 1));
+        hits.resize(count);
+        radiance.assign(count, color(0, 0, 0));
+        scatter_pdf.assign(count, 0);
+        albedo.resize(count);
+        normal.resize(count);
+        has_features.assign(count, 0);
+        alive.assign(count, 1);
+        active.resize(count);
+
+        for (size_t p = 0; p < count; p++)
+            active[p] = uint32_t(p);
+    };
+
+    void record_features(uint32_t p, const color &a, const vec3 &n) {
+        // Only a path's first record counts
+        if (has_features[p])
+            return;
+
+        albedo[p] = a;
+        normal[p] = n;
+        has_features[p] = 1;
+    };
+
+    void finish(uint32_t p, const color &c, const color &a, const vec3 &n) {
+        radiance[p] += c;
+        record_features(p, a, n);
+    };
+
+    void bucket(const material_table &materials) {
+        // Splits the active paths by the material kind they hit, keeping
+        // path order within each queue
+        for (auto &queue : queues)
+            queue.clear();
+
+        for (uint32_t p : active)
+            queues[materials.kind(hits[p].mat)].push_back(p);
+    };
+
+    void compact() {
+        // Drops the paths that finished, keeping path order
+        size_t kept = 0;
+
+        for (uint32_t p : active)
+            if (alive[p])
+                active[kept++] = p;
+
+        active.resize(kept);
+    };
+};
+
+#endif // !WAVEFRONT_H
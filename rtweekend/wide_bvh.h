@@ -0,0 +1,256 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+#include "wide_node_kernels.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+template <int W> class wide_bvh : public hittable {
+  public:
+    // A bvh collapsed to W children per node, 4 or 8, with the child boxes
+    // quantized to bytes. A node is a fraction of the size of the binary
+    // nodes it replaces and all its children are tested in one go, so
+    // traversal reads much less memory per ray.
+    static_assert(W == 4 || W == 8);
+
+    wide_bvh(const hittable_list &list) : wide_bvh(list.objects) {};
+
+    wide_bvh(const std::vector<std::shared_ptr<hittable>> &src_objects) {
+        std::vector<aabb> boxes;
+        boxes.reserve(src_objects.size());
+
+        for (const auto &object : src_objects)
+            boxes.push_back(object->bounding_box());
+
+        std::vector<bvh_node> binary;
+        std::vector<int> order;
+        bvh_builder(boxes).build(binary, order);
+
+        objects.reserve(order.size());
+
+        for (int index : order)
+            objects.push_back(src_objects[index]);
+
+        if (!objects.empty())
+            collapse(binary);
+    };
+
+    bool intersect(const ray &r, interval ray_t,
+                   primitive_hit &hit) const override {
+        if (objects.empty())
+            return false;
+
+        struct entry {
+            uint32_t ref;
+            uint32_t count; // primitives of a leaf, 0 for a node
+            float t;
+        };
+
+        simd_level level = active_simd_level();
+        wide_ray wr(r);
+        float t_min = float(ray_t.min);
+        entry stack[W * bvh_builder::max_depth];
+        int stack_size = 0;
+        bool hit_anything = false;
+        uint64_t box_tests = 0, primitive_tests = 0;
+
+        stack[stack_size++] = {0, 0, t_min};
+
+        while (stack_size > 0) {
+            entry e = stack[--stack_size];
+
+            if (e.t > ray_t.max)
+                continue;
+
+            if (e.count > 0) {
+                primitive_tests += e.count;
+
+                for (uint32_t i = e.ref; i < e.ref + e.count; i++) {
+                    if (objects[i]->intersect(r, ray_t, hit)) {
+                        hit_anything = true;
+                        ray_t.max = hit.t;
+                    }
+                }
+
+                continue;
+            }
+
+            const wide_node<W> &node = nodes[e.ref];
+            float t_enter[W];
+            box_tests += std::popcount(unsigned(node.valid));
+            int mask = wide_node_hits(level, node, wr, t_min,
+                                      upper_bound(ray_t.max), t_enter);
+
+            // Push the children farthest first, so the nearest is next
+            int first = stack_size;
+
+            for (; mask != 0; mask &= mask - 1) {
+                int i = std::countr_zero(unsigned(mask));
+                entry child = {node.child[i], node.count[i], t_enter[i]};
+                int j = stack_size++;
+
+                for (; j > first && stack[j - 1].t < child.t; j--)
+                    stack[j] = stack[j - 1];
+
+                stack[j] = child;
+            }
+        }
+
+        count_traversal(box_tests, primitive_tests);
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); };
+
+    size_t memory_bytes() const {
+        return nodes.capacity() * sizeof(wide_node<W>);
+    };
+
+  private:
+    std::vector<wide_node<W>> nodes;
+    std::vector<std::shared_ptr<hittable>> objects;
+    aabb bbox;
+
+    static float upper_bound(real t) {
+        // t rounded up to single precision, so no box is cut off early
+        float f = float(t);
+
+        return f < t ? std::nextafter(f, infinity) : f;
+    };
+
+    void collapse(const std::vector<bvh_node> &binary) {
+        // Each wide node takes the children of a binary node, then keeps
+        // opening its largest interior child until it has W children or
+        // only leaves
+        bbox = binary[0].bbox;
+
+        struct task {
+            int binary;
+            uint32_t wide;
+        };
+
+        std::vector<task> pending = {{0, 0}};
+        nodes.push_back({});
+
+        while (!pending.empty()) {
+            auto [b, w] = pending.back();
+            pending.pop_back();
+
+            int children[W];
+            int n = 0;
+
+            if (binary[b].is_leaf()) {
+                children[n++] = b;
+            } else {
+                children[n++] = binary[b].first;
+                children[n++] = binary[b].first + 1;
+            }
+
+            while (n < W) {
+                int largest = -1;
+                real largest_area = -1;
+
+                for (int i = 0; i < n; i++) {
+                    const bvh_node &c = binary[children[i]];
+                    real area = c.bbox.surface_area();
+
+                    if (!c.is_leaf() && area > largest_area) {
+                        largest = i;
+                        largest_area = area;
+                    }
+                }
+
+                if (largest < 0)
+                    break;
+
+                int opened = children[largest];
+                children[largest] = binary[opened].first;
+                children[n++] = binary[opened].first + 1;
+            }
+
+            wide_node<W> node = {};
+            quantize(node, binary[b].bbox, binary, children, n);
+
+            for (int i = 0; i < n; i++) {
+                const bvh_node &c = binary[children[i]];
+
+                if (c.is_leaf()) {
+                    node.child[i] = uint32_t(c.first);
+                    node.count[i] = uint8_t(c.count);
+                } else {
+                    node.child[i] = uint32_t(nodes.size());
+                    pending.push_back({children[i], node.child[i]});
+                    nodes.push_back({});
+                }
+            }
+
+            nodes[w] = node;
+        }
+
+        nodes.shrink_to_fit();
+    };
+
+    static void quantize(wide_node<W> &node, const aabb &parent,
+                         const std::vector<bvh_node> &binary,
+                         const int *children, int n) {
+        // A power of two grid of 255 steps from the parent's minimum, with
+        // every child rounded outwards until its dequantized box contains
+        // the real one
+        node.valid = uint8_t((1u << n) - 1);
+
+        for (int a = 0; a < 3; a++) {
+            const interval &range = parent.axis_interval(a);
+            float origin = float(range.min);
+
+            if (origin > range.min)
+                origin = std::nextafter(origin, -infinity);
+
+            int e = -126;
+            double extent = double(range.max) - origin;
+
+            if (extent > 0)
+                e = std::max(e, int(std::ceil(std::log2(extent / 255))));
+
+            while (e < 127 &&
+                   wide_node<W>::dequantize(origin, wide_node<W>::scale(e),
+                                            255) < range.max)
+                e++;
+
+            float s = wide_node<W>::scale(e);
+            node.origin[a] = origin;
+            node.exponent[a] = int8_t(e);
+
+            for (int i = 0; i < n; i++) {
+                const interval &c = binary[children[i]].bbox.axis_interval(a);
+                double lo = std::floor((double(c.min) - origin) / s);
+                double hi = std::ceil((double(c.max) - origin) / s);
+                int q_lo = int(std::clamp(lo, 0.0, 255.0));
+                int q_hi = int(std::clamp(hi, 0.0, 255.0));
+
+                while (q_lo > 0 &&
+                       wide_node<W>::dequantize(origin, s, q_lo) > c.min)
+                    q_lo--;
+
+                while (q_hi < 255 &&
+                       wide_node<W>::dequantize(origin, s, q_hi) < c.max)
+                    q_hi++;
+
+                node.lo[a][i] = uint8_t(q_lo);
+                node.hi[a][i] = uint8_t(q_hi);
+            }
+        }
+    };
+};
+
+#endif // !WIDE_BVH_H
@@ -0,0 +1,196 @@
+#ifndef WIDE_NODE_KERNELS_H
+#define WIDE_NODE_KERNELS_H
+
+#include "ray.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+template <int W> struct alignas(16) wide_node {
+    // W child boxes quantized to 8 bits on a grid over the node's own box:
+    // a child spans origin + lo * 2^exponent to origin + hi * 2^exponent
+    // along each axis, always rounded outwards. Bit i of valid marks slot i
+    // in use. child is a node index, or the first primitive of a leaf child
+    // holding count primitives.
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t valid;
+    uint8_t lo[3][W];
+    uint8_t hi[3][W];
+    uint32_t child[W];
+    uint8_t count[W]; // 0 for child nodes
+
+    static float scale(int e) {
+        // 2^e, for e in [-126, 127]
+        return std::bit_cast<float>(uint32_t(e + 127) << 23);
+    };
+
+    static float dequantize(float origin, float scale, uint8_t q) {
+        // Exactly as the kernels compute it: q * scale is exact, so only the
+        // sum rounds
+        return origin + float(q) * scale;
+    };
+};
+
+struct wide_ray {
+    // The ray in single precision, for the quantized slab tests
+    float orig[3];
+    float inv_dir[3];
+
+    wide_ray(const ray &r) {
+        for (int a = 0; a < 3; a++) {
+            orig[a] = float(r.origin()[a]);
+            inv_dir[a] = 1 / float(r.direction()[a]);
+        }
+    };
+};
+
+// Slab tests of a ray against all the children of a wide node at once. Each
+// returns a mask of the children the ray enters inside [t_min, t_max] and
+// their entry distances. Exit distances are scaled up by a few ulps so the
+// single precision test never misses a box the ray touches.
+constexpr float wide_exit_scale = 1 + 2 * 3 * 0x1p-24f / (1 - 3 * 0x1p-24f);
+
+template <int W>
+inline int wide_node_hits_scalar(const wide_node<W> &node, const wide_ray &r,
+                                 float t_min, float t_max, float *t_enter) {
+    float enter[W], exit[W];
+    std::fill(enter, enter + W, t_min);
+    std::fill(exit, exit + W, t_max);
+
+    for (int a = 0; a < 3; a++) {
+        float s = wide_node<W>::scale(node.exponent[a]);
+
+        for (int i = 0; i < W; i++) {
+            float org = node.origin[a];
+            float lo = wide_node<W>::dequantize(org, s, node.lo[a][i]);
+            float hi = wide_node<W>::dequantize(org, s, node.hi[a][i]);
+            float t0 = (lo - r.orig[a]) * r.inv_dir[a];
+            float t1 = (hi - r.orig[a]) * r.inv_dir[a];
+
+            // A NaN from a zero direction component leaves the axis out
+            float near = t0 < t1 ? t0 : t1;
+            float far = (t0 > t1 ? t0 : t1) * wide_exit_scale;
+            enter[i] = enter[i] < near ? near : enter[i];
+            exit[i] = exit[i] > far ? far : exit[i];
+        }
+    }
+
+    int mask = 0;
+
+    for (int i = 0; i < W; i++) {
+        t_enter[i] = enter[i];
+        mask |= (enter[i] <= exit[i]) << i;
+    }
+
+    return mask & node.valid;
+}
+
+#ifdef RTW_X86
+inline int wide_node_hits_sse2(const float origin[3], const int8_t exponent[3],
+                               const uint8_t *lo, const uint8_t *hi,
+                               int stride, const wide_ray &r, float t_min,
+                               float t_max, float *t_enter) {
+    // Four children, whose quantized bounds for axis a start at lo + a *
+    // stride and hi + a * stride
+    __m128 enter = _mm_set1_ps(t_min);
+    __m128 exit = _mm_set1_ps(t_max);
+    const __m128 exit_scale = _mm_set1_ps(wide_exit_scale);
+    const __m128i zero = _mm_setzero_si128();
+
+    auto widen = [&](const uint8_t *q) {
+        int32_t bytes;
+        std::memcpy(&bytes, q, 4);
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    };
+
+    for (int a = 0; a < 3; a++) {
+        __m128 org = _mm_set1_ps(origin[a]);
+        __m128 s = _mm_set1_ps(wide_node<4>::scale(exponent[a]));
+        __m128 o = _mm_set1_ps(r.orig[a]);
+        __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+
+        __m128 box_lo = _mm_add_ps(org, _mm_mul_ps(widen(lo + a * stride), s));
+        __m128 box_hi = _mm_add_ps(org, _mm_mul_ps(widen(hi + a * stride), s));
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(box_lo, o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(box_hi, o), inv);
+
+        // With a NaN the second operand wins, keeping the running bounds
+        enter = _mm_max_ps(_mm_min_ps(t0, t1), enter);
+        exit = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), exit_scale), exit);
+    }
+
+    _mm_storeu_ps(t_enter, enter);
+
+    return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+}
+
+__attribute__((target("avx2"))) inline int
+wide_node_hits_avx2(const wide_node<8> &node, const wide_ray &r, float t_min,
+                    float t_max, float *t_enter) {
+    __m256 enter = _mm256_set1_ps(t_min);
+    __m256 exit = _mm256_set1_ps(t_max);
+    const __m256 exit_scale = _mm256_set1_ps(wide_exit_scale);
+
+    auto widen = [&](const uint8_t *q) __attribute__((target("avx2"))) {
+        __m128i bytes = _mm_loadl_epi64((const __m128i *)q);
+
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    };
+
+    for (int a = 0; a < 3; a++) {
+        __m256 org = _mm256_set1_ps(node.origin[a]);
+        __m256 s = _mm256_set1_ps(wide_node<8>::scale(node.exponent[a]));
+        __m256 o = _mm256_set1_ps(r.orig[a]);
+        __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+
+        __m256 box_lo = _mm256_add_ps(org, _mm256_mul_ps(widen(node.lo[a]), s));
+        __m256 box_hi = _mm256_add_ps(org, _mm256_mul_ps(widen(node.hi[a]), s));
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(box_lo, o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(box_hi, o), inv);
+
+        enter = _mm256_max_ps(_mm256_min_ps(t0, t1), enter);
+        exit = _mm256_min_ps(
+            _mm256_mul_ps(_mm256_max_ps(t0, t1), exit_scale), exit);
+    }
+
+    _mm256_storeu_ps(t_enter, enter);
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ)) &
+           node.valid;
+}
+#endif
+
+template <int W>
+inline int wide_node_hits(simd_level level, const wide_node<W> &node,
+                          const wide_ray &r, float t_min, float t_max,
+                          float *t_enter) {
+#ifdef RTW_X86
+    if constexpr (W == 8) {
+        if (level == simd_level::avx2)
+            return wide_node_hits_avx2(node, r, t_min, t_max, t_enter);
+    }
+
+    if (level != simd_level::scalar) {
+        // Four children per SSE2 test
+        int mask = 0;
+
+        for (int i = 0; i < W; i += 4)
+            mask |= wide_node_hits_sse2(node.origin, node.exponent,
+                                        &node.lo[0][i], &node.hi[0][i], W, r,
+                                        t_min, t_max, t_enter + i)
+                    << i;
+
+        return mask & node.valid;
+    }
+#endif
+
+    return wide_node_hits_scalar(node, r, t_min, t_max, t_enter);
+}
+
+#endif // !WIDE_NODE_KERNELS_H